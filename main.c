@@ -19,6 +19,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include "rbt.h"
 #include "rbt_util.h"
@@ -59,24 +63,25 @@ void my_free_redblack_entry(redblack_queue_entry *entry)
 	free(entry);
 }
 
+// ia - ib would overflow for keys more than 2^63 apart
 int64_t my_int_compare(void *a, void *b)
 {
 	int64_t ia = (int64_t) a;
 	int64_t ib = (int64_t) b;
-	return ia - ib;
+	return (ia > ib) - (ia < ib);
 }
 
 
 typedef struct _int_randomizer {
 	int *array;
-	int num_items;
-	int num_to_consider;
+	uint64_t num_items;
+	uint64_t num_to_consider;
 } int_randomizer;
 
-int * allocate_items(int num_items)
+int * allocate_items(uint64_t num_items)
 {
 	int *arr = (int *) malloc(num_items * sizeof(int));
-	int i;
+	uint64_t i;
 	
 	for (i = 0 ; i < num_items ; ++i)
 		arr[i] = i;
@@ -84,7 +89,7 @@ int * allocate_items(int num_items)
 	return arr;
 }
 
-int_randomizer * allocate_randomizer(int num_items)
+int_randomizer * allocate_randomizer(uint64_t num_items)
 {
 	int_randomizer *r;
 
@@ -104,7 +109,7 @@ void reset_randomizer(int_randomizer *r)
 int get_random(int_randomizer *r)
 {
 	int temp;
-	int index = rand() % r->num_to_consider;
+	uint64_t index = rand() % r->num_to_consider;
 	--r->num_to_consider;
 
 	temp = r->array[index];
@@ -181,6 +186,34 @@ int is_redblack_tree(redblack_tree *t)
 	return red_rule && black_rule;
 }
 
+/*
+** Rank Rule: every rank difference, parent minus child with NULL at
+**            rank -1, is 1 or 2.
+** Leaf Rule: leaves have rank 0.
+*/
+int is_wavl_node(redblack_tree_node *node)
+{
+	int left = node->left ? node->left->color : -1;
+	int right = node->right ? node->right->color : -1;
+
+	if (node->color - left < 1 || node->color - left > 2 ||
+	    node->color - right < 1 || node->color - right > 2)
+		return 0;
+	if (!node->left && !node->right && node->color)
+		return 0;
+	if ((node->left && node->left->parent != node) ||
+	    (node->right && node->right->parent != node))
+		return 0;
+
+	return (!node->left || is_wavl_node(node->left)) &&
+	       (!node->right || is_wavl_node(node->right));
+}
+
+int is_wavl_tree(redblack_tree *t)
+{
+	return !t->root || (!t->root->parent && is_wavl_node(t->root));
+}
+
 void visualize_calc_widths(redblack_tree_node *node, void *context)
 {
 	int64_t width = 0;
@@ -194,10 +227,10 @@ void visualize_calc_widths(redblack_tree_node *node, void *context)
 	node->context = (void *) (12 + width/2);
 }
 
-void visualize_print_tree(redblack_tree_node *node, void *context, int level)
+void visualize_print_tree(redblack_tree_node *node, void *context, uint64_t level)
 {
 	char fmt[32];
-	int *last_level = (int *) context;
+	uint64_t *last_level = (uint64_t *) context;
 
 	if (level != *last_level) {
 		printf("\n");
@@ -213,7 +246,7 @@ void visualize_print_tree(redblack_tree_node *node, void *context, int level)
 
 void visualize_tree(redblack_tree *t)
 {
-	int last_level = 0;
+	uint64_t last_level = 0;
 	redblack_tree_post_order(t, visualize_calc_widths, NULL);
 	redblack_tree_level_order(t, visualize_print_tree, &last_level);
 	printf("\n\n");
@@ -252,7 +285,7 @@ void insert_and_remove_stress(void)
 				item = get_random(r);
 				redblack_tree_insert(&t, (void *) (int64_t) item);
 				assert(is_redblack_tree(&t));
-				assert(redblack_tree_num_items(&t) == (uint32_t)i+1);
+				assert(redblack_tree_num_items(&t) == (uint64_t)i+1);
 			}
 
 			reset_randomizer(r);
@@ -265,7 +298,7 @@ void insert_and_remove_stress(void)
 				item = get_random(r);
 				redblack_tree_remove(&t, (void *) (int64_t) item);
 				assert(is_redblack_tree(&t));
-				assert(redblack_tree_num_items(&t) == ((uint32_t)num_items - ((uint32_t)i+1)));
+				assert(redblack_tree_num_items(&t) == ((uint64_t)num_items - ((uint64_t)i+1)));
 			}
 #endif
 			free_randomizer(r);
@@ -405,7 +438,7 @@ void sequence_visitor(redblack_tree_node *node, void *context)
 	assert(seq->item_sequence[seq->i++] == (int) (int64_t) node->item);
 }
 
-void sequence_visitor_level(redblack_tree_node *node, void *context, int level)
+void sequence_visitor_level(redblack_tree_node *node, void *context, uint64_t level)
 {
 	visit_sequence *seq = (visit_sequence *) context;
 	(void) level;
@@ -511,10 +544,2939 @@ void other_coverage(void)
 	ror(NULL, NULL);
 }
 
+int64_t my_int_value(void *item)
+{
+	return (int64_t) item;
+}
+
+int64_t my_sum_combine(int64_t a, int64_t b)
+{
+	return a + b;
+}
+
+int64_t my_min_combine(int64_t a, int64_t b)
+{
+	return redblack_tree_min(a, b);
+}
+
+int64_t naive_range_sum(int *present, int num_items, int lo, int hi)
+{
+	int64_t sum = 0;
+	int i;
+
+	for (i = lo ; i <= hi && i < num_items ; ++i)
+		if (i >= 0 && present[i])
+			sum += i;
+
+	return sum;
+}
+
+void test_aggregate(void)
+{
+	redblack_tree t;
+	redblack_tree_aggregate sum = { 0, my_int_value, my_sum_combine };
+	redblack_tree_aggregate min = { INT64_MAX, my_int_value, my_min_combine };
+	int num_items = 200;
+	int present[200] = { 0 };
+	int_randomizer *r;
+	int item;
+	int lo;
+	int i;
+
+	redblack_tree_init(&t, 
+		      my_allocate_redblack_node,
+		      my_free_redblack_node,
+		      my_int_compare,
+		      my_allocate_redblack_entry,
+		      my_free_redblack_entry);
+
+	// no aggregate registered
+	assert(0 == redblack_tree_range_aggregate(&t, (void *) 0, (void *) 10));
+
+	// registering on a populated tree computes the existing subtrees
+	for (i = 0 ; i < 10 ; ++i)
+		assert(redblack_tree_insert(&t, (void *) (int64_t) i));
+	assert(redblack_tree_set_aggregate(&t, &sum));
+	assert(45 == t.root->aggregate);
+	redblack_tree_destroy(&t);
+
+	r = allocate_randomizer(num_items);
+
+	for (i = 0 ; i < num_items ; ++i) {
+		item = get_random(r);
+		assert(redblack_tree_insert(&t, (void *) (int64_t) item));
+		present[item] = 1;
+		lo = rand() % num_items;
+		assert(naive_range_sum(present, num_items, lo, lo + 37) ==
+		       redblack_tree_range_aggregate(&t, (void *) (int64_t) lo,
+						     (void *) (int64_t) (lo + 37)));
+	}
+
+	assert(redblack_tree_range_aggregate(&t, (void *) 0, (void *) 199) ==
+	       199 * 200 / 2);
+	// empty and inverted ranges
+	assert(0 == redblack_tree_range_aggregate(&t, (void *) 300, (void *) 400));
+	assert(0 == redblack_tree_range_aggregate(&t, (void *) 20, (void *) 10));
+
+	assert(redblack_tree_set_aggregate(&t, &min));
+	assert(0 == t.root->aggregate);
+	assert(17 == redblack_tree_range_aggregate(&t, (void *) 17, (void *) 50));
+	assert(redblack_tree_set_aggregate(&t, &sum));
+
+	reset_randomizer(r);
+
+	for (i = 0 ; i < num_items ; ++i) {
+		item = get_random(r);
+		assert(redblack_tree_remove(&t, (void *) (int64_t) item));
+		present[item] = 0;
+		lo = rand() % num_items;
+		assert(naive_range_sum(present, num_items, lo, lo + 37) ==
+		       redblack_tree_range_aggregate(&t, (void *) (int64_t) lo,
+						     (void *) (int64_t) (lo + 37)));
+	}
+
+	assert(!t.root);
+	free_randomizer(r);
+
+	assert(redblack_tree_set_aggregate(&t, NULL));
+	assert(0 == redblack_tree_range_aggregate(&t, (void *) 0, (void *) 10));
+	redblack_tree_destroy(&t);
+}
+
+typedef struct _my_interval {
+	int64_t start;
+	int64_t end;
+} my_interval;
+
+int64_t my_interval_start(void *item)
+{
+	return ((my_interval *) item)->start;
+}
+
+int64_t my_interval_end(void *item)
+{
+	return ((my_interval *) item)->end;
+}
+
+int64_t my_interval_compare(void *a, void *b)
+{
+	my_interval *ia = (my_interval *) a;
+	my_interval *ib = (my_interval *) b;
+
+	if (ia->start != ib->start)
+		return ia->start < ib->start ? -1 : 1;
+	if (ia->end != ib->end)
+		return ia->end < ib->end ? -1 : 1;
+	return 0;
+}
+
+typedef struct _interval_hits {
+	int num_hits;
+	int64_t last_start;
+} interval_hits;
+
+void interval_visitor(redblack_tree_node *node, void *context)
+{
+	interval_hits *hits = (interval_hits *) context;
+	my_interval *iv = (my_interval *) node->item;
+
+	// visited in order
+	assert(iv->start >= hits->last_start);
+	hits->last_start = iv->start;
+	++hits->num_hits;
+}
+
+void test_interval(void)
+{
+	redblack_tree t;
+	my_interval intervals[300];
+	interval_hits hits;
+	int num_items = 300;
+	int64_t a;
+	int64_t b;
+	int expected;
+	int i;
+	int j;
+
+	redblack_tree_init(&t, 
+		      my_allocate_redblack_node,
+		      my_free_redblack_node,
+		      my_interval_compare,
+		      my_allocate_redblack_entry,
+		      my_free_redblack_entry);
+	assert(redblack_tree_set_interval(&t, my_interval_start, my_interval_end));
+
+	for (i = 0 ; i < num_items ; ++i) {
+		intervals[i].start = rand() % 1000;
+		intervals[i].end = intervals[i].start + 1 + rand() % 50;
+		if (!redblack_tree_insert(&t, &intervals[i]))
+			intervals[i].end = intervals[i].start; // duplicate, mark empty
+	}
+
+	for (j = 0 ; j < 200 ; ++j) {
+		a = rand() % 1100;
+		b = a + 1 + rand() % 30;
+
+		expected = 0;
+		for (i = 0 ; i < num_items ; ++i)
+			if (intervals[i].start < intervals[i].end &&
+			    intervals[i].start < b && intervals[i].end > a)
+				++expected;
+
+		hits.num_hits = 0;
+		hits.last_start = INT64_MIN;
+		redblack_tree_overlap(&t, a, b, interval_visitor, &hits);
+		assert(expected == hits.num_hits);
+
+		expected = 0;
+		for (i = 0 ; i < num_items ; ++i)
+			if (intervals[i].start < intervals[i].end &&
+			    intervals[i].start <= a && intervals[i].end > a)
+				++expected;
+
+		hits.num_hits = 0;
+		hits.last_start = INT64_MIN;
+		redblack_tree_stab(&t, a, interval_visitor, &hits);
+		assert(expected == hits.num_hits);
+
+		// remove some intervals as we go
+		i = rand() % num_items;
+		if (intervals[i].end > intervals[i].start) {
+			assert(redblack_tree_remove(&t, &intervals[i]));
+			intervals[i].end = intervals[i].start;
+		}
+	}
+
+	hits.num_hits = 0;
+	redblack_tree_stab(&t, INT64_MAX, interval_visitor, &hits);
+	assert(0 == hits.num_hits);
+
+	// interval queries are disabled with the interval mode
+	assert(redblack_tree_set_interval(&t, NULL, NULL));
+	redblack_tree_overlap(&t, 0, 2000, interval_visitor, &hits);
+	assert(0 == hits.num_hits);
+
+	redblack_tree_destroy(&t);
+}
+
+typedef struct _memory_stream {
+	uint8_t buf[8192];
+	size_t len;
+	size_t pos;
+} memory_stream;
+
+int memory_stream_write(void *context, const void *buf, size_t len)
+{
+	memory_stream *m = (memory_stream *) context;
+
+	if (m->len + len > sizeof(m->buf))
+		return 0;
+	memcpy(m->buf + m->len, buf, len);
+	m->len += len;
+	return 1;
+}
+
+int memory_stream_read(void *context, void *buf, size_t len)
+{
+	memory_stream *m = (memory_stream *) context;
+
+	if (m->pos + len > m->len)
+		return 0;
+	memcpy(buf, m->buf + m->pos, len);
+	m->pos += len;
+	return 1;
+}
+
+int my_save_item(redblack_tree_stream *s, void *item)
+{
+	int32_t i = (int32_t) (int64_t) item;
+	return s->write(s->context, &i, sizeof(i));
+}
+
+int my_load_item(redblack_tree_stream *s, void **item)
+{
+	int32_t i;
+
+	if (!s->read(s->context, &i, sizeof(i)))
+		return 0;
+	*item = (void *) (int64_t) i;
+	return 1;
+}
+
+int64_t my_item_key(void *item)
+{
+	return (int64_t) item;
+}
+
+void * my_key_item(int64_t key)
+{
+	return (void *) key;
+}
+
+uint64_t my_item_hash(void *item)
+{
+	return (uint64_t) (int64_t) item;
+}
+
+void item_visitor(redblack_tree_node *node, void *context)
+{
+	memory_stream *m = (memory_stream *) context;
+	int64_t item = (int64_t) node->item;
+
+	memory_stream_write(m, &item, sizeof(item));
+}
+
+void shape_visitor(redblack_tree_node *node, void *context)
+{
+	memory_stream *m = (memory_stream *) context;
+	int64_t item = (int64_t) node->item;
+
+	memory_stream_write(m, &item, sizeof(item));
+	memory_stream_write(m, &node->color, sizeof(node->color));
+}
+
+int64_t my_int64_ptr_compare(void *a, void *b)
+{
+	int64_t ia = *(int64_t *) a;
+	int64_t ib = *(int64_t *) b;
+	return (ia > ib) - (ia < ib);
+}
+
+static int released_items;
+static int live_boxes; // loaded by boxed_load_item, not yet released
+
+void count_free_item(void *item)
+{
+	(void) item;
+	++released_items;
+}
+
+// items owned by the tree's user, boxed on the heap
+int boxed_save_item(redblack_tree_stream *s, void *item)
+{
+	return my_save_item(s, (void *) *(int64_t *) item);
+}
+
+int boxed_load_item(redblack_tree_stream *s, void **item)
+{
+	void *value;
+	int64_t *box;
+
+	if (!my_load_item(s, &value))
+		return 0;
+	box = (int64_t *) malloc(sizeof(int64_t));
+	if (!box)
+		return 0;
+	*box = (int64_t) value;
+	*item = box;
+	++live_boxes;
+	return 1;
+}
+
+void boxed_free_item(void *item)
+{
+	++released_items;
+	--live_boxes;
+	free(item);
+}
+
+// unboxed keys, counted like boxes
+void * tracked_key_item(int64_t key)
+{
+	++live_boxes;
+	return (void *) key;
+}
+
+void tracked_free_item(void *item)
+{
+	(void) item;
+	--live_boxes;
+}
+
+void free_item_visitor(redblack_tree_node *node, void *context)
+{
+	(void) context;
+	--live_boxes;
+	free(node->item);
+}
+
+void test_serialize(void)
+{
+	redblack_tree t;
+	redblack_tree u;
+	redblack_tree_codec codec = { my_save_item, my_load_item,
+				      my_item_key, my_key_item };
+	redblack_tree_codec boxed = { boxed_save_item, boxed_load_item, NULL, NULL,
+				      boxed_free_item };
+	redblack_tree_stream s;
+	int64_t values[100];
+	memory_stream *m;
+	memory_stream *shape_t;
+	memory_stream *shape_u;
+	int flags[4] = { RBT_SAVE_IN_ORDER, RBT_SAVE_PRE_ORDER,
+			 RBT_SAVE_IN_ORDER | RBT_SAVE_DELTA,
+			 RBT_SAVE_PRE_ORDER | RBT_SAVE_DELTA };
+	size_t full_len;
+	int num_items;
+	int f;
+	int i;
+
+	m = (memory_stream *) calloc(1, sizeof(memory_stream));
+	shape_t = (memory_stream *) calloc(1, sizeof(memory_stream));
+	shape_u = (memory_stream *) calloc(1, sizeof(memory_stream));
+
+	s.write = memory_stream_write;
+	s.read = memory_stream_read;
+	s.context = m;
+
+	redblack_tree_init(&t, 
+		      my_allocate_redblack_node,
+		      my_free_redblack_node,
+		      my_int_compare,
+		      my_allocate_redblack_entry,
+		      my_free_redblack_entry);
+	redblack_tree_init(&u, 
+		      my_allocate_redblack_node,
+		      my_free_redblack_node,
+		      my_int_compare,
+		      my_allocate_redblack_entry,
+		      my_free_redblack_entry);
+
+	for (num_items = 0 ; num_items < 70 ; ++num_items) {
+		int_randomizer *r = allocate_randomizer(num_items);
+
+		for (i = 0 ; i < num_items ; ++i)
+			redblack_tree_insert(&t, (void *) (int64_t) (get_random(r) * 3 - 50));
+		free_randomizer(r);
+
+		for (f = 0 ; f < 4 ; ++f) {
+			m->len = m->pos = 0;
+			assert(redblack_tree_save(&t, &s, &codec, flags[f]));
+			assert(redblack_tree_load(&u, &s, &codec));
+			assert(m->pos == m->len);
+			assert(is_redblack_tree(&u));
+			assert(redblack_tree_num_items(&u) == (uint64_t) num_items);
+
+			// same items
+			shape_t->len = shape_u->len = 0;
+			redblack_tree_in_order(&t, item_visitor, shape_t);
+			redblack_tree_in_order(&u, item_visitor, shape_u);
+			assert(shape_t->len == shape_u->len);
+			assert(!memcmp(shape_t->buf, shape_u->buf, shape_t->len));
+
+			if (flags[f] & RBT_SAVE_PRE_ORDER) {
+				// same shape and colors
+				shape_t->len = shape_u->len = 0;
+				redblack_tree_pre_order(&t, shape_visitor, shape_t);
+				redblack_tree_pre_order(&u, shape_visitor, shape_u);
+				assert(!memcmp(shape_t->buf, shape_u->buf, shape_t->len));
+			}
+
+			if (num_items) {
+				// loading requires an empty tree
+				m->pos = 0;
+				assert(!redblack_tree_load(&u, &s, &codec));
+				redblack_tree_destroy(&u);
+
+				// a truncated stream leaves the tree empty
+				full_len = m->len;
+				m->len = full_len - 1;
+				m->pos = 0;
+				assert(!redblack_tree_load(&u, &s, &codec));
+				assert(!u.root);
+				m->len = full_len;
+			}
+		}
+
+		redblack_tree_destroy(&t);
+	}
+
+	// bad header
+	m->len = m->pos = 0;
+	memory_stream_write(m, "XYZ\1\0\0\0\0\0\0\0\0\0", 13);
+	assert(!redblack_tree_load(&u, &s, &codec));
+
+	// a failed load hands every item it loaded back to the codec
+	redblack_tree_init(&t, 
+		      my_allocate_redblack_node,
+		      my_free_redblack_node,
+		      my_int64_ptr_compare,
+		      my_allocate_redblack_entry,
+		      my_free_redblack_entry);
+	redblack_tree_init(&u, 
+		      my_allocate_redblack_node,
+		      my_free_redblack_node,
+		      my_int64_ptr_compare,
+		      my_allocate_redblack_entry,
+		      my_free_redblack_entry);
+	for (i = 0 ; i < 100 ; ++i) {
+		values[i] = i;
+		assert(redblack_tree_insert(&t, &values[i]));
+	}
+	for (f = 0 ; f < 2 ; ++f) {
+		m->len = m->pos = 0;
+		assert(redblack_tree_save(&t, &s, &boxed, flags[f]));
+		full_len = m->len;
+		for (m->len = 13 ; m->len < full_len ; m->len += 7) {
+			m->pos = 0;
+			assert(!redblack_tree_load(&u, &s, &boxed));
+			assert(!u.root && 0 == live_boxes);
+		}
+		m->len = full_len;
+		m->pos = 0;
+		assert(redblack_tree_load(&u, &s, &boxed));
+		assert(100 == live_boxes);
+		redblack_tree_in_order(&u, free_item_visitor, NULL);
+		redblack_tree_destroy(&u);
+	}
+
+	// pre-order shape bytes that disagree with the count
+	m->buf[5] = 99;
+	m->pos = 0;
+	assert(!redblack_tree_load(&u, &s, &boxed));
+	assert(!u.root && 0 == live_boxes);
+	m->buf[5] = 101;
+	m->pos = 0;
+	assert(!redblack_tree_load(&u, &s, &boxed));
+	assert(!u.root && 0 == live_boxes);
+	redblack_tree_destroy(&t);
+
+	free(m);
+	free(shape_t);
+	free(shape_u);
+}
+
+// items from 1000 on can't be encoded
+int fussy_save_item(redblack_tree_stream *s, void *item)
+{
+	return (int64_t) item < 1000 && my_save_item(s, item);
+}
+
+// a record with an op neither insert nor remove, and a valid check
+void write_bad_record(const char *path)
+{
+	uint8_t record[13] = { 3, 4, 0, 0, 0, 1, 0, 0, 0 };
+	uint32_t h = 2166136261u;
+	FILE *fp;
+	int i;
+
+	for (i = 0 ; i < 9 ; ++i) {
+		h ^= record[i];
+		h *= 16777619u;
+	}
+	for (i = 0 ; i < 4 ; ++i)
+		record[9 + i] = (uint8_t) (h >> (8 * i));
+
+	fp = fopen(path, "ab");
+	assert(fp);
+	assert(1 == fwrite(record, sizeof(record), 1, fp));
+	fclose(fp);
+}
+
+void test_journal(void)
+{
+	redblack_tree t;
+	redblack_tree u;
+	redblack_tree_journal j;
+	redblack_tree_codec codec = { my_save_item, my_load_item, NULL, NULL };
+	redblack_tree_codec fussy = { fussy_save_item, my_load_item, NULL, NULL };
+	redblack_tree_codec counted = { my_save_item, my_load_item, NULL, NULL,
+					count_free_item };
+	redblack_tree_codec boxed = { boxed_save_item, boxed_load_item, NULL, NULL,
+				      boxed_free_item };
+	int64_t values[10];
+	redblack_tree b;
+	redblack_tree_stream s;
+	memory_stream *m;
+	memory_stream *items_t;
+	memory_stream *items_u;
+	char path[] = "/tmp/rbt_journal_XXXXXX";
+	int fd;
+	int i;
+
+	m = (memory_stream *) calloc(1, sizeof(memory_stream));
+	items_t = (memory_stream *) calloc(1, sizeof(memory_stream));
+	items_u = (memory_stream *) calloc(1, sizeof(memory_stream));
+
+	s.write = memory_stream_write;
+	s.read = memory_stream_read;
+	s.context = m;
+
+	fd = mkstemp(path);
+	assert(fd >= 0);
+	close(fd);
+
+	redblack_tree_init(&t, 
+		      my_allocate_redblack_node,
+		      my_free_redblack_node,
+		      my_int_compare,
+		      my_allocate_redblack_entry,
+		      my_free_redblack_entry);
+	redblack_tree_init(&u, 
+		      my_allocate_redblack_node,
+		      my_free_redblack_node,
+		      my_int_compare,
+		      my_allocate_redblack_entry,
+		      my_free_redblack_entry);
+
+	assert(redblack_tree_journal_open(&j, &t, path, &codec, 16));
+
+	for (i = 0 ; i < 100 ; ++i)
+		assert(redblack_tree_journal_insert(&j, (void *) (int64_t) i));
+	assert(!redblack_tree_journal_insert(&j, (void *) (int64_t) 5));
+
+	// snapshot, then journal only what follows
+	assert(redblack_tree_save(&t, &s, &codec, RBT_SAVE_PRE_ORDER));
+	assert(redblack_tree_journal_commit(&j));
+	assert(redblack_tree_journal_truncate(&j));
+
+	for (i = 0 ; i < 100 ; i += 3)
+		assert(redblack_tree_journal_remove(&j, (void *) (int64_t) i));
+	assert(!redblack_tree_journal_remove(&j, (void *) (int64_t) 0));
+	for (i = 100 ; i < 150 ; ++i)
+		assert(redblack_tree_journal_insert(&j, (void *) (int64_t) i));
+	assert(redblack_tree_journal_close(&j));
+
+	// recover: last snapshot, then the log
+	assert(redblack_tree_load(&u, &s, &codec));
+	assert(redblack_tree_journal_replay(&u, path, &codec));
+	assert(is_redblack_tree(&u));
+
+	redblack_tree_in_order(&t, item_visitor, items_t);
+	redblack_tree_in_order(&u, item_visitor, items_u);
+	assert(items_t->len == items_u->len);
+	assert(!memcmp(items_t->buf, items_u->buf, items_t->len));
+	redblack_tree_destroy(&u);
+
+	// over the final state every record is a remove or a duplicate insert
+	released_items = 0;
+	assert(redblack_tree_journal_replay(&t, path, &counted));
+	assert(34 + 50 == released_items);
+	assert(is_redblack_tree(&t));
+	assert(116 == redblack_tree_num_items(&t));
+
+	// a torn record ends the replay: 13 byte records, 4 complete removes
+	assert(0 == truncate(path, 5 * 13 - 1));
+	m->pos = 0;
+	assert(redblack_tree_load(&u, &s, &codec));
+	assert(redblack_tree_journal_replay(&u, path, &codec));
+	assert(96 == redblack_tree_num_items(&u));
+	assert(!redblack_tree_find(&u, (void *) (int64_t) 9));
+	assert(redblack_tree_find(&u, (void *) (int64_t) 12));
+	redblack_tree_destroy(&u);
+
+	// a change that can't be logged is not made, nor any after it
+	assert(redblack_tree_journal_open(&j, &t, path, &fussy, 1));
+	assert(!redblack_tree_journal_insert(&j, (void *) (int64_t) 1000));
+	assert(j.error);
+	assert(!redblack_tree_find(&t, (void *) (int64_t) 1000));
+	assert(!redblack_tree_journal_remove(&j, (void *) (int64_t) 1));
+	assert(redblack_tree_find(&t, (void *) (int64_t) 1));
+	assert(!redblack_tree_journal_close(&j));
+
+	// a failed group commit leaves the change ahead of the log
+	assert(redblack_tree_journal_open(&j, &t, path, &codec, 1));
+	close(j.fd);
+	j.fd = -1;
+	assert(!redblack_tree_journal_insert(&j, (void *) (int64_t) 1001));
+	assert(j.error);
+	assert(redblack_tree_find(&t, (void *) (int64_t) 1001));
+	assert(!redblack_tree_journal_close(&j));
+
+	// a replayed remove releases the item it takes out of the tree too
+	assert(0 == truncate(path, 0));
+	redblack_tree_init(&b, 
+		      my_allocate_redblack_node,
+		      my_free_redblack_node,
+		      my_int64_ptr_compare,
+		      my_allocate_redblack_entry,
+		      my_free_redblack_entry);
+	assert(redblack_tree_journal_open(&j, &b, path, &boxed, 0));
+	for (i = 0 ; i < 10 ; ++i) {
+		values[i] = i;
+		assert(redblack_tree_journal_insert(&j, &values[i]));
+	}
+	for (i = 0 ; i < 10 ; i += 2)
+		assert(redblack_tree_journal_remove(&j, &values[i]));
+	assert(redblack_tree_journal_close(&j));
+	redblack_tree_destroy(&b);
+
+	released_items = 0;
+	assert(redblack_tree_journal_replay(&b, path, &boxed));
+	assert(5 * 2 == released_items);
+	assert(5 == redblack_tree_num_items(&b));
+
+	// an unknown op is a corrupt record, not one to replay as a remove
+	write_bad_record(path);
+	released_items = 0;
+	assert(!redblack_tree_journal_replay(&b, path, &boxed));
+	assert(5 + 5 * 2 == released_items);
+	assert(5 == redblack_tree_num_items(&b));
+	assert(is_redblack_tree(&b));
+	redblack_tree_in_order(&b, free_item_visitor, NULL);
+	redblack_tree_destroy(&b);
+
+	unlink(path);
+	assert(redblack_tree_journal_replay(&u, path, &codec));
+	assert(!u.root);
+
+	redblack_tree_destroy(&t);
+	free(m);
+	free(items_t);
+	free(items_u);
+}
+
+void test_stats(void)
+{
+	redblack_tree t;
+	redblack_tree_stats stats;
+	uint64_t cases;
+	int i;
+
+	redblack_tree_init(&t, 
+		      my_allocate_redblack_node,
+		      my_free_redblack_node,
+		      my_int_compare,
+		      my_allocate_redblack_entry,
+		      my_free_redblack_entry);
+
+	for (i = 0 ; i < 1000 ; ++i)
+		assert(redblack_tree_insert(&t, (void *) (int64_t) i));
+	assert(!redblack_tree_insert(&t, (void *) (int64_t) 7));
+	assert(redblack_tree_find(&t, (void *) (int64_t) 500));
+	for (i = 0 ; i < 1000 ; i += 2)
+		assert(redblack_tree_remove(&t, (void *) (int64_t) i));
+	assert(500 == redblack_tree_num_items(&t));
+
+#ifdef RBT_STATS
+	assert(redblack_tree_get_stats(&t, &stats));
+	assert(1001 == stats.inserts);
+	assert(500 == stats.removes);
+	assert(1 == stats.finds);
+	assert(1000 == stats.allocations);
+	assert(500 == stats.frees);
+	assert(stats.rotations > 0);
+	assert(stats.compares >= stats.descent_depth);
+	assert(stats.max_depth <= 2 * 10); // 2 * log2(1000 + 1)
+
+	// every insert that allocated ends in exactly one terminal case
+	cases = stats.insert_cases[0] + stats.insert_cases[1] + stats.insert_cases[4];
+	assert(cases == stats.allocations);
+	assert(stats.insert_cases[3] <= stats.insert_cases[4]);
+
+	redblack_tree_reset_stats(&t);
+	assert(redblack_tree_get_stats(&t, &stats));
+	assert(0 == stats.inserts);
+#else
+	(void) cases;
+	assert(!redblack_tree_get_stats(&t, &stats));
+	assert(0 == stats.inserts);
+#endif // RBT_STATS
+
+	redblack_tree_destroy(&t);
+	assert(0 == redblack_tree_num_items(&t));
+}
+
+void count_red_visitor(redblack_tree_node *node, void *context)
+{
+	if (node->color == RBT_RED)
+		++*(int *) context;
+}
+
+void test_analyze(void)
+{
+	redblack_tree t;
+	redblack_tree_report report;
+	uint64_t histogram_total;
+	int_randomizer *r;
+	int num_red = 0;
+	int i;
+
+	redblack_tree_init(&t, 
+		      my_allocate_redblack_node,
+		      my_free_redblack_node,
+		      my_int_compare,
+		      my_allocate_redblack_entry,
+		      my_free_redblack_entry);
+
+	redblack_tree_analyze(&t, &report);
+	assert(0 == report.num_nodes);
+	assert(0 == report.height);
+	assert(0 == report.black_height);
+	assert(sizeof(redblack_tree_node) == report.node_bytes);
+	assert(report.alloc_bytes > report.node_bytes);
+
+	r = allocate_randomizer(1000);
+	for (i = 0 ; i < 1000 ; ++i)
+		redblack_tree_insert(&t, (void *) (int64_t) get_random(r));
+	free_randomizer(r);
+
+	redblack_tree_analyze(&t, &report);
+	assert(1000 == report.num_nodes);
+	assert(redblack_tree_height(&t) == report.height);
+	// the helpers count the black NULL leaf as well
+	assert(rbt_min_black_nodes(t.root) - 1 == (int) report.black_height);
+
+	histogram_total = 0;
+	for (i = 0 ; i < RBT_REPORT_MAX_DEPTH ; ++i)
+		histogram_total += report.depth_histogram[i];
+	assert(1000 == histogram_total);
+	assert(1 == report.depth_histogram[0]);
+	assert(2 == report.depth_histogram[1]);
+	assert(report.avg_depth > 1.0 && report.avg_depth < report.height);
+
+	redblack_tree_in_order(&t, count_red_visitor, &num_red);
+	assert(report.red_ratio * 1000 > num_red - 0.5 &&
+	       report.red_ratio * 1000 < num_red + 0.5);
+
+	assert(report.line_changes >= report.page_changes);
+	assert(report.line_changes <= 1.0);
+	assert(report.parent_page_changes <= 1.0);
+
+	redblack_tree_destroy(&t);
+}
+
+void test_trace(void)
+{
+	redblack_tree t;
+	redblack_tree_trace trace;
+	redblack_tree_trace_record record;
+	char path[] = "/tmp/rbt_trace_XXXXXX";
+	uint64_t last_ns = 0;
+	int fd;
+	int i;
+
+	fd = mkstemp(path);
+	assert(fd >= 0);
+	close(fd);
+
+	redblack_tree_init(&t, 
+		      my_allocate_redblack_node,
+		      my_free_redblack_node,
+		      my_int_compare,
+		      my_allocate_redblack_entry,
+		      my_free_redblack_entry);
+
+	assert(!redblack_tree_trace_stop(&t));
+	assert(redblack_tree_trace_start(&t, &trace, path, my_item_key));
+
+	// enough records to flush the trace buffer several times
+	for (i = -1000 ; i < 1000 ; ++i) {
+		redblack_tree_insert(&t, (void *) (int64_t) (i * 1000003));
+		redblack_tree_find(&t, (void *) (int64_t) (i * 1000003 + (i & 1)));
+		if (i & 2)
+			redblack_tree_remove(&t, (void *) (int64_t) (i * 1000003));
+	}
+	assert(redblack_tree_trace_stop(&t));
+	assert(!t.trace);
+
+	// no longer recorded
+	redblack_tree_insert(&t, (void *) (int64_t) 1);
+
+	assert(redblack_tree_trace_open(&trace, path));
+	for (i = -1000 ; i < 1000 ; ++i) {
+		assert(redblack_tree_trace_next(&trace, &record));
+		assert(RBT_TRACE_INSERT == record.op);
+		assert(1 == record.result);
+		assert(i * 1000003 == record.key);
+		assert(record.time_ns >= last_ns);
+		last_ns = record.time_ns;
+
+		assert(redblack_tree_trace_next(&trace, &record));
+		assert(RBT_TRACE_FIND == record.op);
+		assert(((i & 1) ? 0 : 1) == record.result);
+		assert(i * 1000003 + (i & 1) == record.key);
+
+		if (i & 2) {
+			assert(redblack_tree_trace_next(&trace, &record));
+			assert(RBT_TRACE_REMOVE == record.op);
+			assert(1 == record.result);
+		}
+	}
+	assert(!redblack_tree_trace_next(&trace, &record));
+	redblack_tree_trace_close(&trace);
+
+	unlink(path);
+	assert(!redblack_tree_trace_open(&trace, path));
+
+	redblack_tree_destroy(&t);
+}
+
+typedef struct _order_check {
+	int64_t last;
+	uint64_t count;
+} order_check;
+
+void order_visitor(redblack_tree_node *node, void *context)
+{
+	order_check *check = (order_check *) context;
+
+	assert(!check->count || (int64_t) node->item > check->last);
+	check->last = (int64_t) node->item;
+	++check->count;
+}
+
+void level_order_visitor(redblack_tree_node *node, void *context, uint64_t level)
+{
+	order_check *check = (order_check *) context;
+
+	assert(level < 64);
+	order_visitor(node, check);
+}
+
+void test_btree(void)
+{
+	redblack_tree t;
+	redblack_tree_stream s;
+	redblack_tree_codec codec = { my_save_item, my_load_item,
+				      my_item_key, my_key_item };
+	redblack_tree_codec tracked = { my_save_item, my_load_item,
+					my_item_key, tracked_key_item,
+					tracked_free_item };
+	memory_stream *m;
+	order_check check;
+	redblack_tree_aggregate sum = { 0, my_int_value, my_sum_combine };
+	size_t full_len;
+	int num_items = 3000;
+	char *present;
+	int expected = 0;
+	int item;
+	int i;
+
+	present = (char *) calloc(num_items, 1);
+	m = (memory_stream *) calloc(1, sizeof(memory_stream));
+	s.write = memory_stream_write;
+	s.read = memory_stream_read;
+	s.context = m;
+
+	redblack_tree_init(&t, 
+		      my_allocate_redblack_node,
+		      my_free_redblack_node,
+		      my_int_compare,
+		      my_allocate_redblack_entry,
+		      my_free_redblack_entry);
+
+	assert(!redblack_tree_set_backend(&t, RBT_BACKEND_BTREE, NULL));
+	assert(redblack_tree_set_backend(&t, RBT_BACKEND_BTREE, my_item_key));
+
+	// leaves keep no aggregates
+	assert(!redblack_tree_set_aggregate(&t, &sum));
+	assert(!redblack_tree_set_interval(&t, my_interval_start, my_interval_end));
+	assert(!t.aggregate.combine && !t.interval_start);
+	assert(redblack_tree_set_aggregate(&t, NULL));
+
+	assert(!redblack_tree_find(&t, (void *) 1));
+	assert(!redblack_tree_remove(&t, (void *) 1));
+	assert(0 == redblack_tree_height(&t));
+
+	// random mix, enough to split and merge several levels
+	for (i = 0 ; i < 40000 ; ++i) {
+		item = rand() % num_items;
+		if (rand() % 3) {
+			assert(redblack_tree_insert(&t, (void *) (int64_t) item) == !present[item]);
+			if (!present[item])
+				++expected;
+			present[item] = 1;
+		} else {
+			assert(redblack_tree_remove(&t, (void *) (int64_t) item) == present[item]);
+			if (present[item])
+				--expected;
+			present[item] = 0;
+		}
+		assert(redblack_tree_num_items(&t) == (uint64_t) expected);
+	}
+
+	for (i = 0 ; i < num_items ; ++i) {
+		redblack_tree_node *n = redblack_tree_find(&t, (void *) (int64_t) i);
+		assert(!n == !present[i]);
+		assert(!n || n->item == (void *) (int64_t) i);
+	}
+
+	// not while items are stored
+	assert(!redblack_tree_set_backend(&t, RBT_BACKEND_REDBLACK, NULL));
+	assert(redblack_tree_height(&t) >= 2 && redblack_tree_height(&t) <= 4);
+
+	check.count = 0;
+	redblack_tree_in_order(&t, order_visitor, &check);
+	assert(check.count == expected);
+	check.count = 0;
+	redblack_tree_pre_order(&t, order_visitor, &check);
+	assert(check.count == expected);
+	check.count = 0;
+	redblack_tree_post_order(&t, order_visitor, &check);
+	assert(check.count == expected);
+	check.count = 0;
+	redblack_tree_level_order(&t, level_order_visitor, &check);
+	assert(check.count == expected);
+
+	// in-order saves load into either backend, pre-order needs red-black
+	assert(!redblack_tree_save(&t, &s, &codec, RBT_SAVE_PRE_ORDER));
+	m->len = 0;
+	assert(redblack_tree_save(&t, &s, &codec, RBT_SAVE_IN_ORDER | RBT_SAVE_DELTA));
+	redblack_tree_destroy(&t);
+	assert(0 == redblack_tree_num_items(&t));
+	assert(!redblack_tree_find(&t, (void *) 1));
+
+	// a truncated stream leaves the tree empty, configured as it was
+	assert(redblack_tree_set_hash_index(&t, my_item_hash));
+	assert(redblack_tree_set_filter(&t, 100, 0.01, my_item_hash));
+	full_len = m->len;
+	m->len = full_len / 2;
+	m->pos = 0;
+	live_boxes = 0;
+	assert(!redblack_tree_load(&t, &s, &tracked));
+	assert(0 == live_boxes);
+	assert(t.btree_key && t.hash_item && t.filter);
+	assert(!t.btree && 0 == redblack_tree_num_items(&t));
+	m->len = full_len;
+	m->pos = 0;
+
+	assert(redblack_tree_load(&t, &s, &codec));
+	assert(redblack_tree_num_items(&t) == (uint64_t) expected);
+	for (i = 0 ; i < num_items ; ++i)
+		assert(!redblack_tree_find(&t, (void *) (int64_t) i) == !present[i]);
+	check.count = 0;
+	redblack_tree_in_order(&t, order_visitor, &check);
+	assert(check.count == expected);
+
+	// remove everything, collapsing the tree level by level
+	for (i = 0 ; i < num_items ; ++i)
+		assert(redblack_tree_remove(&t, (void *) (int64_t) i) == present[i]);
+	assert(0 == redblack_tree_num_items(&t));
+	assert(0 == redblack_tree_height(&t));
+
+	// extreme keys
+	assert(redblack_tree_insert(&t, (void *) INT64_MAX));
+	assert(redblack_tree_insert(&t, (void *) INT64_MIN));
+	for (i = 0 ; i < 100 ; ++i)
+		assert(redblack_tree_insert(&t, (void *) (int64_t) (INT64_MAX - 1 - i)));
+	assert(!redblack_tree_insert(&t, (void *) INT64_MAX));
+	assert(redblack_tree_find(&t, (void *) INT64_MAX));
+	assert(redblack_tree_find(&t, (void *) INT64_MIN));
+	assert(redblack_tree_remove(&t, (void *) INT64_MAX));
+	assert(!redblack_tree_find(&t, (void *) INT64_MAX));
+
+	t.allocate_node = null_allocate_redblack_node;
+	assert(!redblack_tree_insert(&t, (void *) 5));
+	t.allocate_node = my_allocate_redblack_node;
+
+	redblack_tree_destroy(&t);
+	assert(redblack_tree_set_backend(&t, RBT_BACKEND_REDBLACK, NULL));
+
+	free(present);
+	free(m);
+}
+
+// few distinct hashes, so that most probes collide
+uint64_t my_weak_item_hash(void *item)
+{
+	return (uint64_t) (int64_t) item % 8;
+}
+
+void test_hash(void)
+{
+	uint64_t (*hashes[2])(void * ) = { my_item_hash, my_weak_item_hash };
+	redblack_tree t;
+	redblack_tree_stream s;
+	redblack_tree_codec codec = { my_save_item, my_load_item,
+				      my_item_key, my_key_item };
+	memory_stream *m;
+	int num_items = 2000;
+	char *present;
+	int expected;
+	int backend;
+	int item;
+	int h;
+	int i;
+
+	present = (char *) malloc(num_items);
+	m = (memory_stream *) calloc(1, sizeof(memory_stream));
+	s.write = memory_stream_write;
+	s.read = memory_stream_read;
+	s.context = m;
+
+	for (backend = 0 ; backend < 2 ; ++backend) {
+		for (h = 0 ; h < 2 ; ++h) {
+			redblack_tree_init(&t, 
+				      my_allocate_redblack_node,
+				      my_free_redblack_node,
+				      my_int_compare,
+				      my_allocate_redblack_entry,
+				      my_free_redblack_entry);
+			if (backend)
+				assert(redblack_tree_set_backend(&t, RBT_BACKEND_BTREE, my_item_key));
+
+			memset(present, 0, num_items);
+			expected = 0;
+
+			// the index may be enabled on a populated tree
+			for (i = 0 ; i < num_items / 4 ; ++i) {
+				item = rand() % num_items;
+				if (redblack_tree_insert(&t, (void *) (int64_t) item)) {
+					present[item] = 1;
+					++expected;
+				}
+			}
+			assert(redblack_tree_set_hash_index(&t, hashes[h]));
+
+			for (i = 0 ; i < 20000 ; ++i) {
+				item = rand() % num_items;
+				if (rand() % 2) {
+					assert(redblack_tree_insert(&t, (void *) (int64_t) item) == !present[item]);
+					expected += !present[item];
+					present[item] = 1;
+				} else {
+					assert(redblack_tree_remove(&t, (void *) (int64_t) item) == present[item]);
+					expected -= present[item];
+					present[item] = 0;
+				}
+				item = rand() % num_items;
+				assert(!redblack_tree_find(&t, (void *) (int64_t) item) == !present[item]);
+			}
+			assert(redblack_tree_num_items(&t) == (uint64_t) expected);
+			if (!backend)
+				assert(is_redblack_tree(&t));
+
+			for (i = 0 ; i < num_items ; ++i) {
+				redblack_tree_node *n = redblack_tree_find(&t, (void *) (int64_t) i);
+				assert(!n == !present[i]);
+				assert(!n || n->item == (void *) (int64_t) i);
+			}
+
+			// destroy empties the index, load rebuilds it
+			m->len = 0;
+			m->pos = 0;
+			assert(redblack_tree_save(&t, &s, &codec, RBT_SAVE_IN_ORDER | RBT_SAVE_DELTA));
+			redblack_tree_destroy(&t);
+			assert(!redblack_tree_find(&t, (void *) (int64_t) 0));
+			assert(redblack_tree_insert(&t, (void *) (int64_t) 0));
+			assert(redblack_tree_find(&t, (void *) (int64_t) 0));
+			redblack_tree_destroy(&t);
+			assert(redblack_tree_load(&t, &s, &codec));
+			for (i = 0 ; i < num_items ; ++i)
+				assert(!redblack_tree_find(&t, (void *) (int64_t) i) == !present[i]);
+
+			// dropping the index falls back to the tree
+			assert(redblack_tree_set_hash_index(&t, NULL));
+			for (i = 0 ; i < num_items ; ++i)
+				assert(!redblack_tree_find(&t, (void *) (int64_t) i) == !present[i]);
+
+			redblack_tree_destroy(&t);
+		}
+	}
+
+	free(present);
+	free(m);
+}
+
+void test_cache(void)
+{
+	redblack_tree t;
+	int num_items = 1000;
+	char *present;
+	uint64_t hits;
+	uint64_t misses;
+	int backend;
+	int item;
+	int i;
+
+	present = (char *) malloc(num_items);
+
+	for (backend = 0 ; backend < 2 ; ++backend) {
+		redblack_tree_init(&t, 
+			      my_allocate_redblack_node,
+			      my_free_redblack_node,
+			      my_int_compare,
+			      my_allocate_redblack_entry,
+			      my_free_redblack_entry);
+		if (backend)
+			assert(redblack_tree_set_backend(&t, RBT_BACKEND_BTREE, my_item_key));
+
+		// few slots, so that cold keys keep evicting hot ones
+		assert(redblack_tree_set_cache(&t, 33, my_item_hash));
+		assert(t.cache_mask == 63);
+
+		memset(present, 0, num_items);
+		for (i = 0 ; i < num_items ; ++i) {
+			assert(redblack_tree_insert(&t, (void *) (int64_t) i));
+			present[i] = 1;
+		}
+
+		// most finds hit a handful of hot keys, while the hot keys and
+		// their neighbours keep being removed and inserted again
+		for (i = 0 ; i < 50000 ; ++i) {
+			redblack_tree_node *n;
+
+			item = rand() % 10 ? rand() % 8 : rand() % num_items;
+			if (!(rand() % 64)) {
+				item = rand() % 24;
+				if (present[item])
+					assert(redblack_tree_remove(&t, (void *) (int64_t) item));
+				else
+					assert(redblack_tree_insert(&t, (void *) (int64_t) item));
+				present[item] = !present[item];
+				// hot keys come straight back, in a new node
+				if (item < 8 && !present[item]) {
+					assert(redblack_tree_insert(&t, (void *) (int64_t) item));
+					present[item] = 1;
+				}
+				continue;
+			}
+			n = redblack_tree_find(&t, (void *) (int64_t) item);
+			assert(!n == !present[item]);
+			assert(!n || n->item == (void *) (int64_t) item);
+		}
+
+		redblack_tree_get_cache_stats(&t, &hits, &misses);
+		assert(hits > misses);
+		if (!backend)
+			assert(is_redblack_tree(&t));
+
+		// destroy removes the cache
+		redblack_tree_destroy(&t);
+		assert(!t.cache);
+		redblack_tree_get_cache_stats(&t, &hits, &misses);
+		assert(!hits && !misses);
+		assert(!redblack_tree_find(&t, (void *) 1));
+	}
+
+	free(present);
+}
+
+void count_level_visitor(redblack_tree_node *node, void *context, uint64_t level)
+{
+	(void) node;
+	(void) level;
+	++*(uint64_t *) context;
+}
+
+void test_tombstone(void)
+{
+	redblack_tree t;
+	redblack_tree_aggregate sum = { 0, my_int_value, my_sum_combine };
+	redblack_tree_stream s;
+	redblack_tree_codec codec = { my_save_item, my_load_item,
+				      my_item_key, my_key_item };
+	memory_stream *m;
+	order_check check;
+	int num_items = 1000;
+	int *present;
+	int expected = 0;
+	uint64_t visited;
+	int item;
+	int lo;
+	int i;
+
+	present = (int *) calloc(num_items, sizeof(int));
+	m = (memory_stream *) calloc(1, sizeof(memory_stream));
+	s.write = memory_stream_write;
+	s.read = memory_stream_read;
+	s.context = m;
+
+	redblack_tree_init(&t, 
+		      my_allocate_redblack_node,
+		      my_free_redblack_node,
+		      my_int_compare,
+		      my_allocate_redblack_entry,
+		      my_free_redblack_entry);
+
+	assert(redblack_tree_set_aggregate(&t, &sum));
+	assert(redblack_tree_set_hash_index(&t, my_item_hash));
+	assert(redblack_tree_set_lazy_remove(&t, 30));
+
+	for (i = 0 ; i < 30000 ; ++i) {
+		item = rand() % num_items;
+		if (rand() % 2) {
+			assert(redblack_tree_insert(&t, (void *) (int64_t) item) == !present[item]);
+			expected += !present[item];
+			present[item] = 1;
+		} else {
+			assert(redblack_tree_remove(&t, (void *) (int64_t) item) == present[item]);
+			expected -= present[item];
+			present[item] = 0;
+		}
+		assert(redblack_tree_num_items(&t) == (uint64_t) expected);
+		assert(t.tombstones * 100 <= 30 * (t.tombstones + expected));
+
+		if (!(i % 1000)) {
+			assert(is_redblack_tree(&t));
+			lo = rand() % num_items;
+			assert(redblack_tree_range_aggregate(&t, (void *) (int64_t) lo,
+							     (void *) (int64_t) (lo + 100)) ==
+			       naive_range_sum(present, num_items, lo, lo + 100));
+		}
+	}
+
+	for (i = 0 ; i < num_items ; ++i)
+		assert(!redblack_tree_find(&t, (void *) (int64_t) i) == !present[i]);
+
+	check.count = 0;
+	redblack_tree_in_order(&t, order_visitor, &check);
+	assert(check.count == expected);
+	visited = 0;
+	redblack_tree_level_order(&t, count_level_visitor, &visited);
+	assert(visited == expected);
+
+	// compaction only when asked
+	assert(redblack_tree_set_lazy_remove(&t, 100));
+	for (i = 0 ; i < num_items ; i += 2) {
+		assert(redblack_tree_remove(&t, (void *) (int64_t) i) == present[i]);
+		expected -= present[i];
+		present[i] = 0;
+	}
+	assert(t.tombstones);
+	assert(!redblack_tree_set_backend(&t, RBT_BACKEND_BTREE, my_item_key));
+	redblack_tree_compact(&t);
+	assert(!t.tombstones);
+	assert(is_redblack_tree(&t));
+	assert(redblack_tree_num_items(&t) == (uint64_t) expected);
+	assert(redblack_tree_range_aggregate(&t, (void *) 0, (void *) (int64_t) num_items) ==
+	       naive_range_sum(present, num_items, 0, num_items));
+	for (i = 0 ; i < num_items ; ++i)
+		assert(!redblack_tree_find(&t, (void *) (int64_t) i) == !present[i]);
+
+	// saves leave tombstones out
+	assert(redblack_tree_remove(&t, (void *) 1) == present[1]);
+	expected -= present[1];
+	present[1] = 0;
+	assert(redblack_tree_save(&t, &s, &codec, RBT_SAVE_PRE_ORDER | RBT_SAVE_DELTA));
+	assert(!t.tombstones);
+
+	// removing everything leaves only tombstones
+	for (i = 0 ; i < num_items ; ++i)
+		redblack_tree_remove(&t, (void *) (int64_t) i);
+	assert(0 == redblack_tree_num_items(&t));
+	assert(!redblack_tree_find(&t, (void *) 3));
+	assert(redblack_tree_load(&t, &s, &codec));
+	assert(redblack_tree_num_items(&t) == (uint64_t) expected);
+	assert(is_redblack_tree(&t));
+	for (i = 0 ; i < num_items ; ++i)
+		assert(!redblack_tree_find(&t, (void *) (int64_t) i) == !present[i]);
+
+	// back to eager removal
+	assert(redblack_tree_remove(&t, (void *) 3) == present[3]);
+	expected -= present[3];
+	assert(redblack_tree_set_lazy_remove(&t, 0));
+	assert(!t.tombstones);
+	assert(redblack_tree_num_items(&t) == (uint64_t) expected);
+
+	redblack_tree_destroy(&t);
+	assert(redblack_tree_set_aggregate(&t, NULL));
+
+	assert(redblack_tree_set_backend(&t, RBT_BACKEND_BTREE, my_item_key));
+	assert(!redblack_tree_set_lazy_remove(&t, 50));
+	assert(redblack_tree_set_backend(&t, RBT_BACKEND_REDBLACK, NULL));
+
+	free(present);
+	free(m);
+}
+
+void test_buffer(void)
+{
+	redblack_tree t;
+	redblack_tree_aggregate sum = { 0, my_int_value, my_sum_combine };
+	order_check check;
+	int num_items = 2000;
+	int *present;
+	int expected;
+	int item;
+	int lazy;
+	int lo;
+	int i;
+
+	present = (int *) malloc(num_items * sizeof(int));
+
+	for (lazy = 0 ; lazy < 2 ; ++lazy) {
+		redblack_tree_init(&t, 
+			      my_allocate_redblack_node,
+			      my_free_redblack_node,
+			      my_int_compare,
+			      my_allocate_redblack_entry,
+			      my_free_redblack_entry);
+
+		assert(redblack_tree_set_aggregate(&t, &sum));
+		if (lazy)
+			assert(redblack_tree_set_lazy_remove(&t, 25));
+		assert(redblack_tree_set_write_buffer(&t, 64));
+		assert(!redblack_tree_set_backend(&t, RBT_BACKEND_BTREE, my_item_key));
+
+		memset(present, 0, num_items * sizeof(int));
+		expected = 0;
+
+		// mostly ascending runs, as in a bulk load, with random removes
+		for (i = 0 ; i < 40000 ; ++i) {
+			item = rand() % 4 ? (i / 4 + rand() % 8) % num_items : rand() % num_items;
+			if (rand() % 3) {
+				// no duplicates of a pending insert
+				if (!redblack_tree_insert(&t, (void *) (int64_t) item))
+					assert(present[item]);
+				expected += !present[item];
+				present[item] = 1;
+			} else {
+				if (!redblack_tree_remove(&t, (void *) (int64_t) item))
+					assert(!present[item]);
+				expected -= present[item];
+				present[item] = 0;
+			}
+			assert(t.buffer_len <= 64);
+
+			item = rand() % num_items;
+			assert(!redblack_tree_find(&t, (void *) (int64_t) item) == !present[item]);
+
+			if (!(i % 997)) {
+				assert(redblack_tree_num_items(&t) == (uint64_t) expected);
+				assert(!t.buffer_len);
+				assert(is_redblack_tree(&t));
+				lo = rand() % num_items;
+				assert(redblack_tree_range_aggregate(&t, (void *) (int64_t) lo,
+								     (void *) (int64_t) (lo + 100)) ==
+				       naive_range_sum(present, num_items, lo, lo + 100));
+			}
+		}
+
+		check.count = 0;
+		redblack_tree_in_order(&t, order_visitor, &check);
+		assert(check.count == expected);
+
+		// pending writes are merged before the buffer goes away
+		assert(redblack_tree_insert(&t, (void *) (int64_t) num_items));
+		assert(redblack_tree_set_write_buffer(&t, 0));
+		assert(!t.buffer);
+		assert(redblack_tree_find(&t, (void *) (int64_t) num_items));
+		assert(redblack_tree_num_items(&t) == (uint64_t) expected + 1);
+
+		// destroy drops them
+		assert(redblack_tree_set_write_buffer(&t, 8));
+		assert(redblack_tree_insert(&t, (void *) (int64_t) (num_items + 1)));
+		redblack_tree_destroy(&t);
+		assert(!t.buffer);
+		assert(0 == redblack_tree_num_items(&t));
+
+		assert(redblack_tree_set_aggregate(&t, NULL));
+		assert(redblack_tree_set_lazy_remove(&t, 0));
+	}
+
+	free(present);
+}
+
+typedef struct _fc_worker {
+	redblack_tree_fc *fc;
+	int index;
+	int num_items;
+	int shared_inserted;
+} fc_worker;
+
+void * fc_worker_run(void *context)
+{
+	fc_worker *w = (fc_worker *) context;
+	int slot = redblack_tree_fc_register(w->fc);
+	redblack_tree_node *n;
+	int64_t item;
+	int i;
+
+	assert(slot >= 0);
+
+	// every thread races for the same item once
+	w->shared_inserted = redblack_tree_fc_insert(w->fc, slot, (void *) -1);
+
+	// each thread owns the items equal to its index modulo 4
+	for (i = 0 ; i < w->num_items ; ++i) {
+		item = 4 * i + w->index;
+		assert(redblack_tree_fc_insert(w->fc, slot, (void *) item));
+		assert(!redblack_tree_fc_insert(w->fc, slot, (void *) item));
+		n = redblack_tree_fc_find(w->fc, slot, (void *) item);
+		assert(n && n->item == (void *) item);
+	}
+
+	for (i = 0 ; i < w->num_items ; i += 2) {
+		item = 4 * i + w->index;
+		assert(redblack_tree_fc_remove(w->fc, slot, (void *) item));
+		assert(!redblack_tree_fc_find(w->fc, slot, (void *) item));
+	}
+
+	return NULL;
+}
+
+void test_fc(void)
+{
+	redblack_tree t;
+	redblack_tree_fc fc;
+	pthread_t threads[4];
+	fc_worker workers[4];
+	int num_items = 2000;
+	int shared = 0;
+	int i;
+
+	redblack_tree_init(&t, 
+		      my_allocate_redblack_node,
+		      my_free_redblack_node,
+		      my_int_compare,
+		      my_allocate_redblack_entry,
+		      my_free_redblack_entry);
+
+	assert(redblack_tree_fc_init(&fc, &t, 4));
+
+	for (i = 0 ; i < 4 ; ++i) {
+		workers[i].fc = &fc;
+		workers[i].index = i;
+		workers[i].num_items = num_items;
+		assert(!pthread_create(&threads[i], NULL, fc_worker_run, &workers[i]));
+	}
+
+	for (i = 0 ; i < 4 ; ++i) {
+		assert(!pthread_join(threads[i], NULL));
+		shared += workers[i].shared_inserted;
+	}
+
+	// all slots are taken
+	assert(-1 == redblack_tree_fc_register(&fc));
+	assert(1 == shared);
+	assert(fc.combined == 4 * (1 + 3 * num_items + num_items));
+	assert(fc.combines && fc.combines <= fc.combined);
+
+	assert(redblack_tree_num_items(&t) == (uint64_t) (1 + 4 * num_items / 2));
+	assert(is_redblack_tree(&t));
+	for (i = 0 ; i < 4 * num_items ; ++i)
+		assert(!redblack_tree_find(&t, (void *) (int64_t) i) == !((i / 4) % 2));
+
+	redblack_tree_fc_destroy(&fc);
+	redblack_tree_destroy(&t);
+}
+
+void test_arena(void)
+{
+	char path[] = "/tmp/rbt_arena_XXXXXX";
+	redblack_tree t;
+	redblack_tree_arena a;
+	redblack_tree_node *n;
+	uint64_t header[13]; // magic, version, base, capacity, ... dirty
+	uint64_t bad[13];
+	uint8_t *old_base;
+	void *blocker;
+	int num_items = 3000;
+	int64_t item;
+	int fd;
+	int i;
+
+	fd = mkstemp(path);
+	assert(fd >= 0);
+	close(fd);
+
+	redblack_tree_init(&t, 
+		      null_allocate_redblack_node,
+		      my_free_redblack_node,
+		      my_int64_ptr_compare,
+		      my_allocate_redblack_entry,
+		      my_free_redblack_entry);
+
+	// 3000 slots of 80 bytes need more than one growth step
+	assert(redblack_tree_arena_open(&a, &t, path, sizeof(int64_t), 1 << 22));
+	for (i = 0 ; i < num_items ; ++i) {
+		item = 7 * i;
+		assert(redblack_tree_insert(&t, &item));
+	}
+	for (i = 0 ; i < num_items ; i += 3) {
+		item = 7 * i;
+		assert(redblack_tree_remove(&t, &item));
+	}
+	// freed slots are reused
+	for (i = 0 ; i < num_items ; i += 6) {
+		item = 7 * i;
+		assert(redblack_tree_insert(&t, &item));
+	}
+	assert(redblack_tree_arena_sync(&a));
+	assert(redblack_tree_arena_close(&a));
+	assert(!t.root && 0 == redblack_tree_num_items(&t));
+
+	// the wrong item size is refused
+	assert(!redblack_tree_arena_open(&a, &t, path, sizeof(int32_t), 1 << 22));
+
+	// reopened where it was
+	assert(redblack_tree_arena_open(&a, &t, path, sizeof(int64_t), 0));
+	old_base = a.base;
+	assert(is_redblack_tree(&t));
+	for (i = 0 ; i < num_items ; ++i) {
+		item = 7 * i;
+		n = redblack_tree_find(&t, &item);
+		assert(!n == (i % 3 == 0 && i % 6 != 0));
+		assert(!n || *(int64_t *) n->item == item);
+	}
+	assert(redblack_tree_arena_close(&a));
+
+	// with the old range taken, the links are relocated
+	blocker = mmap(old_base, 4096, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+	assert(blocker == old_base);
+	assert(redblack_tree_arena_open(&a, &t, path, sizeof(int64_t), 0));
+	assert(a.base != old_base);
+	assert(is_redblack_tree(&t));
+	for (i = 0 ; i < num_items ; ++i) {
+		item = 7 * i;
+		n = redblack_tree_find(&t, &item);
+		assert(!n == (i % 3 == 0 && i % 6 != 0));
+		assert(!n || *(int64_t *) n->item == item);
+	}
+	item = -1;
+	assert(redblack_tree_insert(&t, &item));
+	redblack_tree_destroy(&t);
+	assert(redblack_tree_arena_close(&a));
+	munmap(blocker, 4096);
+
+	// destroy put every slot on the free list
+	assert(redblack_tree_arena_open(&a, &t, path, sizeof(int64_t), 0));
+	assert(0 == redblack_tree_num_items(&t));
+	assert(!a.dirty);
+	assert(!redblack_tree_set_balance(&t, RBT_BALANCE_WAVL));
+	// the hand would outlive the mapping
+	assert(!redblack_tree_set_capacity(&t, 2, NULL, NULL));
+	assert(redblack_tree_arena_close(&a));
+	assert(redblack_tree_set_capacity(&t, 2, NULL, NULL));
+	assert(!redblack_tree_arena_open(&a, &t, path, sizeof(int64_t), 0));
+	assert(redblack_tree_set_capacity(&t, 0, NULL, NULL));
+
+	// the nodes hold colors, not ranks
+	assert(redblack_tree_set_balance(&t, RBT_BALANCE_WAVL));
+	assert(!redblack_tree_arena_open(&a, &t, path, sizeof(int64_t), 0));
+	assert(redblack_tree_set_balance(&t, RBT_BALANCE_REDBLACK));
+
+	// header fields that don't describe slots within the file
+	fd = open(path, O_RDWR);
+	assert(fd >= 0);
+	assert(sizeof(header) == pread(fd, header, sizeof(header), 0));
+	for (i = 0 ; i < 4 ; ++i) {
+		memcpy(bad, header, sizeof(header));
+		if (i == 0)
+			bad[5] += 16;            // slot_size
+		else if (i == 1)
+			bad[6] = bad[7] + bad[5]; // used past file_size
+		else if (i == 2)
+			bad[3] = bad[7] - 1;     // capacity below file_size
+		else
+			bad[9] = bad[2] + 8;     // root inside the header
+		assert(sizeof(bad) == pwrite(fd, bad, sizeof(bad), 0));
+		assert(!redblack_tree_arena_open(&a, &t, path, sizeof(int64_t), 0));
+	}
+	assert(sizeof(header) == pwrite(fd, header, sizeof(header), 0));
+	close(fd);
+
+	// a crash after a change, before the next sync
+	assert(redblack_tree_arena_open(&a, &t, path, sizeof(int64_t), 0));
+	item = 1;
+	assert(redblack_tree_insert(&t, &item));
+	assert(a.dirty);
+	assert(redblack_tree_arena_sync(&a));
+	assert(!a.dirty);
+	item = 2;
+	assert(redblack_tree_insert(&t, &item));
+	assert(a.dirty);
+	munmap(a.base, a.capacity);
+	close(a.fd);
+	redblack_tree_init(&t, 
+		      null_allocate_redblack_node,
+		      my_free_redblack_node,
+		      my_int64_ptr_compare,
+		      my_allocate_redblack_entry,
+		      my_free_redblack_entry);
+	assert(!redblack_tree_arena_open(&a, &t, path, sizeof(int64_t), 0));
+
+	unlink(path);
+}
+
+void test_min_max(void)
+{
+	redblack_tree t;
+	int num_items = 500;
+	char *present;
+	int mode;
+	int item;
+	int lo;
+	int hi;
+	void *popped;
+	redblack_tree_node *n;
+	int i;
+
+	present = (char *) malloc(num_items);
+
+	// red-black, lazy removal, B+-tree
+	for (mode = 0 ; mode < 3 ; ++mode) {
+		redblack_tree_init(&t, 
+			      my_allocate_redblack_node,
+			      my_free_redblack_node,
+			      my_int_compare,
+			      my_allocate_redblack_entry,
+			      my_free_redblack_entry);
+		if (mode == 1)
+			assert(redblack_tree_set_lazy_remove(&t, 40));
+		if (mode == 2)
+			assert(redblack_tree_set_backend(&t, RBT_BACKEND_BTREE, my_item_key));
+
+		memset(present, 0, num_items);
+		assert(!redblack_tree_min_node(&t));
+		assert(!redblack_tree_max_node(&t));
+		assert(!redblack_tree_pop_min(&t, &popped));
+		assert(!redblack_tree_pop_max(&t, &popped));
+
+		for (i = 0 ; i < 20000 ; ++i) {
+			item = rand() % num_items;
+			switch (rand() % 5) {
+			case 0:
+			case 1:
+				redblack_tree_insert(&t, (void *) (int64_t) item);
+				present[item] = 1;
+				break;
+			case 2:
+				redblack_tree_remove(&t, (void *) (int64_t) item);
+				present[item] = 0;
+				break;
+			case 3:
+				for (lo = 0 ; lo < num_items && !present[lo] ; ++lo)
+					;
+				assert(redblack_tree_pop_min(&t, &popped) == (lo < num_items));
+				if (lo < num_items) {
+					assert(popped == (void *) (int64_t) lo);
+					present[lo] = 0;
+				}
+				break;
+			default:
+				for (hi = num_items - 1 ; hi >= 0 && !present[hi] ; --hi)
+					;
+				assert(redblack_tree_pop_max(&t, &popped) == (hi >= 0));
+				if (hi >= 0) {
+					assert(popped == (void *) (int64_t) hi);
+					present[hi] = 0;
+				}
+				break;
+			}
+
+			for (lo = 0 ; lo < num_items && !present[lo] ; ++lo)
+				;
+			for (hi = num_items - 1 ; hi >= 0 && !present[hi] ; --hi)
+				;
+			n = redblack_tree_min_node(&t);
+			assert(lo < num_items ? n && n->item == (void *) (int64_t) lo : !n);
+			n = redblack_tree_max_node(&t);
+			assert(hi >= 0 ? n && n->item == (void *) (int64_t) hi : !n);
+		}
+
+		if (mode != 2)
+			assert(is_redblack_tree(&t));
+
+		// drain in order
+		for (lo = 0 ; redblack_tree_pop_min(&t, &popped) ; lo = (int) (int64_t) popped + 1) {
+			for ( ; !present[lo] ; ++lo)
+				;
+			assert(popped == (void *) (int64_t) lo);
+		}
+		assert(0 == redblack_tree_num_items(&t));
+
+		redblack_tree_destroy(&t);
+	}
+
+	free(present);
+}
+
+uint64_t latency_total(redblack_tree *t, int op)
+{
+	uint64_t counts[RBT_LATENCY_BUCKETS];
+	uint64_t total = 0;
+	int i;
+
+	assert(redblack_tree_get_latency(t, op, counts));
+	for (i = 0 ; i < RBT_LATENCY_BUCKETS ; ++i)
+		total += counts[i];
+	return total;
+}
+
+void test_latency(void)
+{
+	redblack_tree t;
+	uint64_t counts[RBT_LATENCY_BUCKETS];
+	void *popped;
+	int i;
+
+	redblack_tree_init(&t, 
+		      my_allocate_redblack_node,
+		      my_free_redblack_node,
+		      my_int_compare,
+		      my_allocate_redblack_entry,
+		      my_free_redblack_entry);
+
+	// nothing is kept until asked for
+	redblack_tree_insert(&t, (void *) 1);
+	assert(!redblack_tree_get_latency(&t, RBT_TRACE_INSERT, counts));
+	for (i = 0 ; i < RBT_LATENCY_BUCKETS ; ++i)
+		assert(!counts[i]);
+
+	assert(redblack_tree_set_latency_histograms(&t, 1));
+	for (i = 0 ; i < 1000 ; ++i)
+		redblack_tree_insert(&t, (void *) (int64_t) (rand() % 500));
+	for (i = 0 ; i < 700 ; ++i)
+		redblack_tree_find(&t, (void *) (int64_t) (rand() % 500));
+	for (i = 0 ; i < 300 ; ++i)
+		redblack_tree_remove(&t, (void *) (int64_t) (rand() % 500));
+	assert(redblack_tree_pop_min(&t, &popped));
+
+	assert(1000 == latency_total(&t, RBT_TRACE_INSERT));
+	assert(700 == latency_total(&t, RBT_TRACE_FIND));
+	assert(301 == latency_total(&t, RBT_TRACE_REMOVE));
+	assert(!redblack_tree_get_latency(&t, 0, counts));
+	assert(!redblack_tree_get_latency(&t, RBT_TRACE_REMOVE + 1, counts));
+
+	redblack_tree_reset_latency(&t);
+	assert(0 == latency_total(&t, RBT_TRACE_INSERT));
+	redblack_tree_find(&t, (void *) 1);
+	assert(1 == latency_total(&t, RBT_TRACE_FIND));
+
+	assert(redblack_tree_set_latency_histograms(&t, 0));
+	assert(!redblack_tree_get_latency(&t, RBT_TRACE_FIND, counts));
+
+	assert(redblack_tree_set_latency_histograms(&t, 1));
+	redblack_tree_destroy(&t); // frees the histograms
+	assert(!redblack_tree_get_latency(&t, RBT_TRACE_FIND, counts));
+}
+
+void test_wavl(void)
+{
+	redblack_tree t;
+	redblack_tree u;
+	redblack_tree_codec codec = { my_save_item, my_load_item,
+				      my_item_key, my_key_item };
+	redblack_tree_stream s;
+	redblack_tree_stats before;
+	redblack_tree_stats after;
+	redblack_tree_report report;
+	memory_stream *m;
+	memory_stream *shape_t;
+	memory_stream *shape_u;
+	int num_items = 1000;
+	char *present;
+	void *popped;
+	int64_t last;
+	int stats;
+	int count;
+	int item;
+	int i;
+
+	present = (char *) calloc(num_items, 1);
+	m = (memory_stream *) calloc(1, sizeof(memory_stream));
+	shape_t = (memory_stream *) calloc(1, sizeof(memory_stream));
+	shape_u = (memory_stream *) calloc(1, sizeof(memory_stream));
+	s.write = memory_stream_write;
+	s.read = memory_stream_read;
+	s.context = m;
+
+	redblack_tree_init(&t, 
+		      my_allocate_redblack_node,
+		      my_free_redblack_node,
+		      my_int_compare,
+		      my_allocate_redblack_entry,
+		      my_free_redblack_entry);
+	redblack_tree_init(&u, 
+		      my_allocate_redblack_node,
+		      my_free_redblack_node,
+		      my_int_compare,
+		      my_allocate_redblack_entry,
+		      my_free_redblack_entry);
+
+	// only an empty red-black backend can switch
+	assert(redblack_tree_set_backend(&t, RBT_BACKEND_BTREE, my_item_key));
+	assert(!redblack_tree_set_balance(&t, RBT_BALANCE_WAVL));
+	assert(redblack_tree_set_backend(&t, RBT_BACKEND_REDBLACK, NULL));
+	redblack_tree_insert(&t, (void *) 1);
+	assert(!redblack_tree_set_balance(&t, RBT_BALANCE_WAVL));
+	redblack_tree_destroy(&t);
+	assert(redblack_tree_set_balance(&t, RBT_BALANCE_WAVL));
+	assert(redblack_tree_set_balance(&u, RBT_BALANCE_WAVL));
+
+	// without removes, the height of an AVL tree
+	for (i = 0 ; i < num_items ; ++i) {
+		item = rand() % num_items;
+		redblack_tree_insert(&t, (void *) (int64_t) item);
+		present[item] = 1;
+	}
+	assert(is_wavl_tree(&t));
+	for (count = redblack_tree_num_items(&t) + 2, i = 0 ; count ; count >>= 1)
+		++i;
+	assert(redblack_tree_height(&t) <= 1.45 * i);
+
+	// mixed writes, at most two rotations per remove
+	stats = redblack_tree_get_stats(&t, &before);
+	for (i = 0 ; i < 20000 ; ++i) {
+		item = rand() % num_items;
+		if (rand() % 2) {
+			redblack_tree_insert(&t, (void *) (int64_t) item);
+			present[item] = 1;
+		} else {
+			redblack_tree_get_stats(&t, &before);
+			redblack_tree_remove(&t, (void *) (int64_t) item);
+			redblack_tree_get_stats(&t, &after);
+			assert(after.rotations - before.rotations <= 2);
+			present[item] = 0;
+		}
+		if (!(i % 97))
+			assert(is_wavl_tree(&t));
+	}
+	assert(is_wavl_tree(&t));
+	for (i = 0 ; i < num_items ; ++i)
+		assert(!redblack_tree_find(&t, (void *) (int64_t) i) == !present[i]);
+	if (stats) {
+		assert(after.remove_cases[2] + after.remove_cases[3] +
+		       after.remove_cases[4] + after.remove_cases[5]);
+		assert(after.insert_cases[2] + after.insert_cases[3] +
+		       after.insert_cases[4]);
+	}
+
+	redblack_tree_analyze(&t, &report);
+	assert(0 == report.black_height && 0 == report.red_ratio);
+
+	// pre-order saves keep the ranks, and only load as ranks
+	m->len = m->pos = 0;
+	assert(redblack_tree_save(&t, &s, &codec,
+				  RBT_SAVE_PRE_ORDER | RBT_SAVE_DELTA));
+	assert(redblack_tree_load(&u, &s, &codec));
+	assert(is_wavl_tree(&u));
+	shape_t->len = shape_u->len = 0;
+	redblack_tree_pre_order(&t, shape_visitor, shape_t);
+	redblack_tree_pre_order(&u, shape_visitor, shape_u);
+	assert(shape_t->len == shape_u->len);
+	assert(!memcmp(shape_t->buf, shape_u->buf, shape_t->len));
+	redblack_tree_destroy(&u);
+
+	assert(redblack_tree_set_balance(&u, RBT_BALANCE_REDBLACK));
+	m->pos = 0;
+	assert(!redblack_tree_load(&u, &s, &codec));
+	redblack_tree_insert(&u, (void *) 1);
+	m->len = m->pos = 0;
+	assert(redblack_tree_save(&u, &s, &codec, RBT_SAVE_PRE_ORDER));
+	redblack_tree_destroy(&u);
+	assert(redblack_tree_set_balance(&u, RBT_BALANCE_WAVL));
+	assert(!redblack_tree_load(&u, &s, &codec));
+
+	// in-order loads are built with valid ranks
+	m->len = m->pos = 0;
+	assert(redblack_tree_save(&t, &s, &codec, RBT_SAVE_IN_ORDER | RBT_SAVE_DELTA));
+	assert(redblack_tree_load(&u, &s, &codec));
+	assert(is_wavl_tree(&u));
+	assert(redblack_tree_num_items(&u) == redblack_tree_num_items(&t));
+	redblack_tree_destroy(&u);
+
+	// so are compacted ones
+	assert(redblack_tree_set_lazy_remove(&t, 25));
+	for (i = 0 ; i < num_items ; i += 3) {
+		redblack_tree_remove(&t, (void *) (int64_t) i);
+		present[i] = 0;
+	}
+	redblack_tree_compact(&t);
+	assert(is_wavl_tree(&t));
+	assert(redblack_tree_set_lazy_remove(&t, 0));
+
+	for (last = -1 ; redblack_tree_pop_min(&t, &popped) ; last = (int64_t) popped) {
+		assert((int64_t) popped > last && present[(int64_t) popped]);
+		if (!(last % 50))
+			assert(is_wavl_tree(&t));
+	}
+	assert(!t.root);
+
+	redblack_tree_destroy(&t);
+	free(present);
+	free(m);
+	free(shape_t);
+	free(shape_u);
+}
+
+typedef struct _relaxed_worker {
+	redblack_tree_fc *fc;
+	int slot;
+	int stop;
+	uint64_t slices;
+} relaxed_worker;
+
+// repairs in slices while the other threads write
+void * relaxed_rebalance_thread(void *context)
+{
+	relaxed_worker *w = (relaxed_worker *) context;
+
+	while (!__atomic_load_n(&w->stop, __ATOMIC_ACQUIRE)) {
+		if (!redblack_tree_fc_rebalance(w->fc, w->slot, 8))
+			sched_yield();
+		++w->slices;
+	}
+
+	return NULL;
+}
+
+void test_relaxed(void)
+{
+	redblack_tree t;
+	redblack_tree_aggregate sum = { 0, my_int_value, my_sum_combine };
+	redblack_tree_fc fc;
+	relaxed_worker w;
+	pthread_t thread;
+	int num_items = 1000;
+	int *present;
+	void *popped;
+	uint32_t left;
+	uint32_t last;
+	int64_t item;
+	int slot;
+	int i;
+
+	present = (int *) calloc(num_items, sizeof(int));
+
+	redblack_tree_init(&t, 
+		      my_allocate_redblack_node,
+		      my_free_redblack_node,
+		      my_int_compare,
+		      my_allocate_redblack_entry,
+		      my_free_redblack_entry);
+
+	// red-black repairs only, and not with tombstones of its own
+	assert(redblack_tree_set_balance(&t, RBT_BALANCE_WAVL));
+	assert(!redblack_tree_set_relaxed(&t, 64));
+	assert(redblack_tree_set_balance(&t, RBT_BALANCE_REDBLACK));
+	assert(redblack_tree_set_lazy_remove(&t, 50));
+	assert(!redblack_tree_set_relaxed(&t, 64));
+	assert(redblack_tree_set_lazy_remove(&t, 0));
+	assert(0 == redblack_tree_rebalance(&t, 0));
+
+	assert(redblack_tree_set_relaxed(&t, 64));
+	assert(!redblack_tree_set_lazy_remove(&t, 50));
+	assert(!redblack_tree_set_balance(&t, RBT_BALANCE_WAVL));
+	assert(!redblack_tree_set_backend(&t, RBT_BACKEND_BTREE, my_item_key));
+	assert(redblack_tree_set_aggregate(&t, &sum));
+	// tombstones leave the hash index like removed nodes
+	assert(redblack_tree_set_hash_index(&t, my_item_hash));
+
+	// sorted inserts leave runs of red nodes, black heights stay equal
+	for (i = 0 ; i < 100 ; ++i) {
+		assert(redblack_tree_insert(&t, (void *) (int64_t) i));
+		present[i] = 1;
+		assert(rbt_max_black_nodes(t.root) == rbt_min_black_nodes(t.root));
+	}
+	assert(redblack_tree_rebalance(&t, 1) > 0);
+	for (last = redblack_tree_rebalance(&t, 0) ; last ; last = left)
+		assert((left = redblack_tree_rebalance(&t, 3)) < last);
+	assert(is_redblack_tree(&t));
+
+	// random writes, repaired in slices
+	for (i = 0 ; i < 20000 ; ++i) {
+		item = rand() % num_items;
+		if (rand() % 2) {
+			redblack_tree_insert(&t, (void *) item);
+			present[item] = 1;
+		} else {
+			assert(redblack_tree_remove(&t, (void *) item) == present[item]);
+			present[item] = 0;
+		}
+		if (!(i % 7))
+			assert(redblack_tree_rebalance(&t, 2) <= 2 * 64);
+		if (!(i % 101)) {
+			for (item = 0 ; item < num_items && !present[item] ; ++item)
+				;
+			assert(item == num_items ? !redblack_tree_min_node(&t) :
+			       redblack_tree_min_node(&t)->item == (void *) item);
+			assert(rbt_max_black_nodes(t.root) == rbt_min_black_nodes(t.root));
+			assert(redblack_tree_range_aggregate(&t, (void *) 0,
+				(void *) (int64_t) num_items) ==
+			       naive_range_sum(present, num_items, 0, num_items));
+		}
+	}
+	for (i = 0 ; i < num_items ; ++i)
+		assert(!redblack_tree_find(&t, (void *) (int64_t) i) == !present[i]);
+	assert(0 == redblack_tree_rebalance(&t, 0));
+	assert(is_redblack_tree(&t));
+	assert(0 == t.tombstones);
+
+	// a background thread repairs through the flat-combining front end
+	assert(redblack_tree_fc_init(&fc, &t, 2));
+	w.fc = &fc;
+	w.slot = redblack_tree_fc_register(&fc);
+	w.stop = 0;
+	w.slices = 0;
+	slot = redblack_tree_fc_register(&fc);
+	assert(!pthread_create(&thread, NULL, relaxed_rebalance_thread, &w));
+	for (i = 0 ; i < 20000 ; ++i) {
+		item = rand() % num_items;
+		if (rand() % 2) {
+			redblack_tree_fc_insert(&fc, slot, (void *) item);
+			present[item] = 1;
+		} else {
+			assert(redblack_tree_fc_remove(&fc, slot, (void *) item) == present[item]);
+			present[item] = 0;
+		}
+	}
+	__atomic_store_n(&w.stop, 1, __ATOMIC_RELEASE);
+	pthread_join(thread, NULL);
+	redblack_tree_fc_destroy(&fc);
+	assert(w.slices);
+	assert(0 == redblack_tree_rebalance(&t, 0));
+	assert(is_redblack_tree(&t));
+
+	// turning it off repairs everything, and drains stay in order
+	for (i = 0 ; i < num_items ; i += 2) {
+		redblack_tree_remove(&t, (void *) (int64_t) i);
+		present[i] = 0;
+	}
+	assert(redblack_tree_set_relaxed(&t, 0));
+	assert(is_redblack_tree(&t));
+	assert(0 == t.tombstones);
+	for (item = -1 ; redblack_tree_pop_min(&t, &popped) ; item = (int64_t) popped)
+		assert((int64_t) popped > item && present[(int64_t) popped]);
+
+	redblack_tree_destroy(&t);
+	free(present);
+}
+
+typedef struct _adjacent_count {
+	redblack_tree_node *prev;
+	uint64_t adjacent;   // in-order steps to the next node in memory
+} adjacent_count;
+
+void adjacent_visitor(redblack_tree_node *node, void *context)
+{
+	adjacent_count *c = (adjacent_count *) context;
+
+	if (c->prev && node == c->prev + 1)
+		++c->adjacent;
+	c->prev = node;
+}
+
+uint64_t count_adjacent(redblack_tree *t)
+{
+	adjacent_count c = { NULL, 0 };
+
+	redblack_tree_in_order(t, adjacent_visitor, &c);
+	return c.adjacent;
+}
+
+void test_layout(void)
+{
+	redblack_tree t;
+	redblack_tree_aggregate sum = { 0, my_int_value, my_sum_combine };
+	redblack_tree_report before;
+	redblack_tree_report after;
+	int num_items = 2000;
+	int *present;
+	int64_t item;
+	int steps;
+	int i;
+
+	present = (int *) calloc(num_items, sizeof(int));
+
+	redblack_tree_init(&t, 
+		      my_allocate_redblack_node,
+		      my_free_redblack_node,
+		      my_int_compare,
+		      my_allocate_redblack_entry,
+		      my_free_redblack_entry);
+
+	assert(redblack_tree_relayout(&t));
+	assert(!redblack_tree_relayout_step(&t, 10));
+
+	assert(redblack_tree_set_aggregate(&t, &sum));
+	assert(redblack_tree_set_hash_index(&t, my_item_hash));
+	assert(redblack_tree_set_cache(&t, 64, my_item_hash));
+
+	// churn scatters the nodes over the heap
+	for (i = 0 ; i < 4 * num_items ; ++i) {
+		item = rand() % num_items;
+		if (rand() % 3) {
+			redblack_tree_insert(&t, (void *) item);
+			present[item] = 1;
+		} else {
+			redblack_tree_remove(&t, (void *) item);
+			present[item] = 0;
+		}
+		redblack_tree_find(&t, (void *) (int64_t) (rand() % num_items));
+	}
+
+	// in one go, every in-order step moves to the next slot
+	redblack_tree_analyze(&t, &before);
+	assert(redblack_tree_relayout(&t));
+	assert(is_redblack_tree(&t));
+	assert(count_adjacent(&t) == t.count - 1);
+	redblack_tree_analyze(&t, &after);
+	assert(after.num_nodes == before.num_nodes);
+	assert(after.height == before.height);
+	assert(after.line_changes <= before.line_changes);
+	assert(after.page_changes < 0.1);
+	for (i = 0 ; i < num_items ; ++i)
+		assert(!redblack_tree_find(&t, (void *) (int64_t) i) == !present[i]);
+	assert(redblack_tree_min_node(&t) == t.leftmost && !t.leftmost->left);
+	assert(redblack_tree_max_node(&t) == t.rightmost && !t.rightmost->right);
+
+	// again, out of the slab of the last pass into a new one
+	assert(redblack_tree_relayout(&t));
+	assert(count_adjacent(&t) == t.count - 1);
+	assert(1 == t.layout->num_slabs);
+
+	// in slices, with writes and compaction in between
+	for (steps = 0 ; steps < 20 ; ++steps) {
+		if (steps == 10)
+			assert(redblack_tree_set_lazy_remove(&t, 100));
+		while (redblack_tree_relayout_step(&t, 37)) {
+			for (i = 0 ; i < 20 ; ++i) {
+				item = rand() % num_items;
+				if (rand() % 2) {
+					redblack_tree_insert(&t, (void *) item);
+					present[item] = 1;
+				} else {
+					redblack_tree_remove(&t, (void *) item);
+					present[item] = 0;
+				}
+			}
+			if (!(rand() % 10))
+				redblack_tree_compact(&t);
+			assert(is_redblack_tree(&t));
+		}
+		assert(redblack_tree_range_aggregate(&t, (void *) 0,
+			(void *) (int64_t) num_items) ==
+		       naive_range_sum(present, num_items, 0, num_items));
+	}
+	for (i = 0 ; i < num_items ; ++i)
+		assert(!redblack_tree_find(&t, (void *) (int64_t) i) == !present[i]);
+	redblack_tree_compact(&t);
+	assert(redblack_tree_set_lazy_remove(&t, 0));
+
+	// a relaxed tree moves its pending nodes along
+	assert(redblack_tree_set_relaxed(&t, 64));
+	for (i = 0 ; i < 4 * num_items ; ++i) {
+		item = rand() % num_items;
+		if (rand() % 2) {
+			redblack_tree_insert(&t, (void *) item);
+			present[item] = 1;
+		} else {
+			redblack_tree_remove(&t, (void *) item);
+			present[item] = 0;
+		}
+		if (!(i % 50))
+			redblack_tree_relayout_step(&t, 25);
+	}
+	assert(redblack_tree_set_relaxed(&t, 0));
+	assert(is_redblack_tree(&t));
+	for (i = 0 ; i < num_items ; ++i)
+		assert(!redblack_tree_find(&t, (void *) (int64_t) i) == !present[i]);
+
+	// compaction freeing the next node ends the pass
+	assert(redblack_tree_set_lazy_remove(&t, 100));
+	assert(redblack_tree_relayout_step(&t, 1));
+	assert(redblack_tree_remove(&t, t.layout->next->item));
+	redblack_tree_compact(&t);
+	assert(!t.layout->next);
+	assert(redblack_tree_set_lazy_remove(&t, 0));
+	for (i = 0 ; i < num_items ; ++i)
+		present[i] = redblack_tree_find(&t, (void *) (int64_t) i) != NULL;
+
+	// so does emptying the tree
+	assert(redblack_tree_relayout_step(&t, 5));
+	for (i = 0 ; i < num_items ; ++i)
+		assert(redblack_tree_remove(&t, (void *) (int64_t) i) == present[i]);
+	assert(!redblack_tree_relayout_step(&t, 5));
+	assert(0 == t.layout->num_slabs);
+
+	// or destroying it
+	for (i = 0 ; i < num_items ; ++i)
+		redblack_tree_insert(&t, (void *) (int64_t) i);
+	assert(redblack_tree_relayout(&t));
+	assert(redblack_tree_relayout_step(&t, 5));
+	redblack_tree_destroy(&t);
+	assert(!t.layout);
+
+	redblack_tree_init(&t, 
+		      my_allocate_redblack_node,
+		      my_free_redblack_node,
+		      my_int_compare,
+		      my_allocate_redblack_entry,
+		      my_free_redblack_entry);
+	assert(redblack_tree_set_backend(&t, RBT_BACKEND_BTREE, my_item_key));
+	assert(!redblack_tree_relayout(&t));
+	assert(!redblack_tree_relayout_step(&t, 0));
+	redblack_tree_destroy(&t);
+
+	free(present);
+}
+
+void test_wide_keys(void)
+{
+	redblack_tree t;
+	int64_t keys[] = { 0, INT64_MAX, INT64_MIN, -1, 1,
+			   INT64_MAX - 1, INT64_MIN + 1, INT64_MIN / 2 };
+	int num_keys = sizeof(keys) / sizeof(keys[0]);
+	order_check check = { 0, 0 };
+	uint64_t count;
+	uint64_t i;
+
+	redblack_tree_init(&t, 
+		      my_allocate_redblack_node,
+		      my_free_redblack_node,
+		      my_int_compare,
+		      my_allocate_redblack_entry,
+		      my_free_redblack_entry);
+
+	// keys at both ends of int64_t, which ia - ib would misorder
+	for (i = 0 ; i < (uint64_t) num_keys ; ++i)
+		assert(redblack_tree_insert(&t, (void *) keys[i]));
+	assert(is_redblack_tree(&t));
+	redblack_tree_in_order(&t, order_visitor, &check);
+	assert(check.count == (uint64_t) num_keys);
+	assert((int64_t) redblack_tree_min_node(&t)->item == INT64_MIN);
+	assert((int64_t) redblack_tree_max_node(&t)->item == INT64_MAX);
+	for (i = 0 ; i < (uint64_t) num_keys ; ++i)
+		assert(redblack_tree_find(&t, (void *) keys[i]));
+	assert(!redblack_tree_find(&t, (void *) (INT64_MAX - 2)));
+	assert(redblack_tree_remove(&t, (void *) INT64_MIN));
+	assert(redblack_tree_remove(&t, (void *) INT64_MAX));
+	assert(is_redblack_tree(&t));
+	redblack_tree_destroy(&t);
+
+	// a level-order walk appends to its queues in O(1)
+	for (i = 0 ; i < 100000 ; ++i)
+		redblack_tree_insert(&t, (void *) (int64_t) ((i * 0x9e3779b97f4a7c15ull) >> 1));
+	assert(100000 == redblack_tree_num_items(&t));
+	count = 0;
+	redblack_tree_level_order(&t, count_level_visitor, &count);
+	assert(100000 == count);
+	redblack_tree_destroy(&t);
+}
+
+void test_merge(void)
+{
+	redblack_tree trees[6];
+	redblack_tree *list[6];
+	redblack_tree_merge m;
+	redblack_tree_node *node;
+	int num_trees = 6;
+	int num_items = 1000;
+	int *counts;
+	int *first;
+	int64_t last;
+	uint32_t tree;
+	uint32_t last_tree;
+	uint64_t total;
+	int64_t item;
+	int i;
+	int j;
+
+	counts = (int *) calloc(num_items, sizeof(int));
+	first = (int *) malloc(num_items * sizeof(int));
+	for (i = 0 ; i < num_items ; ++i)
+		first[i] = num_trees;
+
+	for (j = 0 ; j < num_trees ; ++j) {
+		redblack_tree_init(&trees[j],
+			      my_allocate_redblack_node,
+			      my_free_redblack_node,
+			      my_int_compare,
+			      my_allocate_redblack_entry,
+			      my_free_redblack_entry);
+		list[j] = &trees[j];
+	}
+
+	// every backend and mode, one tree left empty
+	assert(redblack_tree_set_backend(&trees[1], RBT_BACKEND_BTREE, my_item_key));
+	assert(redblack_tree_set_balance(&trees[2], RBT_BALANCE_WAVL));
+	assert(redblack_tree_set_lazy_remove(&trees[3], 100));
+	assert(redblack_tree_set_write_buffer(&trees[5], 64));
+	for (j = 0 ; j < num_trees ; ++j) {
+		if (j == 4)
+			continue;
+		for (i = 0 ; i < num_items / 2 ; ++i)
+			redblack_tree_insert(&trees[j], (void *) (int64_t) (rand() % num_items));
+		// tombstones and buffered removes are not part of the union
+		for (i = 0 ; i < num_items / 8 ; ++i)
+			redblack_tree_remove(&trees[j], (void *) (int64_t) (rand() % num_items));
+		for (i = 0 ; i < num_items ; ++i) {
+			if (!redblack_tree_find(&trees[j], (void *) (int64_t) i))
+				continue;
+			++counts[i];
+			if (first[i] == num_trees)
+				first[i] = j;
+		}
+	}
+	assert(trees[3].tombstones);
+
+	// all items, equal ones in tree order
+	assert(redblack_tree_merge_init(&m, list, num_trees, 0));
+	total = 0;
+	last = -1;
+	last_tree = 0;
+	while ((node = redblack_tree_merge_next(&m, &tree))) {
+		item = (int64_t) node->item;
+		assert(item > last || (item == last && tree > last_tree));
+		assert(redblack_tree_find(&trees[tree], node->item) == node);
+		if (item != last)
+			assert((int) tree == first[item]);
+		--counts[item];
+		last = item;
+		last_tree = tree;
+		++total;
+	}
+	assert(!redblack_tree_merge_next(&m, NULL));
+	redblack_tree_merge_destroy(&m);
+	for (i = 0 ; i < num_items ; ++i)
+		assert(!counts[i]);
+	assert(total > (uint64_t) num_items);
+
+	// collapsed, the copy from the first tree holding the item
+	assert(redblack_tree_merge_init(&m, list, num_trees, 1));
+	last = -1;
+	while ((node = redblack_tree_merge_next(&m, &tree))) {
+		item = (int64_t) node->item;
+		for ( ; last + 1 < item ; ++last)
+			assert(first[last + 1] == num_trees);
+		assert((int) tree == first[item]);
+		last = item;
+	}
+	for ( ; last + 1 < num_items ; ++last)
+		assert(first[last + 1] == num_trees);
+	redblack_tree_merge_destroy(&m);
+
+	assert(redblack_tree_merge_init(&m, list, 0, 1));
+	assert(!redblack_tree_merge_next(&m, &tree));
+	redblack_tree_merge_destroy(&m);
+
+	for (j = 0 ; j < num_trees ; ++j)
+		redblack_tree_destroy(&trees[j]);
+	free(counts);
+	free(first);
+}
+
+void test_filter(void)
+{
+	redblack_tree t;
+	redblack_tree u;
+	redblack_tree_stream s;
+	redblack_tree_codec codec = { my_save_item, my_load_item, NULL, NULL };
+	memory_stream *m;
+	int num_items = 1500;
+	int num_probes = 20000;
+	char *present;
+	uint64_t rejected;
+	uint64_t passed;
+	uint64_t false_positives;
+	int item;
+	int mode;
+	int i;
+
+	present = (char *) malloc(num_items);
+	m = (memory_stream *) calloc(1, sizeof(memory_stream));
+	s.write = memory_stream_write;
+	s.read = memory_stream_read;
+	s.context = m;
+
+	for (mode = 0 ; mode < 4 ; ++mode) {
+		memset(present, 0, num_items);
+		redblack_tree_init(&t,
+			      my_allocate_redblack_node,
+			      my_free_redblack_node,
+			      my_int_compare,
+			      my_allocate_redblack_entry,
+			      my_free_redblack_entry);
+		if (mode == 1)
+			assert(redblack_tree_set_backend(&t, RBT_BACKEND_BTREE, my_item_key));
+		else if (mode == 2)
+			assert(redblack_tree_set_lazy_remove(&t, 30));
+		else if (mode == 3)
+			assert(redblack_tree_set_write_buffer(&t, 32));
+
+		// out of range rates leave no filter
+		assert(!redblack_tree_set_filter(&t, 100, 0, my_item_hash));
+		assert(!redblack_tree_set_filter(&t, 100, 1, my_item_hash));
+		assert(!t.filter);
+
+		// sized far below what the tree grows to
+		assert(redblack_tree_set_filter(&t, 100, 0.01, my_item_hash));
+		for (i = 0 ; i < 20000 ; ++i) {
+			item = rand() % num_items;
+			if (rand() % 3) {
+				// buffered updates always report success
+				assert(redblack_tree_insert(&t, (void *) (int64_t) item) == !present[item] || mode == 3);
+				present[item] = 1;
+			} else {
+				assert(redblack_tree_remove(&t, (void *) (int64_t) item) == present[item] || mode == 3);
+				present[item] = 0;
+			}
+		}
+		assert(t.filter->capacity >= t.count);
+
+		// no false negatives
+		for (i = 0 ; i < num_items ; ++i)
+			assert(!redblack_tree_find(&t, (void *) (int64_t) i) == !present[i]);
+
+		// most absent items never reach the tree
+		assert(redblack_tree_set_filter(&t, t.count, 0.01, my_item_hash));
+		for (i = 0 ; i < num_probes ; ++i)
+			assert(!redblack_tree_find(&t, (void *) (int64_t) (num_items + i)));
+		redblack_tree_get_filter_stats(&t, &rejected, &passed, &false_positives);
+		assert(rejected + passed == (uint64_t) num_probes);
+		assert(passed == false_positives);
+		assert(false_positives < (uint64_t) num_probes / 50);
+
+		// the filter follows the tree through a reload
+		redblack_tree_init(&u,
+			      my_allocate_redblack_node,
+			      my_free_redblack_node,
+			      my_int_compare,
+			      my_allocate_redblack_entry,
+			      my_free_redblack_entry);
+		assert(redblack_tree_set_filter(&u, 10, 0.05, my_item_hash));
+		m->len = m->pos = 0;
+		assert(redblack_tree_save(&t, &s, &codec, RBT_SAVE_IN_ORDER));
+		assert(redblack_tree_load(&u, &s, &codec));
+		for (i = 0 ; i < num_items ; ++i)
+			assert(!redblack_tree_find(&u, (void *) (int64_t) i) == !present[i]);
+		redblack_tree_destroy(&u);
+		assert(!u.filter);
+
+		// removing every item empties the filter
+		for (i = 0 ; i < num_items ; ++i)
+			assert(redblack_tree_remove(&t, (void *) (int64_t) i) == present[i] || mode == 3);
+		redblack_tree_flush(&t);
+		for (i = 0 ; i < (int) ((t.filter->num_counters + 1) / 2) ; ++i)
+			assert(!t.filter->counters[i]);
+
+		assert(redblack_tree_set_filter(&t, 0, 0, NULL));
+		assert(!t.filter);
+		redblack_tree_get_filter_stats(&t, &rejected, &passed, &false_positives);
+		assert(!rejected && !passed && !false_positives);
+		assert(redblack_tree_set_filter(&t, 0, 0.5, my_item_hash));
+		redblack_tree_destroy(&t);
+		assert(!t.filter);
+	}
+
+	free(present);
+	free(m);
+}
+
+int file_stream_read(void *context, void *buf, size_t len)
+{
+	return fread(buf, 1, len, (FILE *) context) == len;
+}
+
+void test_snapshot(void)
+{
+	redblack_tree t;
+	redblack_tree u;
+	redblack_tree_snapshot snap;
+	redblack_tree_snapshot snap2;
+	redblack_tree_codec codec = { my_save_item, my_load_item,
+				      my_item_key, my_key_item };
+	redblack_tree_codec no_save = { NULL, my_load_item, NULL, NULL };
+	redblack_tree_stream s;
+	char path[] = "/tmp/rbt_snapshot_XXXXXX";
+	int num_items = 20000;
+	FILE *fp;
+	int fd;
+	int i;
+
+	fd = mkstemp(path);
+	assert(fd >= 0);
+	close(fd);
+
+	redblack_tree_init(&t,
+		      my_allocate_redblack_node,
+		      my_free_redblack_node,
+		      my_int_compare,
+		      my_allocate_redblack_entry,
+		      my_free_redblack_entry);
+	redblack_tree_init(&u,
+		      my_allocate_redblack_node,
+		      my_free_redblack_node,
+		      my_int_compare,
+		      my_allocate_redblack_entry,
+		      my_free_redblack_entry);
+
+	assert(redblack_tree_set_lazy_remove(&t, 50));
+	for (i = 0 ; i < num_items ; ++i)
+		assert(redblack_tree_insert(&t, (void *) (int64_t) i));
+	redblack_tree_remove(&t, (void *) (int64_t) 7);
+
+	// the image is the tree at the call, whatever happens after
+	assert(redblack_tree_snapshot_async(&snap, &t, path, &codec, RBT_SAVE_IN_ORDER | RBT_SAVE_DELTA));
+	for (i = 0 ; i < num_items ; i += 2)
+		assert(redblack_tree_remove(&t, (void *) (int64_t) i));
+	for (i = num_items ; i < 2 * num_items ; ++i)
+		assert(redblack_tree_insert(&t, (void *) (int64_t) i));
+	while (!redblack_tree_snapshot_done(&snap))
+		usleep(1000);
+	assert(redblack_tree_snapshot_done(&snap));
+	assert(redblack_tree_snapshot_wait(&snap));
+	assert(redblack_tree_snapshot_wait(&snap));
+
+	fp = fopen(path, "rb");
+	assert(fp);
+	s.write = NULL;
+	s.read = file_stream_read;
+	s.context = fp;
+	assert(redblack_tree_load(&u, &s, &codec));
+	fclose(fp);
+	assert(is_redblack_tree(&u));
+	assert(redblack_tree_num_items(&u) == (uint64_t) num_items - 1);
+	for (i = 0 ; i < 2 * num_items ; ++i)
+		assert(!redblack_tree_find(&u, (void *) (int64_t) i) == (i == 7 || i >= num_items));
+	redblack_tree_destroy(&u);
+
+	// a failed snapshot leaves the last image in place
+	assert(redblack_tree_snapshot_async(&snap, &t, path, &no_save, RBT_SAVE_IN_ORDER));
+	assert(!redblack_tree_snapshot_wait(&snap));
+	fp = fopen(path, "rb");
+	assert(fp);
+	s.context = fp;
+	assert(redblack_tree_load(&u, &s, &codec));
+	fclose(fp);
+	assert(redblack_tree_num_items(&u) == (uint64_t) num_items - 1);
+	redblack_tree_destroy(&u);
+
+	assert(!redblack_tree_snapshot_async(&snap, &t, "/nonexistent/rbt_snapshot", &codec, RBT_SAVE_IN_ORDER));
+	assert(!redblack_tree_snapshot_wait(&snap));
+
+	// a bare name lives in the working directory
+	assert(redblack_tree_snapshot_async(&snap, &t, "rbt_snapshot_test.img", &codec, RBT_SAVE_IN_ORDER));
+	assert(redblack_tree_snapshot_wait(&snap));
+	assert(0 == unlink("rbt_snapshot_test.img"));
+
+	// snapshots to the same path each write a file of their own
+	assert(redblack_tree_snapshot_async(&snap, &t, path, &codec, RBT_SAVE_IN_ORDER));
+	assert(redblack_tree_snapshot_async(&snap2, &t, path, &codec, RBT_SAVE_PRE_ORDER));
+	assert(redblack_tree_snapshot_wait(&snap));
+	assert(redblack_tree_snapshot_wait(&snap2));
+	fp = fopen(path, "rb");
+	assert(fp);
+	s.context = fp;
+	assert(redblack_tree_load(&u, &s, &codec));
+	fclose(fp);
+	assert(is_redblack_tree(&u));
+	assert(redblack_tree_num_items(&u) == (uint64_t) num_items + num_items / 2 - 1);
+	redblack_tree_destroy(&u);
+
+	// the tree itself went on as usual
+	assert(redblack_tree_num_items(&t) == (uint64_t) num_items + num_items / 2 - 1);
+	redblack_tree_destroy(&t);
+	unlink(path);
+}
+
+uint64_t counted_allocs;
+uint64_t counted_frees; // also bumped by the reclaimer thread
+
+redblack_tree_node * counting_allocate_node(void *item)
+{
+	++counted_allocs;
+	return my_allocate_redblack_node(item);
+}
+
+void counting_free_node(redblack_tree_node *node)
+{
+	__atomic_fetch_add(&counted_frees, 1, __ATOMIC_RELAXED);
+	free(node);
+}
+
+void test_reclaim(void)
+{
+	redblack_tree t;
+	redblack_tree_reclaim r;
+	int num_items = 5000;
+	uint64_t steps;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t before;
+	uint64_t rejected;
+	uint64_t passed;
+	uint64_t false_positives;
+	int mode;
+	int i;
+
+	for (mode = 0 ; mode < 4 ; ++mode) {
+		counted_allocs = counted_frees = 0;
+		redblack_tree_init(&t,
+			      counting_allocate_node,
+			      counting_free_node,
+			      my_int_compare,
+			      my_allocate_redblack_entry,
+			      my_free_redblack_entry);
+		assert(redblack_tree_set_hash_index(&t, my_item_hash));
+		if (mode == 1)
+			assert(redblack_tree_set_backend(&t, RBT_BACKEND_BTREE, my_item_key));
+		else if (mode == 2)
+			assert(redblack_tree_set_lazy_remove(&t, 50));
+		else if (mode == 0) {
+			assert(redblack_tree_set_cache(&t, 64, my_item_hash));
+			assert(redblack_tree_set_filter(&t, 2 * num_items, 0.01, my_item_hash));
+			assert(redblack_tree_set_capacity(&t, num_items, NULL, NULL));
+		}
+
+		for (i = 0 ; i < num_items ; ++i)
+			redblack_tree_insert(&t, (void *) (int64_t) (rand() % (2 * num_items)));
+		// slab nodes and malloc'd ones side by side
+		if (mode == 3) {
+			assert(redblack_tree_relayout(&t));
+			for (i = 0 ; i < num_items ; ++i)
+				redblack_tree_insert(&t, (void *) (int64_t) (rand() % (4 * num_items)));
+		}
+		for (i = 0 ; i < num_items / 4 ; ++i)
+			redblack_tree_remove(&t, (void *) (int64_t) (rand() % (2 * num_items)));
+		assert(mode != 2 || t.tombstones);
+
+		// t is empty and usable before any node is freed
+		steps = counted_frees;
+		assert(redblack_tree_detach(&t, &r));
+		assert(counted_frees == steps);
+		assert(!t.root && !t.btree && !t.layout && !t.tombstones);
+		assert(0 == redblack_tree_num_items(&t));
+		for (i = 0 ; i < 100 ; ++i)
+			assert(redblack_tree_insert(&t, (void *) (int64_t) i));
+
+		if (mode % 2) {
+			assert(redblack_tree_reclaim_start(&r));
+			for (i = 0 ; i < 100 ; ++i)
+				assert(redblack_tree_find(&t, (void *) (int64_t) i));
+		} else {
+			for (steps = 0 ; redblack_tree_reclaim_step(&r, 7) ; ++steps)
+				assert(steps < (uint64_t) 4 * num_items);
+			assert(steps > (uint64_t) num_items / 7);
+			assert(!redblack_tree_reclaim_step(&r, 7));
+		}
+		redblack_tree_reclaim_wait(&r);
+		assert(!r.root && !r.btree && !r.layout);
+		assert(counted_allocs - counted_frees == 100);
+
+		assert(100 == redblack_tree_num_items(&t));
+
+		// the configuration outlived the nodes
+		if (mode == 0) {
+			assert(t.hash_item && t.cache && t.filter && t.clock);
+			// the second find of each item comes from the cache
+			for (i = 0 ; i < 100 ; ++i) {
+				assert(redblack_tree_find(&t, (void *) (int64_t) i));
+				assert(redblack_tree_find(&t, (void *) (int64_t) i));
+			}
+			redblack_tree_get_cache_stats(&t, &hits, &misses);
+			assert(hits >= 100);
+			redblack_tree_get_filter_stats(&t, &before, &passed, &false_positives);
+			for (i = 100 ; i < 200 ; ++i)
+				assert(!redblack_tree_find(&t, (void *) (int64_t) i));
+			redblack_tree_get_filter_stats(&t, &rejected, &passed, &false_positives);
+			assert(rejected > before);
+			for (i = 100 ; i < num_items + 100 ; ++i)
+				assert(redblack_tree_insert(&t, (void *) (int64_t) i));
+			assert(redblack_tree_num_items(&t) == (uint64_t) num_items);
+			assert(is_redblack_tree(&t));
+		}
+
+		redblack_tree_destroy(&t);
+		assert(counted_allocs == counted_frees);
+	}
+}
+
+typedef struct _eviction_log {
+	char *present;
+	uint64_t evicted;
+} eviction_log;
+
+void log_eviction(void *item, void *context)
+{
+	eviction_log *log = (eviction_log *) context;
+
+	assert(log->present[(int64_t) item]);
+	log->present[(int64_t) item] = 0;
+	++log->evicted;
+}
+
+void test_capacity(void)
+{
+	redblack_tree t;
+	eviction_log log;
+	redblack_tree_codec codec = { my_save_item, my_load_item, NULL, NULL };
+	redblack_tree_stream s;
+	redblack_tree_node *n;
+	memory_stream *m;
+	int num_items = 2000;
+	uint64_t capacity = 300;
+	int item;
+	int mode;
+	int i;
+
+	log.present = (char *) malloc(num_items);
+
+	for (mode = 0 ; mode < 4 ; ++mode) {
+		memset(log.present, 0, num_items);
+		log.evicted = 0;
+		redblack_tree_init(&t,
+			      my_allocate_redblack_node,
+			      my_free_redblack_node,
+			      my_int_compare,
+			      my_allocate_redblack_entry,
+			      my_free_redblack_entry);
+		if (mode == 1)
+			assert(redblack_tree_set_lazy_remove(&t, 30));
+		else if (mode == 2)
+			assert(redblack_tree_set_balance(&t, RBT_BALANCE_WAVL));
+		else if (mode == 3) {
+			assert(redblack_tree_set_hash_index(&t, my_item_hash));
+			assert(redblack_tree_set_cache(&t, 64, my_item_hash));
+			assert(redblack_tree_set_filter(&t, capacity, 0.01, my_item_hash));
+		}
+		assert(redblack_tree_set_capacity(&t, capacity, log_eviction, &log));
+		assert(!redblack_tree_set_write_buffer(&t, 16));
+		assert(!redblack_tree_set_relaxed(&t, 16));
+		assert(!redblack_tree_set_backend(&t, RBT_BACKEND_BTREE, my_item_key));
+
+		// finds keep a hot set in, whatever else comes through
+		// present before the insert, which may evict the new item itself
+		for (i = 0 ; i < (int) capacity + 1 ; ++i) {
+			log.present[i] = 1;
+			assert(redblack_tree_insert(&t, (void *) (int64_t) i));
+		}
+		assert(1 == log.evicted);
+		for (i = 0 ; i < 20000 ; ++i) {
+			if (i % 4 == 0) {
+				item = rand() % 50;
+				assert(!redblack_tree_find(&t, (void *) (int64_t) item) == !log.present[item]);
+				continue;
+			}
+			item = 50 + rand() % (num_items - 50);
+			if (i % 4 == 1) {
+				if (redblack_tree_remove(&t, (void *) (int64_t) item))
+					log.present[item] = 0;
+			} else {
+				log.present[item] = 1;
+				redblack_tree_insert(&t, (void *) (int64_t) item);
+			}
+			assert(t.count <= capacity);
+		}
+		// evicted before the first find, or never found since; putting
+		// one back may evict another whose bit the hand just cleared
+		do {
+			item = 0;
+			for (i = 0 ; i < 50 ; ++i) {
+				if (log.present[i])
+					continue;
+				log.present[i] = 1;
+				assert(redblack_tree_insert(&t, (void *) (int64_t) i));
+				++item;
+			}
+		} while (item);
+		// and one the hand is about to reach needs its bit set
+		for (i = 0 ; i < 50 ; ++i)
+			assert(redblack_tree_find(&t, (void *) (int64_t) i));
+		for (i = 0 ; i < 5000 ; ++i) {
+			assert(redblack_tree_find(&t, (void *) (int64_t) (i % 50)));
+			item = 50 + rand() % (num_items - 50);
+			log.present[item] = 1;
+			redblack_tree_insert(&t, (void *) (int64_t) item);
+		}
+		for (i = 0 ; i < 50 ; ++i)
+			assert(log.present[i]);
+
+		assert(mode == 2 ? is_wavl_tree(&t) : is_redblack_tree(&t));
+		assert(t.count == capacity);
+		assert(t.clock->evictions == log.evicted);
+		for (i = 0 ; i < num_items ; ++i)
+			assert(!redblack_tree_find(&t, (void *) (int64_t) i) == !log.present[i]);
+
+		// shrinking evicts right away
+		assert(redblack_tree_set_capacity(&t, capacity / 3, log_eviction, &log));
+		assert(redblack_tree_num_items(&t) == capacity / 3);
+		for (i = 0 ; i < num_items ; ++i)
+			assert(!redblack_tree_find(&t, (void *) (int64_t) i) == !log.present[i]);
+
+		// unbounded again
+		assert(redblack_tree_set_capacity(&t, 0, NULL, NULL));
+		assert(!t.clock);
+		for (i = 0 ; i < num_items ; ++i)
+			redblack_tree_insert(&t, (void *) (int64_t) i);
+		assert(redblack_tree_num_items(&t) == (uint64_t) num_items);
+
+		assert(redblack_tree_set_capacity(&t, 10, NULL, NULL));
+		redblack_tree_destroy(&t);
+		assert(!t.clock);
+	}
+
+	// relayout carries the hand over to the copy of its node
+	redblack_tree_init(&t,
+		      my_allocate_redblack_node,
+		      my_free_redblack_node,
+		      my_int_compare,
+		      my_allocate_redblack_entry,
+		      my_free_redblack_entry);
+	assert(redblack_tree_set_capacity(&t, 8, NULL, NULL));
+	for (i = 0 ; i < 10 ; ++i)
+		assert(redblack_tree_insert(&t, (void *) (int64_t) i));
+	assert(t.clock->hand);
+	assert(redblack_tree_relayout(&t));
+	assert(t.clock->hand->flags & RBT_NODE_SLAB);
+	for (i = 10 ; i < 20 ; ++i)
+		redblack_tree_insert(&t, (void *) (int64_t) i);
+	assert(is_redblack_tree(&t));
+	assert(8 == redblack_tree_num_items(&t));
+	redblack_tree_destroy(&t);
+
+	// a hand on the successor follows its item into the removed node
+	assert(redblack_tree_set_capacity(&t, 100, NULL, NULL));
+	for (i = 0 ; i < 15 ; ++i)
+		assert(redblack_tree_insert(&t, (void *) (int64_t) i));
+	n = t.root;
+	item = (int) (int64_t) n->item;
+	t.clock->hand = n->right;
+	while (t.clock->hand->left)
+		t.clock->hand = t.clock->hand->left;
+	assert(redblack_tree_remove(&t, (void *) (int64_t) item));
+	assert(t.clock->hand == n);
+	assert((int64_t) n->item == item + 1);
+	assert(n->flags & RBT_NODE_RECENT);
+	redblack_tree_destroy(&t);
+
+	// an image larger than the capacity is cut down as it loads
+	m = (memory_stream *) calloc(1, sizeof(memory_stream));
+	s.write = memory_stream_write;
+	s.read = memory_stream_read;
+	s.context = m;
+	for (i = 0 ; i < 50 ; ++i)
+		assert(redblack_tree_insert(&t, (void *) (int64_t) i));
+	assert(redblack_tree_save(&t, &s, &codec, RBT_SAVE_PRE_ORDER));
+	redblack_tree_destroy(&t);
+	memset(log.present, 1, 50);
+	log.evicted = 0;
+	assert(redblack_tree_set_capacity(&t, 20, log_eviction, &log));
+	assert(redblack_tree_load(&t, &s, &codec));
+	assert(20 == redblack_tree_num_items(&t));
+	assert(30 == log.evicted && 30 == t.clock->evictions);
+	assert(is_redblack_tree(&t));
+	for (i = 0 ; i < 50 ; ++i)
+		assert(!redblack_tree_find(&t, (void *) (int64_t) i) == !log.present[i]);
+	redblack_tree_destroy(&t);
+	free(m);
+
+	free(log.present);
+}
+
 int main(int argc, char *argv[])
 {
 	test_rbt_util();
 	insert_and_remove_stress();
 	other_coverage();
+	test_aggregate();
+	test_interval();
+	test_serialize();
+	test_journal();
+	test_stats();
+	test_analyze();
+	test_trace();
+	test_btree();
+	test_hash();
+	test_cache();
+	test_tombstone();
+	test_buffer();
+	test_fc();
+	test_arena();
+	test_min_max();
+	test_latency();
+	test_wavl();
+	test_relaxed();
+	test_layout();
+	test_wide_keys();
+	test_merge();
+	test_filter();
+	test_snapshot();
+	test_reclaim();
+	test_capacity();
 	return 0;
 }
@@ -4,16 +4,38 @@ CFLAGS   ?= -std=gnu99 -g -O0 -Wall -Werror -fno-inline
 
 all: librbt.so main
 
-librbt.so: rbt.h rbt.c rbt_insert.c rbt_remove.c rbt_util.h
+librbt.so: rbt.h rbt.c rbt_insert.c rbt_remove.c rbt_augment.c rbt_interval.c rbt_serialize.c rbt_journal.c rbt_analyze.c rbt_trace.c rbt_btree.c rbt_hash.c rbt_cache.c rbt_tombstone.c rbt_buffer.c rbt_fc.c rbt_arena.c rbt_probe.c rbt_wavl.c rbt_relaxed.c rbt_layout.c rbt_merge.c rbt_filter.c rbt_snapshot.c rbt_reclaim.c rbt_clock.c rbt_util.h
 	$(CC) $(CPPFLAGS) $(CFLAGS) -c -fPIC -o rbt.o rbt.c
 	$(CC) $(CPPFLAGS) $(CFLAGS) -c -fPIC -o rbt_insert.o rbt_insert.c
 	$(CC) $(CPPFLAGS) $(CFLAGS) -c -fPIC -o rbt_remove.o rbt_remove.c
-	$(CC) -shared -o librbt.so rbt.o rbt_insert.o rbt_remove.o
+	$(CC) $(CPPFLAGS) $(CFLAGS) -c -fPIC -o rbt_augment.o rbt_augment.c
+	$(CC) $(CPPFLAGS) $(CFLAGS) -c -fPIC -o rbt_interval.o rbt_interval.c
+	$(CC) $(CPPFLAGS) $(CFLAGS) -c -fPIC -o rbt_serialize.o rbt_serialize.c
+	$(CC) $(CPPFLAGS) $(CFLAGS) -c -fPIC -o rbt_journal.o rbt_journal.c
+	$(CC) $(CPPFLAGS) $(CFLAGS) -c -fPIC -o rbt_analyze.o rbt_analyze.c
+	$(CC) $(CPPFLAGS) $(CFLAGS) -c -fPIC -o rbt_trace.o rbt_trace.c
+	$(CC) $(CPPFLAGS) $(CFLAGS) -c -fPIC -o rbt_btree.o rbt_btree.c
+	$(CC) $(CPPFLAGS) $(CFLAGS) -c -fPIC -o rbt_hash.o rbt_hash.c
+	$(CC) $(CPPFLAGS) $(CFLAGS) -c -fPIC -o rbt_cache.o rbt_cache.c
+	$(CC) $(CPPFLAGS) $(CFLAGS) -c -fPIC -o rbt_tombstone.o rbt_tombstone.c
+	$(CC) $(CPPFLAGS) $(CFLAGS) -c -fPIC -o rbt_buffer.o rbt_buffer.c
+	$(CC) $(CPPFLAGS) $(CFLAGS) -c -fPIC -o rbt_fc.o rbt_fc.c
+	$(CC) $(CPPFLAGS) $(CFLAGS) -c -fPIC -o rbt_arena.o rbt_arena.c
+	$(CC) $(CPPFLAGS) $(CFLAGS) -c -fPIC -o rbt_probe.o rbt_probe.c
+	$(CC) $(CPPFLAGS) $(CFLAGS) -c -fPIC -o rbt_wavl.o rbt_wavl.c
+	$(CC) $(CPPFLAGS) $(CFLAGS) -c -fPIC -o rbt_relaxed.o rbt_relaxed.c
+	$(CC) $(CPPFLAGS) $(CFLAGS) -c -fPIC -o rbt_layout.o rbt_layout.c
+	$(CC) $(CPPFLAGS) $(CFLAGS) -c -fPIC -o rbt_merge.o rbt_merge.c
+	$(CC) $(CPPFLAGS) $(CFLAGS) -c -fPIC -o rbt_filter.o rbt_filter.c
+	$(CC) $(CPPFLAGS) $(CFLAGS) -c -fPIC -o rbt_snapshot.o rbt_snapshot.c
+	$(CC) $(CPPFLAGS) $(CFLAGS) -c -fPIC -o rbt_reclaim.o rbt_reclaim.c
+	$(CC) $(CPPFLAGS) $(CFLAGS) -c -fPIC -o rbt_clock.o rbt_clock.c
+	$(CC) -shared -o librbt.so rbt.o rbt_insert.o rbt_remove.o rbt_augment.o rbt_interval.o rbt_serialize.o rbt_journal.o rbt_analyze.o rbt_trace.o rbt_btree.o rbt_hash.o rbt_cache.o rbt_tombstone.o rbt_buffer.o rbt_fc.o rbt_arena.o rbt_probe.o rbt_wavl.o rbt_relaxed.o rbt_layout.o rbt_merge.o rbt_filter.o rbt_snapshot.o rbt_reclaim.o rbt_clock.o -lpthread
 
 main: main.c
-	$(CC) $(CPPFLAGS) $(CFLAGS) -o main main.c -L$(PWD) -lrbt
+	$(CC) $(CPPFLAGS) $(CFLAGS) -o main main.c -L$(PWD) -lrbt -lpthread
 
 clean:
-	$(RM) librbt.so rbt.o rbt_insert.o rbt_remove.o main
+	$(RM) librbt.so rbt.o rbt_insert.o rbt_remove.o rbt_augment.o rbt_interval.o rbt_serialize.o rbt_journal.o rbt_analyze.o rbt_trace.o rbt_btree.o rbt_hash.o rbt_cache.o rbt_tombstone.o rbt_buffer.o rbt_fc.o rbt_arena.o rbt_probe.o rbt_wavl.o rbt_relaxed.o rbt_layout.o rbt_merge.o rbt_filter.o rbt_snapshot.o rbt_reclaim.o rbt_clock.o main
 
 .PHONY: all clean
@@ -16,6 +16,8 @@
 ** along with this program; if not, write to the Free Software
 ** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
+#include <string.h>
+
 #include "rbt.h"
 #include "rbt_util.h"
 
@@ -27,11 +29,42 @@ void redblack_tree_init(redblack_tree *t,
 		void (*free_entry)(redblack_queue_entry * ))
 {
 	t->root = NULL;
+	t->leftmost = NULL;
+	t->rightmost = NULL;
+	t->count = 0;
 	t->allocate_node = allocate_node;
 	t->free_node = free_node;
 	t->compare_items = compare_items;
 	t->allocate_entry = allocate_entry;
 	t->free_entry = free_entry;
+	t->aggregate.identity = 0;
+	t->aggregate.value = NULL;
+	t->aggregate.combine = NULL;
+	t->interval_start = NULL;
+	t->trace = NULL;
+	t->hash_item = NULL;
+	t->hash_table = NULL;
+	t->hash_capacity = 0;
+	t->buffer = NULL;
+	t->buffer_len = 0;
+	t->buffer_capacity = 0;
+	t->tombstones = 0;
+	t->tombstone_percent = 0;
+	t->cache_hash = NULL;
+	t->cache = NULL;
+	t->cache_mask = 0;
+	t->cache_hits = 0;
+	t->cache_misses = 0;
+	t->btree = NULL;
+	t->btree_key = NULL;
+	t->balance = RBT_BALANCE_REDBLACK;
+	t->relaxed = NULL;
+	t->layout = NULL;
+	t->filter = NULL;
+	t->clock = NULL;
+	t->arena = NULL;
+	t->latency = NULL;
+	redblack_tree_reset_stats(t);
 }
 
 static void redblack_tree_destroy_node(redblack_tree *t, redblack_tree_node *node)
@@ -42,38 +75,50 @@ static void redblack_tree_destroy_node(redblack_tree *t, redblack_tree_node *nod
 	redblack_tree_destroy_node(t, node->left);
 	redblack_tree_destroy_node(t, node->right);
 
-	t->free_node(node);
+	redblack_tree_release_node(t, node);
 }
 
 void redblack_tree_destroy(redblack_tree *t)
 {
+	redblack_tree_set_cache(t, 0, NULL);
+	redblack_tree_set_filter(t, 0, 0, NULL);
+	redblack_tree_set_capacity(t, 0, NULL, NULL);
+	redblack_tree_set_latency_histograms(t, 0);
+	redblack_tree_relaxed_clear(t);
+	redblack_tree_set_relaxed(t, 0);
+	redblack_tree_buffer_drop(t);
+	redblack_btree_destroy(t);
 	redblack_tree_destroy_node(t, t->root);
+	redblack_tree_layout_destroy(t);
 	t->root = NULL;
+	t->leftmost = NULL;
+	t->rightmost = NULL;
+	t->count = 0;
+	t->tombstones = 0;
+	redblack_tree_hash_clear(t);
 }
 
-static uint32_t redblack_tree_num_items_node(redblack_tree_node *node)
+uint64_t redblack_tree_num_items(redblack_tree *t)
 {
-	if (!node)
-		return 0;
-	return 1 + redblack_tree_num_items_node(node->left) +
-		   redblack_tree_num_items_node(node->right);
+	redblack_tree_flush(t);
+	return t->count;
 }
 
-uint32_t redblack_tree_num_items(redblack_tree *t)
-{
-	return redblack_tree_num_items_node(t->root);
-}
-
-redblack_tree_node * redblack_tree_find(redblack_tree *t,
-					void *item)
+static redblack_tree_node * redblack_tree_find_node(redblack_tree *t,
+						   void *item)
 {
 	redblack_tree_node *node;
 	int64_t res;
+	uint64_t depth = 0;
+
+	redblack_tree_stat(t, finds);
 
 	node = t->root;
 
 	while (node) {
 
+		++depth;
+		redblack_tree_stat(t, compares);
 		res = t->compare_items(item, node->item);
 
 		if (res < 0) {
@@ -81,12 +126,148 @@ redblack_tree_node * redblack_tree_find(redblack_tree *t,
 		} else if (res > 0) {
 			node = node->right;
 		} else {
-			return node;
+			break;
+		}
+
+	}
+
+	redblack_tree_stat_depth(t, depth);
+	return node;
+}
+
+static redblack_tree_node * redblack_tree_lookup(redblack_tree *t,
+						void *item)
+{
+	if (t->hash_item)
+		return redblack_tree_hash_find(t, item);
+	if (t->btree_key)
+		return redblack_btree_find(t, item);
+	return redblack_tree_find_node(t, item);
+}
+
+static redblack_tree_node * redblack_tree_find_stored(redblack_tree *t,
+						     void *item)
+{
+	redblack_tree_node **slot;
+	redblack_tree_node *node;
+
+	if (!redblack_tree_may_contain(t, item)) {
+		++t->filter->rejected;
+		return NULL;
+	}
+
+	if (t->cache) {
+		slot = redblack_tree_cache_slot(t, item);
+		node = *slot;
+		if (node && !t->compare_items(item, node->item)) {
+			++t->cache_hits;
+		} else {
+			++t->cache_misses;
+			node = redblack_tree_lookup(t, item);
+			if (node)
+				*slot = node;
 		}
+	} else
+		node = redblack_tree_lookup(t, item);
+
+	if (node && redblack_tree_is_tombstone(node))
+		node = NULL;
 
+	if (node && t->clock)
+		node->flags |= RBT_NODE_RECENT;
+
+	if (t->filter) {
+		++t->filter->passed;
+		if (!node)
+			++t->filter->false_positives;
 	}
 
-	return NULL;
+	return node;
+}
+
+redblack_tree_node * redblack_tree_find(redblack_tree *t,
+					void *item)
+{
+	uint64_t start = redblack_tree_latency_start(t);
+	redblack_tree_node *node;
+
+	redblack_tree_probe(find, t, item);
+
+	if (!t->buffer_len || !redblack_tree_buffer_find(t, item, &node))
+		node = redblack_tree_find_stored(t, item);
+
+	if (t->trace)
+		redblack_tree_trace_record_op(t, RBT_TRACE_FIND, item, node != NULL);
+
+	redblack_tree_latency_record(t, RBT_TRACE_FIND, start);
+	redblack_tree_probe(find_done, t, node);
+	return node;
+}
+
+static redblack_tree_node * redblack_tree_extreme(redblack_tree *t, int max)
+{
+	redblack_tree_node *node;
+
+	redblack_tree_flush(t);
+
+	if (t->btree_key)
+		return redblack_btree_extreme(t, max);
+
+	node = max ? t->rightmost : t->leftmost;
+
+	// lazily removed extremes stay in place until compaction
+	while (node && redblack_tree_is_tombstone(node))
+		node = max ? redblack_tree_prev(node) : redblack_tree_next(node);
+
+	return node;
+}
+
+redblack_tree_node * redblack_tree_min_node(redblack_tree *t)
+{
+	return redblack_tree_extreme(t, 0);
+}
+
+redblack_tree_node * redblack_tree_max_node(redblack_tree *t)
+{
+	return redblack_tree_extreme(t, 1);
+}
+
+/*
+** The B+-tree backend visits every traversal in key order.
+*/
+typedef struct _redblack_tree_btree_visit {
+	void (*visitor)(redblack_tree_node *node, void *context);
+	void (*level_visitor)(redblack_tree_node *node, void *context, uint64_t level);
+	void *context;
+} redblack_tree_btree_visit;
+
+static void redblack_tree_btree_visitor(redblack_tree_node *node,
+					void *context,
+					uint64_t level)
+{
+	redblack_tree_btree_visit *visit = (redblack_tree_btree_visit *) context;
+
+	if (visit->visitor)
+		visit->visitor(node, visit->context);
+	else
+		visit->level_visitor(node, visit->context, level);
+}
+
+static int redblack_tree_btree_traverse(redblack_tree *t,
+					void (*visitor)(redblack_tree_node *node, void *context),
+					void (*level_visitor)(redblack_tree_node *node, void *context, uint64_t level),
+					void *context)
+{
+	redblack_tree_btree_visit visit;
+
+	if (!t->btree_key)
+		return 0;
+
+	visit.visitor = visitor;
+	visit.level_visitor = level_visitor;
+	visit.context = context;
+	redblack_btree_in_order(t, redblack_tree_btree_visitor, &visit);
+	return 1;
 }
 
 static void redblack_tree_pre_order_node(redblack_tree *t,
@@ -97,7 +278,8 @@ static void redblack_tree_pre_order_node(redblack_tree *t,
 	if (!node)
 		return;
 
-	visitor(node, context);
+	if (!redblack_tree_is_tombstone(node))
+		visitor(node, context);
 
 	redblack_tree_pre_order_node(t, visitor, context, node->left);
 	redblack_tree_pre_order_node(t, visitor, context, node->right);
@@ -107,6 +289,11 @@ void redblack_tree_pre_order(redblack_tree *t,
 			     void (*visitor)(redblack_tree_node *node, void *context),
 			     void *context)
 {
+	redblack_tree_flush(t);
+
+	if (redblack_tree_btree_traverse(t, visitor, NULL, context))
+		return;
+
 	redblack_tree_pre_order_node(t, visitor, context, t->root);
 }
 
@@ -120,7 +307,8 @@ static void redblack_tree_in_order_node(redblack_tree *t,
 
 	redblack_tree_in_order_node(t, visitor, context, node->left);
 
-	visitor(node, context);
+	if (!redblack_tree_is_tombstone(node))
+		visitor(node, context);
 
 	redblack_tree_in_order_node(t, visitor, context, node->right);
 }
@@ -129,6 +317,11 @@ void redblack_tree_in_order(redblack_tree *t,
 			    void (*visitor)(redblack_tree_node *node, void *context),
 			    void *context)
 {
+	redblack_tree_flush(t);
+
+	if (redblack_tree_btree_traverse(t, visitor, NULL, context))
+		return;
+
 	redblack_tree_in_order_node(t, visitor, context, t->root);
 }
 
@@ -144,19 +337,28 @@ static void redblack_tree_post_order_node(redblack_tree *t,
 
 	redblack_tree_post_order_node(t, visitor, context, node->right);
 
-	visitor(node, context);
+	if (!redblack_tree_is_tombstone(node))
+		visitor(node, context);
 }
 
 void redblack_tree_post_order(redblack_tree *t,
 			      void (*visitor)(redblack_tree_node *node, void *context),
 			      void *context)
 {
+	redblack_tree_flush(t);
+
+	if (redblack_tree_btree_traverse(t, visitor, NULL, context))
+		return;
+
 	redblack_tree_post_order_node(t, visitor, context, t->root);
 }
 
+// queue_tail[level] points at the last entry of that queue, so that
+// appending stays O(1) however wide the level is
 static void redblack_add_queue_entry(redblack_tree *t,
 				     redblack_tree_node *node,
-				     redblack_queue_entry **queue_head)
+				     redblack_queue_entry **queue_head,
+				     redblack_queue_entry **queue_tail)
 {
 	redblack_queue_entry *entry;
 
@@ -164,51 +366,55 @@ static void redblack_add_queue_entry(redblack_tree *t,
 
 	entry->next = NULL;
 
-	if (*queue_head == NULL) {
+	if (*queue_head == NULL)
 		*queue_head = entry;
-	} else {
-		redblack_queue_entry *last = *queue_head;
+	else
+		(*queue_tail)->next = entry;
 
-		while (last->next)
-			last = last->next;
-
-		last->next = entry;
-	}
+	*queue_tail = entry;
 }
 
 static void redblack_tree_level_order_node(redblack_tree *t,
 					   redblack_tree_node *node,
 					   redblack_queue_entry **queue_array,
-					   int level)
+					   uint64_t height,
+					   uint64_t level)
 {
 	if (!node)
 		return;
 
-	redblack_add_queue_entry(t, node, &queue_array[level]);
+	redblack_add_queue_entry(t, node, &queue_array[level],
+				 &queue_array[height + level]);
 
-	redblack_tree_level_order_node(t, node->left, queue_array, level+1);
-	redblack_tree_level_order_node(t, node->right, queue_array, level+1);
+	redblack_tree_level_order_node(t, node->left, queue_array, height, level+1);
+	redblack_tree_level_order_node(t, node->right, queue_array, height, level+1);
 }
 
 void redblack_tree_level_order(redblack_tree *t,
-			       void (*visitor)(redblack_tree_node *node, void *context, int level),
+			       void (*visitor)(redblack_tree_node *node, void *context, uint64_t level),
 			       void *context)
 {
 	redblack_queue_entry **queue_array;
-	uint32_t height;
-	uint32_t i;
+	uint64_t height;
+	uint64_t i;
 
-	// Allocate an array of queues, one for each level of the tree.
+	redblack_tree_flush(t);
+
+	if (redblack_tree_btree_traverse(t, NULL, visitor, context))
+		return;
+
+	// Allocate an array of queues, one for each level of the tree,
+	// followed by their tails.
 	height = redblack_tree_height(t);
 
 	if (!height)
 		return;
 
 	queue_array = (redblack_queue_entry **)
-			calloc(height, sizeof(redblack_queue_entry *));
+			calloc(2 * height, sizeof(redblack_queue_entry *));
 
 	// Place each tree item in one of the queues, based on the tree level.
-	redblack_tree_level_order_node(t, t->root, queue_array, 0);
+	redblack_tree_level_order_node(t, t->root, queue_array, height, 0);
 
 	// Iterate over each queue.
 	for (i = 0 ; i < height ; ++i) {
@@ -217,7 +423,8 @@ void redblack_tree_level_order(redblack_tree *t,
 		while (entry) {
 			redblack_queue_entry *trash;
 
-			visitor(entry->node, context, i);
+			if (!redblack_tree_is_tombstone(entry->node))
+				visitor(entry->node, context, i);
 
 			trash = entry;
 			entry = entry->next;
@@ -228,7 +435,7 @@ void redblack_tree_level_order(redblack_tree *t,
 	free(queue_array);
 }
 
-static uint32_t redblack_tree_height_node(redblack_tree_node *node)
+static uint64_t redblack_tree_height_node(redblack_tree_node *node)
 {
 	if (!node)
 		return 0;
@@ -236,7 +443,27 @@ static uint32_t redblack_tree_height_node(redblack_tree_node *node)
 				     redblack_tree_height_node(node->right));
 }
 
-uint32_t redblack_tree_height(redblack_tree *t)
+uint64_t redblack_tree_height(redblack_tree *t)
 {
+	redblack_tree_flush(t);
+
+	if (t->btree_key)
+		return redblack_btree_height(t);
+
 	return redblack_tree_height_node(t->root);
 }
+
+int redblack_tree_get_stats(redblack_tree *t, redblack_tree_stats *stats)
+{
+	*stats = t->stats;
+#ifdef RBT_STATS
+	return 1;
+#else
+	return 0;
+#endif // RBT_STATS
+}
+
+void redblack_tree_reset_stats(redblack_tree *t)
+{
+	memset(&t->stats, 0, sizeof(t->stats));
+}
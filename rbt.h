@@ -20,6 +20,8 @@
 #define __RBT_H__
 #include <stdlib.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
 
 typedef enum _redblack_tree_color
 {
@@ -33,24 +35,313 @@ typedef struct _redblack_tree_node {
 	struct _redblack_tree_node *parent;
 	struct _redblack_tree_node *left;
 	struct _redblack_tree_node *right;
-	int8_t color;
+	int64_t aggregate; // combined value of this subtree
+	int8_t color;      // or the rank, with RBT_BALANCE_WAVL
+	uint8_t flags;     // RBT_NODE_*
 } redblack_tree_node;
 
+#define RBT_NODE_TOMBSTONE 0x01 // removed lazily, awaiting compaction
+#define RBT_NODE_PENDING   0x02 // may be listed for redblack_tree_rebalance
+#define RBT_NODE_SLAB      0x04 // copied by redblack_tree_relayout, owned by the tree
+#define RBT_NODE_RECENT    0x08 // found or inserted since the clock hand last passed
+
 // for level-order traverse
 typedef struct _redblack_queue_entry {
 	redblack_tree_node *node;
 	struct _redblack_queue_entry *next;
 } redblack_queue_entry;
 
+// a write waiting in the buffer
+typedef struct _redblack_tree_buffered {
+	void *item;
+	redblack_tree_node *node; // node to insert, NULL for a remove
+	int remove;               // remove the stored item first
+} redblack_tree_buffered;
+
+// repairs deferred in relaxed mode (see redblack_tree_set_relaxed)
+typedef struct _redblack_tree_relaxed {
+	struct _redblack_tree_node **reds; // red nodes linked under a red parent
+	struct _redblack_tree_node **dead; // tombstones awaiting their removal
+	uint32_t num_reds;
+	uint32_t num_dead;
+	uint32_t capacity;                 // of each list
+} redblack_tree_relaxed;
+
+// nodes copied side by side by redblack_tree_relayout
+typedef struct _redblack_tree_slab {
+	struct _redblack_tree_node *nodes;
+	uint64_t size;
+	uint64_t used;                     // slots handed out, in order
+	uint64_t live;                     // of those, still in the tree
+} redblack_tree_slab;
+
+// state of redblack_tree_relayout
+typedef struct _redblack_tree_layout {
+	redblack_tree_slab *slabs;
+	uint32_t num_slabs;
+	uint32_t capacity;
+	int open;                          // slab being filled, or -1
+	struct _redblack_tree_node *next;  // next node to copy, NULL between passes
+} redblack_tree_layout;
+
+// CLOCK eviction state of a bounded tree (see redblack_tree_set_capacity)
+typedef struct _redblack_tree_clock {
+	uint64_t capacity;
+	redblack_tree_node *hand;  // next node to consider, NULL for the leftmost
+	void (*evict)(void *item, void *context);
+	void *context;
+	uint64_t evictions;
+} redblack_tree_clock;
+
+// counting Bloom filter in front of finds (see redblack_tree_set_filter)
+typedef struct _redblack_tree_filter {
+	uint64_t (*hash_item)(void * );
+	uint8_t *counters;         // two 4-bit counters per byte
+	uint64_t num_counters;
+	uint64_t capacity;         // items it is sized for
+	uint32_t num_hashes;
+	uint32_t bits_per_item;    // counters per item, in 1/16ths
+	uint64_t rejected;         // finds answered without a search
+	uint64_t passed;           // finds that searched
+	uint64_t false_positives;  // of those, finds that found nothing
+} redblack_tree_filter;
+
+typedef enum _redblack_tree_backend
+{
+	RBT_BACKEND_REDBLACK,
+	RBT_BACKEND_BTREE
+} redblack_tree_backend;
+
+// rebalancing of the red-black backend (see redblack_tree_set_balance)
+typedef enum _redblack_tree_balance
+{
+	RBT_BALANCE_REDBLACK,
+	RBT_BALANCE_WAVL      // weak AVL, the color field holds the rank
+} redblack_tree_balance;
+
+#ifndef RBT_BTREE_ORDER
+#define RBT_BTREE_ORDER 16 // keys per B+-tree node, a multiple of 4
+#endif
+
+typedef enum _redblack_tree_save_flags
+{
+	RBT_SAVE_IN_ORDER  = 0x0, // items only, reloaded as a balanced tree
+	RBT_SAVE_PRE_ORDER = 0x1, // items with colors, reloaded with the same shape
+	RBT_SAVE_DELTA     = 0x2  // encode items as deltas of integer keys
+} redblack_tree_save_flags;
+
+// byte stream for save / load - each callback returns 0 if it failed
+typedef struct _redblack_tree_stream {
+	int (*write)(void *context, const void *buf, size_t len);
+	int (*read)(void *context, void *buf, size_t len);
+	void *context;
+} redblack_tree_stream;
+
+// item encoding for save / load - each callback returns 0 if it failed
+typedef struct _redblack_tree_codec {
+	int (*save_item)(redblack_tree_stream *s, void *item);
+	int (*load_item)(redblack_tree_stream *s, void **item);
+	// used instead of save_item / load_item with RBT_SAVE_DELTA
+	int64_t (*item_key)(void *item);
+	void * (*key_item)(int64_t key);
+	// releases a loaded item the tree did not take, NULL if none need it
+	void (*free_item)(void *item);
+} redblack_tree_codec;
+
+// per-node aggregate, maintained for every subtree (see redblack_tree_set_aggregate)
+typedef struct _redblack_tree_aggregate {
+	int64_t identity;
+	int64_t (*value)(void *item);
+	int64_t (*combine)(int64_t , int64_t );
+} redblack_tree_aggregate;
+
+// operation counters, updated only when the library is built with RBT_STATS
+typedef struct _redblack_tree_stats {
+	uint64_t inserts;
+	uint64_t removes;
+	uint64_t finds;
+	uint64_t compares;
+	uint64_t rotations;
+	uint64_t insert_cases[5];  // cases 1, 2, 3, 4.1 and 4.2 in rbt_insert.c,
+	                           // or root, none, promote, rotate, double
+	                           // rotate in rbt_wavl.c
+	uint64_t remove_cases[6];  // cases 1 - 6 in rbt_remove.c, or root, leaf,
+	                           // demote, demote twice, rotate, double rotate
+	                           // in rbt_wavl.c
+	uint64_t allocations;
+	uint64_t frees;
+	uint64_t descent_depth;    // nodes visited by insert, remove and find
+	uint64_t max_depth;        // deepest node visited
+} redblack_tree_stats;
+
+// latency histogram bucket i counts operations taking [2^i, 2^(i+1)) ns
+#define RBT_LATENCY_BUCKETS 64
+
+typedef struct _redblack_tree_latency {
+	uint64_t counts[3][RBT_LATENCY_BUCKETS]; // by redblack_tree_trace_op - 1
+} redblack_tree_latency;
+
+typedef enum _redblack_tree_trace_op
+{
+	RBT_TRACE_INSERT = 1,
+	RBT_TRACE_FIND,
+	RBT_TRACE_REMOVE
+} redblack_tree_trace_op;
+
+typedef struct _redblack_tree_trace_record {
+	uint8_t op;          // redblack_tree_trace_op
+	uint8_t result;      // the operation succeeded / the item was found
+	int64_t key;
+	uint64_t time_ns;    // since the trace was started
+} redblack_tree_trace_record;
+
+// operation trace file, being written or read (see redblack_tree_trace_start)
+typedef struct _redblack_tree_trace {
+	int fd;
+	int error;
+	int64_t (*item_key)(void *item);
+	uint64_t start_ns;
+	uint64_t last_ns;
+	size_t len;
+	size_t pos;
+	uint8_t buf[4096];
+} redblack_tree_trace;
+
 typedef struct _redblack_tree {
 	redblack_tree_node *root;
+	redblack_tree_node *leftmost;     // smallest item, red-black backend
+	redblack_tree_node *rightmost;    // largest item, red-black backend
+	uint64_t count;
 	redblack_tree_node * (*allocate_node)(void *item);
 	void (*free_node)(redblack_tree_node * );
 	int64_t (*compare_items)(void * , void * );
 	redblack_queue_entry * (*allocate_entry)(redblack_tree_node * );
 	void (*free_entry)(redblack_queue_entry * );
+	redblack_tree_aggregate aggregate;
+	int64_t (*interval_start)(void * );
+	redblack_tree_trace *trace;
+	uint64_t (*hash_item)(void * );   // non-NULL when the hash index is used
+	redblack_tree_node **hash_table;  // open addressing, linear probing
+	uint64_t hash_capacity;           // power of two
+	struct _redblack_tree_buffered *buffer; // pending writes, sorted
+	uint32_t buffer_len;
+	uint32_t buffer_capacity;
+	uint64_t tombstones;              // nodes removed lazily
+	uint32_t tombstone_percent;       // 0 when removes are eager
+	uint64_t (*cache_hash)(void * );
+	redblack_tree_node **cache;       // hot-key cache, NULL when unused
+	uint64_t cache_mask;              // slots - 1
+	uint64_t cache_hits;
+	uint64_t cache_misses;
+	void *btree;                      // B+-tree backend root
+	int64_t (*btree_key)(void * );    // non-NULL when the B+-tree backend is used
+	uint8_t balance;                  // redblack_tree_balance
+	redblack_tree_relaxed *relaxed;   // NULL unless repairs are deferred
+	redblack_tree_layout *layout;     // NULL until nodes are relaid out
+	redblack_tree_filter *filter;     // NULL unless finds are filtered
+	redblack_tree_clock *clock;       // NULL unless the tree is bounded
+	struct _redblack_tree_arena *arena; // nodes live in a mapped file
+	redblack_tree_latency *latency;   // NULL unless histograms are kept
+	redblack_tree_stats stats;
 } redblack_tree;
 
+#define RBT_REPORT_MAX_DEPTH 128
+
+// memory and shape report (see redblack_tree_analyze)
+typedef struct _redblack_tree_report {
+	uint64_t num_nodes;
+	uint64_t node_bytes;        // sizeof(redblack_tree_node)
+	uint64_t alloc_bytes;       // node_bytes plus estimated malloc overhead
+	uint64_t height;            // nodes on the longest path
+	uint64_t black_height;      // black nodes on every root-to-leaf path, 0 for WAVL
+	uint64_t depth_histogram[RBT_REPORT_MAX_DEPTH]; // nodes per depth, root = 0
+	double avg_depth;           // mean depth of a node, root = 0
+	double red_ratio;           // share of red nodes, 0 for WAVL
+	double line_changes;        // share of in-order steps to another cache line
+	double page_changes;        // share of in-order steps to another page
+	double parent_page_changes; // share of nodes on another page than their parent
+} redblack_tree_report;
+
+// write-ahead log of inserts and removes (see redblack_tree_journal_open)
+typedef struct _redblack_tree_journal {
+	redblack_tree *t;
+	const redblack_tree_codec *codec;
+	int fd;
+	int error;            // a record could not be logged or committed
+	uint8_t *buf;         // records not yet written
+	size_t len;
+	size_t capacity;
+	uint32_t sync_batch;  // records per group commit, 0 for manual commits
+	uint32_t pending;     // records since the last commit
+} redblack_tree_journal;
+
+// image being saved by a child process (see redblack_tree_snapshot_async)
+typedef struct _redblack_tree_snapshot {
+	pid_t pid;    // child saving the image, 0 once it was reaped
+	int result;   // 1 if the child saved the image
+} redblack_tree_snapshot;
+
+// nodes taken out of a tree, still to be freed (see redblack_tree_detach)
+typedef struct _redblack_tree_reclaim {
+	redblack_tree_node *root;       // red-black nodes left
+	void *btree;                    // B+-tree backend root left
+	redblack_tree_layout *layout;   // slabs of relaid-out nodes, freed last
+	void (*free_node)(redblack_tree_node * );
+	pthread_t thread;
+	int running;                    // thread started and not yet joined
+} redblack_tree_reclaim;
+
+// memory-mapped file holding the nodes (see redblack_tree_arena_open)
+typedef struct _redblack_tree_arena {
+	redblack_tree *t;
+	int fd;
+	uint8_t *base;
+	uint64_t capacity; // bytes reserved for the mapping
+	size_t item_size;
+	int dirty;         // the file was marked as changed since the last sync
+} redblack_tree_arena;
+
+// a request published by one thread to the flat-combining front end
+typedef struct _redblack_tree_fc_slot {
+	void *item;
+	redblack_tree_node *node; // result of a find
+	int op;                   // RBT_TRACE_INSERT, _FIND, _REMOVE or a rebalance
+	int result;
+	int pending;              // set by the owner, cleared once done
+} __attribute__((aligned(64))) redblack_tree_fc_slot;
+
+// flat-combining front end (see redblack_tree_fc_init)
+typedef struct _redblack_tree_fc {
+	redblack_tree *t;
+	pthread_mutex_t lock;
+	redblack_tree_fc_slot *slots;
+	redblack_tree_fc_slot **batch; // combiner scratch
+	uint32_t num_slots;
+	uint32_t registered;
+	uint64_t combines;             // batches run
+	uint64_t combined;             // requests run in them
+} redblack_tree_fc;
+
+// position of a merge in one of its trees
+typedef struct _redblack_tree_merge_cursor {
+	redblack_tree *t;
+	redblack_tree_node *node; // next in this tree, NULL once it is done
+	void *item;               // node->item
+	redblack_tree_node **stack; // ancestors still to visit, red-black backend
+	uint32_t top;
+	void *leaf;               // with the B+-tree backend, leaf holding node
+	uint32_t pos;             // and its index in there
+} redblack_tree_merge_cursor;
+
+// ordered union of several trees (see redblack_tree_merge_init)
+typedef struct _redblack_tree_merge {
+	redblack_tree_merge_cursor *cursors;
+	uint32_t *losers;         // tournament: [0] the winner, [p] the loser at p
+	redblack_tree_node **stacks;
+	uint32_t num_trees;
+	int distinct;
+} redblack_tree_merge;
+
 void redblack_tree_init(redblack_tree *t,
 		redblack_tree_node * (*allocate_node)(void *item),
 		void (*free_node)(redblack_tree_node * ),
@@ -60,13 +351,34 @@ void redblack_tree_init(redblack_tree *t,
 
 void redblack_tree_destroy(redblack_tree *t);
 
+// Empty t without freeing its nodes: they are handed over to r, whatever
+// the size of the tree, and t can be used again right away, configured
+// as it was. Free them with redblack_tree_reclaim_step or
+// redblack_tree_reclaim_start, then redblack_tree_reclaim_wait. Not for
+// arena trees, 0 then.
+int redblack_tree_detach(redblack_tree *t, redblack_tree_reclaim *r);
+
+// Free detached nodes for up to budget steps, each freeing a node or
+// rotating one out of the way. No stack or allocation is needed. 1 while
+// some are left.
+int redblack_tree_reclaim_step(redblack_tree_reclaim *r, uint64_t budget);
+
+// Free the detached nodes on a thread of their own, so free_node must be
+// safe to call from it while the tree allocates. 0 if the thread can't be
+// started, leaving the nodes to redblack_tree_reclaim_step.
+int redblack_tree_reclaim_start(redblack_tree_reclaim *r);
+
+// Wait for the thread, or free what is left on this one.
+void redblack_tree_reclaim_wait(redblack_tree_reclaim *r);
+
 // 0 if insertion failed
 int redblack_tree_insert(redblack_tree *t, void *item);
 
 // 0 if removal failed
 int redblack_tree_remove(redblack_tree *t, void *item);
 
-uint32_t redblack_tree_num_items(redblack_tree *t);
+// O(1)
+uint64_t redblack_tree_num_items(redblack_tree *t);
 
 // NULL if not found
 redblack_tree_node * redblack_tree_find(redblack_tree *t,
@@ -85,9 +397,383 @@ void redblack_tree_post_order(redblack_tree *t,
 			      void *context);
 
 void redblack_tree_level_order(redblack_tree *t,
-			       void (*visitor)(redblack_tree_node *node, void *context, int level),
+			       void (*visitor)(redblack_tree_node *node, void *context, uint64_t level),
+			       void *context);
+
+uint64_t redblack_tree_height(redblack_tree *t);
+
+// One iterative O(n) pass, without allocation. The deepest buckets of
+// the depth histogram absorb anything deeper than RBT_REPORT_MAX_DEPTH.
+void redblack_tree_analyze(redblack_tree *t, redblack_tree_report *report);
+
+// Record every insert, find and remove on t, with its key, result and
+// time, to a new trace file at path. 0 if the file can't be created.
+int redblack_tree_trace_start(redblack_tree *t,
+			      redblack_tree_trace *trace,
+			      const char *path,
+			      int64_t (*item_key)(void *item));
+
+// Flush and close the trace. 0 if any record could not be written.
+int redblack_tree_trace_stop(redblack_tree *t);
+
+// Read back a trace file, one record per call to redblack_tree_trace_next.
+int redblack_tree_trace_open(redblack_tree_trace *trace, const char *path);
+
+// 0 at the end of the trace
+int redblack_tree_trace_next(redblack_tree_trace *trace,
+			     redblack_tree_trace_record *record);
+
+void redblack_tree_trace_close(redblack_tree_trace *trace);
+
+// Copy the operation counters. 0 if the library was built without
+// RBT_STATS, in which case the counters are all zero.
+int redblack_tree_get_stats(redblack_tree *t, redblack_tree_stats *stats);
+
+void redblack_tree_reset_stats(redblack_tree *t);
+
+// Keep per-operation latency histograms for insert, find and remove, or
+// stop keeping them with on = 0. They are updated with relaxed atomics,
+// so another thread may read them while the tree is in use; switching
+// them on or off must not race with operations. 0 if out of memory.
+int redblack_tree_set_latency_histograms(redblack_tree *t, int on);
+
+// Copy the histogram of op (a redblack_tree_trace_op). 0 if histograms
+// are not kept, in which case counts is all zero.
+int redblack_tree_get_latency(redblack_tree *t,
+			      int op,
+			      uint64_t counts[RBT_LATENCY_BUCKETS]);
+
+void redblack_tree_reset_latency(redblack_tree *t);
+
+// Select the structure behind the redblack_tree API, on an empty tree.
+// RBT_BACKEND_BTREE stores the nodes from allocate_node in a B+-tree of
+// RBT_BTREE_ORDER keys per node, searched by item_key, which must order
+// items exactly as compare_items does. Traversals then all visit items
+// in key order, level_order with the B+-tree level of the items.
+// Aggregates, interval mode, analysis, lazy removal, relaxed balance,
+// capacities and pre-order saves are only available with the red-black
+// backend. 0 if the backend can't be used.
+int redblack_tree_set_backend(redblack_tree *t,
+			      redblack_tree_backend backend,
+			      int64_t (*item_key)(void *item));
+
+// Select how the red-black backend rebalances, on an empty tree.
+// RBT_BALANCE_WAVL keeps a weak AVL tree instead: the same nodes with a
+// rank in place of the color, at most two rotations per insert or remove
+// and, until items are removed, the height of an AVL tree. Pre-order
+// saves and arena files keep the ranks, and must be loaded or reopened
+// in the same mode. 0 with the B+-tree backend, relaxed balance or an
+// arena.
+int redblack_tree_set_balance(redblack_tree *t, redblack_tree_balance balance);
+
+// Defer the repairs of the red-black backend. An insert that links a red
+// node under a red parent, and a remove that would unlink a black leaf,
+// only record the node - the latter as a tombstone, like lazy removal -
+// and redblack_tree_rebalance repairs them later. Black heights stay
+// equal throughout, only red nodes may follow each other, so paths can
+// grow by as many nodes as are pending. Up to max_pending of each kind
+// are kept; beyond that writes repair as they go. 0 rebalances
+// and returns to immediate repairs. Not with WAVL, lazy removal, an
+// arena, a capacity or the B+-tree backend; 0 then, or if out of memory.
+int redblack_tree_set_relaxed(redblack_tree *t, uint32_t max_pending);
+
+// Repair up to budget recorded nodes, all of them if budget is 0, and
+// return how many are left; with none left, the tree is a valid
+// red-black tree. Saves, compaction and redblack_tree_set_relaxed
+// rebalance fully first.
+uint32_t redblack_tree_rebalance(redblack_tree *t, uint32_t budget);
+
+// Copy every node of the red-black backend, in key order, into one
+// contiguous slab owned by the tree, relink them and release the old
+// ones, so that scans walk memory sequentially and the last levels of a
+// search stay within a page. Nodes from earlier slabs move as well; the
+// tree frees a slab once all of its nodes are gone, without calling
+// free_node. Node pointers found before are invalid afterwards. Not
+// with an arena or the B+-tree backend. 0 then or if out of memory.
+int redblack_tree_relayout(redblack_tree *t);
+
+// Incremental redblack_tree_relayout: start a pass, or continue the
+// current one, copying up to budget nodes. Writes may run between the
+// steps; nodes inserted behind the pass keep their place until the next
+// one. Compaction ends a pass early. 1 while the pass has nodes left, 0
+// once it is done or could not get memory.
+int redblack_tree_relayout_step(redblack_tree *t, uint32_t budget);
+
+// Keep an open-addressing hash index from items to their nodes, so that
+// redblack_tree_find costs O(1) on average. hash_item must give equal
+// hashes to items that compare equal. Ordered operations still use the
+// tree. Should the index fail to grow during an insert, it is dropped
+// and finds fall back to the tree. Pass NULL to drop the index.
+// 0 if the index could not be allocated.
+int redblack_tree_set_hash_index(redblack_tree *t,
+				 uint64_t (*hash_item)(void *item));
+
+// Put a direct-mapped cache of recently found nodes in front of
+// redblack_tree_find, for skewed lookups. slots is rounded up to a power
+// of two; the cache is indexed by hash_item, which must give equal hashes
+// to items that compare equal. Pass 0 slots to remove the cache;
+// redblack_tree_destroy removes it as well. 0 if the cache could not be allocated.
+int redblack_tree_set_cache(redblack_tree *t,
+			    uint32_t slots,
+			    uint64_t (*hash_item)(void *item));
+
+// Finds answered from the cache and finds that had to search, since the
+// cache was set.
+void redblack_tree_get_cache_stats(redblack_tree *t,
+				   uint64_t *hits,
+				   uint64_t *misses);
+
+// Put a counting Bloom filter in front of redblack_tree_find and
+// redblack_tree_remove, so that most searches for absent items end
+// after a few hashes instead of a descent. It is sized for
+// expected_items at a false-positive rate of fp_rate, between 0 and 1,
+// and rebuilt twice as large whenever the tree outgrows it. hash_item
+// must give equal hashes to items that compare equal. Each item costs
+// about 0.7 * log2(1 / fp_rate) bytes, 4.8 at 1%. Pass NULL to remove
+// the filter; redblack_tree_destroy removes it as well. 0 if the filter
+// could not be allocated or fp_rate is out of range.
+int redblack_tree_set_filter(redblack_tree *t,
+			     uint64_t expected_items,
+			     double fp_rate,
+			     uint64_t (*hash_item)(void *item));
+
+// Bound t to capacity items, making it an ordered cache. Inserting past
+// capacity evicts an item the second-chance CLOCK way: a hand sweeps the
+// nodes in key order, passing over, and clearing, the reference bit
+// that finds and inserts set, until it meets a node without it, which is
+// unlinked directly, with no search. evict, unless NULL, is then called
+// with its item and context. Items beyond a new capacity are evicted
+// right away. Pass 0 to unbound t; redblack_tree_destroy does so as well.
+// Not with the B+-tree backend, a write buffer, relaxed balance or an
+// arena. 0 if t can't be bounded.
+int redblack_tree_set_capacity(redblack_tree *t,
+			       uint64_t capacity,
+			       void (*evict)(void *item, void *context),
 			       void *context);
 
-uint32_t redblack_tree_height(redblack_tree *t);
+// Finds the filter answered, finds it let through, and how many of
+// those found nothing, since the filter was set.
+void redblack_tree_get_filter_stats(redblack_tree *t,
+				    uint64_t *rejected,
+				    uint64_t *passed,
+				    uint64_t *false_positives);
+
+// Make redblack_tree_remove only mark the node as a tombstone, skipping
+// the repair. Finds and traversals skip tombstones, and inserting the
+// item again revives its node. Once tombstones exceed max_percent of the
+// nodes in the tree, they are compacted away in one pass; 100 compacts
+// only when asked. 0 compacts and returns to eager removal. Red-black
+// backend without relaxed balance only; 0 otherwise.
+int redblack_tree_set_lazy_remove(redblack_tree *t, uint32_t max_percent);
+
+// The node holding the smallest or largest item, NULL if the tree is
+// empty. O(1) with the red-black backend, which keeps both up to date.
+redblack_tree_node * redblack_tree_min_node(redblack_tree *t);
+
+redblack_tree_node * redblack_tree_max_node(redblack_tree *t);
+
+// Remove the smallest or largest item, returned in *item, without
+// searching for it. Items of an arena are only valid until the next
+// insert. 0 if the tree is empty.
+int redblack_tree_pop_min(redblack_tree *t, void **item);
+
+int redblack_tree_pop_max(redblack_tree *t, void **item);
+
+// Merge pending writes, then free every tombstone and rebuild the tree
+// balanced, in O(n).
+void redblack_tree_compact(redblack_tree *t);
+
+// Absorb up to capacity inserts and removes in a sorted array, merged
+// into the tree in one ordered pass when it fills up. The array costs
+// O(capacity) moves per write, so a few hundred entries suit best. Each insert of the
+// pass starts its descent from the previous node instead of the root.
+// Finds check the buffer first; everything else merges it first. While
+// buffered, insert and remove can't see the tree: they return 1 unless
+// the buffer shows the call has no effect, and an insert of an item
+// already in the tree is dropped by the merge. Items passed to remove
+// must stay valid until the merge. 0 merges and removes the
+// buffer, as does redblack_tree_destroy, which drops pending writes.
+// Red-black backend without an arena or a capacity only; 0 if the buffer
+// can't be used.
+int redblack_tree_set_write_buffer(redblack_tree *t, uint32_t capacity);
+
+// Merge the pending writes of the write buffer into the tree.
+void redblack_tree_flush(redblack_tree *t);
+
+// Register a per-node aggregate. combine must be associative and identity
+// must be its neutral element. The aggregate of every subtree is kept up to
+// date through insert and remove. Pass NULL to disable.
+// 0 on a B+-tree backend, which keeps no aggregates.
+int redblack_tree_set_aggregate(redblack_tree *t,
+				const redblack_tree_aggregate *aggregate);
+
+// Combined value of all items in [lo, hi], O(log n).
+// identity if the range is empty or no aggregate is registered.
+int64_t redblack_tree_range_aggregate(redblack_tree *t, void *lo, void *hi);
+
+// 0 if save failed
+int redblack_tree_save(redblack_tree *t,
+		       redblack_tree_stream *s,
+		       const redblack_tree_codec *codec,
+		       int flags);
+
+// Rebuild an empty tree from redblack_tree_save output in O(n), without
+// comparisons or rotations. A tree bounded by redblack_tree_set_capacity
+// then evicts down to its capacity. 0 if load failed, leaving the tree
+// empty and the items loaded so far with codec->free_item.
+int redblack_tree_load(redblack_tree *t,
+		       redblack_tree_stream *s,
+		       const redblack_tree_codec *codec);
+
+// Journal the mutations of t to the log file at path, appending to it.
+// Every sync_batch records are written with one write and one fdatasync.
+// codec->save_item encodes each record. 0 if the log can't be opened.
+int redblack_tree_journal_open(redblack_tree_journal *j,
+			       redblack_tree *t,
+			       const char *path,
+			       const redblack_tree_codec *codec,
+			       uint32_t sync_batch);
+
+// redblack_tree_insert / redblack_tree_remove, logging successful calls.
+// 0 if the tree didn't change, or if the journal has failed (j->error):
+// a record that can't be encoded leaves the tree unchanged, but one whose
+// group commit failed leaves the change in the tree, ahead of the log.
+int redblack_tree_journal_insert(redblack_tree_journal *j, void *item);
+int redblack_tree_journal_remove(redblack_tree_journal *j, void *item);
+
+// Write and fdatasync the pending records. 0 if the journal has failed.
+int redblack_tree_journal_commit(redblack_tree_journal *j);
+
+// Discard the log once a snapshot covering it has been saved.
+int redblack_tree_journal_truncate(redblack_tree_journal *j);
+
+// Commit and close. 0 if the journal has failed.
+int redblack_tree_journal_close(redblack_tree_journal *j);
+
+// Re-apply the log at path on top of t (typically just loaded from the
+// last snapshot). A torn record at the end of the log, left by a crash
+// during a commit, ends the replay, so save a new snapshot and truncate
+// the log before journaling again. A missing log replays nothing.
+// Items of remove records, the items they take out of the tree, and
+// items of inserts the tree did not take go to codec->free_item; with a
+// write buffer, an insert the merge drops as a duplicate is not
+// released. 0 if the log could not be read or holds an unknown record.
+int redblack_tree_journal_replay(redblack_tree *t,
+				 const char *path,
+				 const redblack_tree_codec *codec);
+
+// Save t as redblack_tree_save would, to the file at path, from a child
+// process forked with a copy-on-write image of the tree. Writers only
+// wait for the fork; the tree may then change freely, while the child
+// saves it as it was at the call. The image is written beside path and
+// renamed over it once synced, and the directory is synced after the
+// rename, so path always holds a complete image.
+// The child may only make async-signal-safe calls, since the library
+// may run threads of its own, and so may codec->save_item. Call with no
+// other thread using t. Not for arena trees, whose shared mapping the
+// child would see changing. 0 if the file can't be created or the child
+// can't be started.
+int redblack_tree_snapshot_async(redblack_tree_snapshot *snap,
+				 redblack_tree *t,
+				 const char *path,
+				 const redblack_tree_codec *codec,
+				 int flags);
+
+// 1 once the child has exited, so that redblack_tree_snapshot_wait
+// won't block.
+int redblack_tree_snapshot_done(redblack_tree_snapshot *snap);
+
+// Wait for the child. 1 if the image at path is complete.
+int redblack_tree_snapshot_wait(redblack_tree_snapshot *snap);
+
+// Keep the nodes of the empty tree t in the file at path, so that a
+// later open finds the tree ready to use, without a load. Nodes are
+// fixed-size slots carrying a copy of item_size bytes from the item
+// passed to insert; node->item points at that copy, which must not hold
+// pointers, and the node context is not kept. capacity bounds the file
+// size when it is created. The file is mapped where it was last mapped
+// when that range is free, else every link is relocated once, in a
+// linear pass. allocate_node and free_node are not called while open.
+// Red-black backend without a write buffer, relaxed balance or a
+// capacity only, in the balance mode the file was created in. 0 if the file can't be used,
+// which includes a file left changed after its last sync by a crash.
+int redblack_tree_arena_open(redblack_tree_arena *a,
+			     redblack_tree *t,
+			     const char *path,
+			     size_t item_size,
+			     uint64_t capacity);
+
+// Make the file match the tree, a durability point: writes in between
+// may reach the file in any order, so the first change after a sync
+// marks the file, and open refuses it until the next sync clears the
+// mark. Inserts and removes fail while the mark can't be written.
+// Where a crash must not lose the tree, pair the arena with the journal
+// and recover from a save. 0 if the file couldn't be synced.
+int redblack_tree_arena_sync(redblack_tree_arena *a);
+
+// Sync and unmap; t is left empty.
+int redblack_tree_arena_close(redblack_tree_arena *a);
+
+// Share t between threads through flat combining: each thread publishes
+// its request in its own slot, and whichever thread takes the lock runs
+// every pending request in one batch, sorted by item so the descents
+// share warm paths. Up to max_threads threads, each registering once.
+// 0 if the slots could not be allocated.
+int redblack_tree_fc_init(redblack_tree_fc *fc, redblack_tree *t, uint32_t max_threads);
+
+void redblack_tree_fc_destroy(redblack_tree_fc *fc);
+
+// Claim a slot for the calling thread, -1 if all are taken.
+int redblack_tree_fc_register(redblack_tree_fc *fc);
+
+int redblack_tree_fc_insert(redblack_tree_fc *fc, int slot, void *item);
+
+int redblack_tree_fc_remove(redblack_tree_fc *fc, int slot, void *item);
+
+// The node found may be freed as soon as any thread removes its item.
+redblack_tree_node * redblack_tree_fc_find(redblack_tree_fc *fc, int slot, void *item);
+
+// redblack_tree_rebalance through the front end, so that a background
+// thread can repair a relaxed tree in slices between the other requests.
+uint32_t redblack_tree_fc_rebalance(redblack_tree_fc *fc, int slot, uint32_t budget);
+
+// Iterate over the union of num_trees trees in key order, with a
+// tournament tree over one cursor per tree: log2(num_trees) compares per
+// item and no copies. Items that compare equal come in the order of their trees,
+// or, with distinct set, only the one from the first tree. The trees
+// must share an ordering, that of trees[0]->compare_items, and must not
+// change until redblack_tree_merge_destroy; pending writes and repairs
+// are applied first. 0 if out of memory.
+int redblack_tree_merge_init(redblack_tree_merge *m,
+			     redblack_tree **trees,
+			     uint32_t num_trees,
+			     int distinct);
+
+// The next node, NULL at the end. *tree, if not NULL, gets the index of
+// the tree holding it.
+redblack_tree_node * redblack_tree_merge_next(redblack_tree_merge *m, uint32_t *tree);
+
+void redblack_tree_merge_destroy(redblack_tree_merge *m);
+
+// Interval tree mode: each item is a half-open interval [start, end) and
+// compare_items must order items by start first. The subtree maximum end
+// is kept in the aggregate, so this replaces any registered aggregate.
+// Pass NULL callbacks to disable. 0 on a B+-tree backend.
+int redblack_tree_set_interval(redblack_tree *t,
+			       int64_t (*interval_start)(void *item),
+			       int64_t (*interval_end)(void *item));
+
+// Visit, in order, every interval overlapping [start, end).
+void redblack_tree_overlap(redblack_tree *t,
+			   int64_t start,
+			   int64_t end,
+			   void (*visitor)(redblack_tree_node *node, void *context),
+			   void *context);
+
+// Visit, in order, every interval containing point.
+void redblack_tree_stab(redblack_tree *t,
+			int64_t point,
+			void (*visitor)(redblack_tree_node *node, void *context),
+			void *context);
 
 #endif // __RBT_H__
@@ -0,0 +1,140 @@
+/*
+** rbt_analyze.c : implementation of Red-Black Tree analysis
+** Copyright (C) 2018  Tim Whisonant
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#include <string.h>
+#include <unistd.h>
+
+#include "rbt.h"
+#include "rbt_util.h"
+
+#define RBT_CACHE_LINE 64
+
+/*
+** Size of a malloc chunk holding bytes: a size_t header, rounded up to
+** a 2 * size_t alignment, with a minimum chunk of four size_t. This is
+** the glibc layout; other allocators are in the same range.
+*/
+static uint64_t redblack_tree_alloc_estimate(uint64_t bytes)
+{
+	uint64_t align = 2 * sizeof(size_t);
+	uint64_t chunk = (bytes + sizeof(size_t) + align - 1) & ~(align - 1);
+
+	return redblack_tree_max(chunk, (uint64_t) (4 * sizeof(size_t)));
+}
+
+static inline int redblack_tree_same_block(redblack_tree_node *a,
+					   redblack_tree_node *b,
+					   uintptr_t block)
+{
+	return ((uintptr_t) a / block) == ((uintptr_t) b / block);
+}
+
+void redblack_tree_analyze(redblack_tree *t, redblack_tree_report *report)
+{
+	redblack_tree_node *node;
+	redblack_tree_node *prev = NULL;
+	redblack_tree_node *last = NULL;
+	uintptr_t page = (uintptr_t) sysconf(_SC_PAGESIZE);
+	uint64_t depth = 0;
+	uint64_t total_depth = 0;
+	uint64_t num_red = 0;
+	uint64_t line_changes = 0;
+	uint64_t page_changes = 0;
+	uint64_t parent_page_changes = 0;
+
+	memset(report, 0, sizeof(*report));
+
+	redblack_tree_flush(t);
+	node = t->root;
+
+	report->node_bytes = sizeof(redblack_tree_node);
+	report->alloc_bytes = redblack_tree_alloc_estimate(sizeof(redblack_tree_node));
+
+	// ranks are no colors
+	for (node = t->balance == RBT_BALANCE_WAVL ? NULL : t->root ;
+	     node ; node = node->left)
+		if (node->color == RBT_BLACK)
+			++report->black_height;
+
+	/*
+	** In-order walk using the parent links. prev is the node we came
+	** from, which tells whether node's left subtree is done.
+	*/
+	node = t->root;
+
+	while (node) {
+
+		if (prev == node->parent) {
+			// first arrival - the left subtree comes first
+			if (node->left) {
+				prev = node;
+				node = node->left;
+				++depth;
+				continue;
+			}
+		} else if (prev != node->left) {
+			// back from the right subtree - node is finished
+			prev = node;
+			node = node->parent;
+			--depth;
+			continue;
+		}
+
+		// visit
+		++report->num_nodes;
+		++report->depth_histogram[redblack_tree_min(depth,
+					(uint64_t) RBT_REPORT_MAX_DEPTH - 1)];
+		total_depth += depth;
+		report->height = redblack_tree_max(report->height, depth + 1);
+
+		if (node->color == RBT_RED && t->balance != RBT_BALANCE_WAVL)
+			++num_red;
+
+		if (node->parent && !redblack_tree_same_block(node, node->parent, page))
+			++parent_page_changes;
+
+		if (last) {
+			if (!redblack_tree_same_block(node, last, RBT_CACHE_LINE))
+				++line_changes;
+			if (!redblack_tree_same_block(node, last, page))
+				++page_changes;
+		}
+		last = node;
+
+		prev = node;
+		if (node->right) {
+			node = node->right;
+			++depth;
+		} else {
+			node = node->parent;
+			--depth;
+		}
+	}
+
+	if (!report->num_nodes)
+		return;
+
+	report->avg_depth = (double) total_depth / report->num_nodes;
+	report->red_ratio = (double) num_red / report->num_nodes;
+	report->parent_page_changes = (double) parent_page_changes / report->num_nodes;
+
+	if (report->num_nodes > 1) {
+		report->line_changes = (double) line_changes / (report->num_nodes - 1);
+		report->page_changes = (double) page_changes / (report->num_nodes - 1);
+	}
+}
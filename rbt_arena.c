@@ -0,0 +1,332 @@
+/*
+** rbt_arena.c : memory-mapped node arena for Red-Black Trees
+** Copyright (C) 2018  Tim Whisonant
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "rbt.h"
+#include "rbt_util.h"
+
+/*
+** File layout: a header, then slots of slot_size bytes, each a node
+** followed by its item. All links are addresses within the mapping as
+** of header.base. Free slots are chained through their left link.
+** dirty is written through before the first change after a sync, and
+** cleared once a sync made the whole file match the tree.
+*/
+#define RBT_ARENA_VERSION 2
+#define RBT_ARENA_GROW    (1u << 20) // file growth step
+#define RBT_NODE_FREE     0x80       // slot on the free list
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0 // the address is then only a hint
+#endif
+
+typedef struct _redblack_tree_arena_header {
+	char magic[8];
+	uint64_t version;
+	uint64_t base;      // address the file was last mapped at
+	uint64_t capacity;
+	uint64_t item_size;
+	uint64_t slot_size;
+	uint64_t used;      // bytes of header and slots handed out
+	uint64_t file_size;
+	uint64_t free_list; // first free slot
+	uint64_t root;
+	uint64_t count;
+	uint64_t balance;   // redblack_tree_balance the nodes were built in
+	uint64_t dirty;     // changed since the last sync
+} __attribute__((aligned(64))) redblack_tree_arena_header;
+
+#define RBT_ARENA_ITEM_OFFSET \
+	((sizeof(redblack_tree_node) + 15) & ~(size_t) 15)
+
+static inline redblack_tree_arena_header * redblack_tree_arena_header_of(redblack_tree_arena *a)
+{
+	return (redblack_tree_arena_header *) a->base;
+}
+
+redblack_tree_node * redblack_tree_arena_alloc(redblack_tree *t, void *item)
+{
+	redblack_tree_arena *a = t->arena;
+	redblack_tree_arena_header *h = redblack_tree_arena_header_of(a);
+	redblack_tree_node *node;
+	uint64_t size;
+
+	if (!redblack_tree_arena_change(t))
+		return NULL;
+
+	if (h->free_list) {
+		node = (redblack_tree_node *) h->free_list;
+		h->free_list = (uint64_t) node->left;
+	} else {
+		if (h->used + h->slot_size > h->capacity)
+			return NULL;
+
+		if (h->used + h->slot_size > h->file_size) {
+			size = h->file_size + RBT_ARENA_GROW;
+			if (size > h->capacity)
+				size = h->capacity;
+			if (ftruncate(a->fd, (off_t) size))
+				return NULL;
+			h->file_size = size;
+		}
+
+		node = (redblack_tree_node *) (a->base + h->used);
+		h->used += h->slot_size;
+	}
+
+	memset(node, 0, sizeof(redblack_tree_node));
+	node->item = (uint8_t *) node + RBT_ARENA_ITEM_OFFSET;
+	memcpy(node->item, item, h->item_size);
+	return node;
+}
+
+void redblack_tree_arena_free(redblack_tree *t, redblack_tree_node *node)
+{
+	redblack_tree_arena_header *h = redblack_tree_arena_header_of(t->arena);
+
+	// the slot then stays as the file last synced it
+	if (!redblack_tree_arena_change(t))
+		return;
+
+	node->flags = RBT_NODE_FREE;
+	node->left = (redblack_tree_node *) h->free_list;
+	h->free_list = (uint64_t) node;
+}
+
+int redblack_tree_arena_mark_dirty(redblack_tree_arena *a)
+{
+	redblack_tree_arena_header *h = redblack_tree_arena_header_of(a);
+
+	// a mark left in memory only errs on the safe side
+	h->dirty = 1;
+	if (msync(a->base, sizeof(*h), MS_SYNC))
+		return 0;
+	a->dirty = 1;
+	return 1;
+}
+
+#define redblack_tree_arena_move(p, delta) \
+	((p) ? (__typeof__(p)) ((uint8_t *) (p) + (delta)) : NULL)
+
+/*
+** The range the file was last mapped at is taken: shift every link by
+** the distance moved. Slots are visited in file order, not tree order.
+*/
+static void redblack_tree_arena_relocate(redblack_tree_arena *a)
+{
+	redblack_tree_arena_header *h = redblack_tree_arena_header_of(a);
+	ptrdiff_t delta = (ptrdiff_t) ((uintptr_t) a->base - (uintptr_t) h->base);
+	redblack_tree_node *node;
+	uint64_t offset;
+
+	for (offset = sizeof(*h) ; offset < h->used ; offset += h->slot_size) {
+		node = (redblack_tree_node *) (a->base + offset);
+		node->left = redblack_tree_arena_move(node->left, delta);
+		if (node->flags & RBT_NODE_FREE)
+			continue;
+		node->right = redblack_tree_arena_move(node->right, delta);
+		node->parent = redblack_tree_arena_move(node->parent, delta);
+		node->item = (uint8_t *) node + RBT_ARENA_ITEM_OFFSET;
+	}
+
+	if (h->free_list)
+		h->free_list += delta;
+	if (h->root)
+		h->root += delta;
+	h->base = (uint64_t) a->base;
+}
+
+// the header of an existing file describes slots within it
+static int redblack_tree_arena_valid(const redblack_tree_arena_header *h,
+				     size_t item_size,
+				     uint64_t file_size)
+{
+	uint64_t slot_size = (RBT_ARENA_ITEM_OFFSET + item_size + 15) & ~(uint64_t) 15;
+	uint64_t slots;
+
+	if (h->slot_size != slot_size ||
+	    h->used < sizeof(*h) || h->used > h->file_size ||
+	    h->file_size > file_size || h->file_size > h->capacity ||
+	    (h->used - sizeof(*h)) % slot_size)
+		return 0;
+
+	slots = (h->used - sizeof(*h)) / slot_size;
+	if (h->count > slots)
+		return 0;
+
+	// links to a slot, relative to where the file was mapped
+	if (h->root && (h->root - h->base < sizeof(*h) ||
+			h->root - h->base >= h->used ||
+			(h->root - h->base - sizeof(*h)) % slot_size))
+		return 0;
+	if (h->free_list && (h->free_list - h->base < sizeof(*h) ||
+			     h->free_list - h->base >= h->used ||
+			     (h->free_list - h->base - sizeof(*h)) % slot_size))
+		return 0;
+
+	return 1;
+}
+
+static int redblack_tree_arena_map(redblack_tree_arena *a, void *want)
+{
+	void *p = MAP_FAILED;
+
+	if (want)
+		p = mmap(want, a->capacity, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_FIXED_NOREPLACE, a->fd, 0);
+	if (p == MAP_FAILED)
+		p = mmap(NULL, a->capacity, PROT_READ | PROT_WRITE,
+			 MAP_SHARED, a->fd, 0);
+	if (p == MAP_FAILED)
+		return 0;
+
+	a->base = (uint8_t *) p;
+	return 1;
+}
+
+int redblack_tree_arena_open(redblack_tree_arena *a,
+			     redblack_tree *t,
+			     const char *path,
+			     size_t item_size,
+			     uint64_t capacity)
+{
+	redblack_tree_arena_header h;
+	struct stat st;
+	ssize_t got;
+
+	if (t->root || t->btree_key || t->arena || t->buffer ||
+	    t->relaxed || t->clock)
+		return 0;
+
+	a->t = t;
+	a->item_size = item_size;
+	a->dirty = 0;
+	a->fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (a->fd < 0)
+		return 0;
+
+	if (fstat(a->fd, &st))
+		goto out_close;
+
+	if (st.st_size) {
+		got = pread(a->fd, &h, sizeof(h), 0);
+		if (got != (ssize_t) sizeof(h) ||
+		    memcmp(h.magic, "RBTARENA", 8) ||
+		    h.version != RBT_ARENA_VERSION ||
+		    h.item_size != item_size ||
+		    h.balance != (uint64_t) t->balance ||
+		    h.dirty ||
+		    !redblack_tree_arena_valid(&h, item_size, (uint64_t) st.st_size))
+			goto out_close;
+
+		a->capacity = h.capacity;
+		if (!redblack_tree_arena_map(a, (void *) h.base))
+			goto out_close;
+
+		// a crash while relocating would tear the links too
+		if ((uint64_t) a->base != h.base) {
+			if (!redblack_tree_arena_mark_dirty(a)) {
+				munmap(a->base, a->capacity);
+				goto out_close;
+			}
+			redblack_tree_arena_relocate(a);
+		}
+	} else {
+		memset(&h, 0, sizeof(h));
+		memcpy(h.magic, "RBTARENA", 8);
+		h.version = RBT_ARENA_VERSION;
+		h.capacity = capacity;
+		h.item_size = item_size;
+		h.balance = (uint64_t) t->balance;
+		h.slot_size = (RBT_ARENA_ITEM_OFFSET + item_size + 15) & ~(uint64_t) 15;
+		h.used = sizeof(h);
+		h.file_size = RBT_ARENA_GROW < capacity ? RBT_ARENA_GROW : capacity;
+
+		if (capacity < sizeof(h) || ftruncate(a->fd, (off_t) h.file_size))
+			goto out_close;
+
+		a->capacity = capacity;
+		if (!redblack_tree_arena_map(a, NULL))
+			goto out_close;
+
+		h.base = (uint64_t) a->base;
+		memcpy(a->base, &h, sizeof(h));
+	}
+
+	t->root = (redblack_tree_node *) redblack_tree_arena_header_of(a)->root;
+	t->count = redblack_tree_arena_header_of(a)->count;
+	redblack_tree_track_rebuild(t);
+	t->arena = a;
+	redblack_tree_hash_rebuild(t);
+	redblack_tree_filter_rebuild(t);
+	return 1;
+
+out_close:
+	close(a->fd);
+	a->fd = -1;
+	return 0;
+}
+
+int redblack_tree_arena_sync(redblack_tree_arena *a)
+{
+	redblack_tree_arena_header *h = redblack_tree_arena_header_of(a);
+
+	// only linked, live nodes count
+	redblack_tree_compact(a->t);
+
+	h->root = (uint64_t) a->t->root;
+	h->count = a->t->count;
+
+	if (msync(a->base, h->used, MS_SYNC))
+		return 0;
+
+	// only now may a crash leave the file as it is
+	h->dirty = 0;
+	a->dirty = 0;
+	return !msync(a->base, sizeof(*h), MS_SYNC);
+}
+
+int redblack_tree_arena_close(redblack_tree_arena *a)
+{
+	redblack_tree *t = a->t;
+	int res = redblack_tree_arena_sync(a);
+
+	// nothing may keep pointing into the mapping
+	if (t->cache)
+		memset(t->cache, 0, (t->cache_mask + 1) * sizeof(redblack_tree_node *));
+	redblack_tree_hash_clear(t);
+	if (t->clock)
+		t->clock->hand = NULL;
+	t->root = NULL;
+	t->leftmost = t->rightmost = NULL;
+	t->count = 0;
+	t->arena = NULL;
+	redblack_tree_filter_rebuild(t);
+
+	res = !munmap(a->base, a->capacity) && res;
+	res = !close(a->fd) && res;
+	a->base = NULL;
+	a->fd = -1;
+	return res;
+}
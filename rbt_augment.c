@@ -0,0 +1,105 @@
+/*
+** rbt_augment.c : implementation of Red-Black Tree aggregates
+** Copyright (C) 2018  Tim Whisonant
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#include "rbt.h"
+#include "rbt_util.h"
+
+static void redblack_tree_augment_visitor(redblack_tree_node *node, void *context)
+{
+	redblack_tree_augment_node((redblack_tree *) context, node);
+}
+
+int redblack_tree_set_aggregate(redblack_tree *t,
+				const redblack_tree_aggregate *aggregate)
+{
+	if (!aggregate || !aggregate->combine) {
+		t->interval_start = NULL;
+		t->aggregate.identity = 0;
+		t->aggregate.value = NULL;
+		t->aggregate.combine = NULL;
+		return 1;
+	}
+
+	// B+-tree leaves carry no aggregates
+	if (t->btree_key)
+		return 0;
+
+	if (!redblack_tree_arena_change(t))
+		return 0;
+
+	t->interval_start = NULL;
+	t->aggregate = *aggregate;
+
+	redblack_tree_compact(t);
+
+	// children before parents
+	redblack_tree_post_order(t, redblack_tree_augment_visitor, t);
+	return 1;
+}
+
+/*
+** check_lo / check_hi are cleared once every item of the subtree is
+** known to satisfy that bound, at which point the stored subtree
+** aggregate can be used as is. After the first node found inside the
+** range, each side is a one-sided query down a single path.
+*/
+static int64_t redblack_tree_range_aggregate_node(redblack_tree *t,
+						  redblack_tree_node *node,
+						  void *lo,
+						  void *hi,
+						  int check_lo,
+						  int check_hi)
+{
+	int64_t agg;
+
+	while (node) {
+
+		if (!check_lo && !check_hi)
+			return node->aggregate;
+
+		if (check_lo && t->compare_items(node->item, lo) < 0) {
+			node = node->right;
+		} else if (check_hi && t->compare_items(node->item, hi) > 0) {
+			node = node->left;
+		} else {
+			agg = redblack_tree_node_value(t, node);
+			agg = t->aggregate.combine(
+				redblack_tree_range_aggregate_node(t, node->left,
+								   lo, hi,
+								   check_lo, 0),
+				agg);
+			return t->aggregate.combine(agg,
+				redblack_tree_range_aggregate_node(t, node->right,
+								   lo, hi,
+								   0, check_hi));
+		}
+
+	}
+
+	return t->aggregate.identity;
+}
+
+int64_t redblack_tree_range_aggregate(redblack_tree *t, void *lo, void *hi)
+{
+	if (!t->aggregate.combine)
+		return t->aggregate.identity;
+
+	redblack_tree_flush(t);
+
+	return redblack_tree_range_aggregate_node(t, t->root, lo, hi, 1, 1);
+}
@@ -0,0 +1,554 @@
+/*
+** rbt_btree.c : implementation of the B+-tree backend
+** Copyright (C) 2018  Tim Whisonant
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#include <string.h>
+#if defined(__AVX2__) || defined(__SSE4_2__)
+#include <immintrin.h>
+#endif
+
+#include "rbt.h"
+#include "rbt_util.h"
+
+/*
+** B+-tree backend. Every item still lives in its own redblack_tree_node
+** from allocate_node, so redblack_tree_find and the traversals hand out
+** the same nodes as the red-black backend. The B+-tree nodes only hold
+** the integer keys inline, for searching, plus the links: internal
+** nodes hold num separators and num + 1 children, where children[i + 1]
+** starts at keys[i]. Leaves hold num items and are chained in key order.
+**
+** Key slots past num always hold INT64_MAX, so a search scans all
+** RBT_BTREE_ORDER slots without looking at num. That keeps the loop
+** branch-free and lets it use the SIMD 64-bit compares when the
+** library is built for them (e.g. CFLAGS += -march=native).
+*/
+#define RBT_BTREE_MIN (RBT_BTREE_ORDER / 2)
+
+typedef struct _redblack_btree_node {
+	int64_t keys[RBT_BTREE_ORDER] __attribute__((aligned(32)));
+	union {
+		struct _redblack_btree_node *children[RBT_BTREE_ORDER + 1];
+		redblack_tree_node *items[RBT_BTREE_ORDER];
+	};
+	struct _redblack_btree_node *next; // leaf chain
+	uint16_t num;
+	uint8_t leaf;
+} redblack_btree_node;
+
+// number of keys less than key
+static inline uint32_t redblack_btree_rank(const redblack_btree_node *bn,
+					   int64_t key)
+{
+	uint32_t n = 0;
+	int i;
+
+#if defined(__AVX2__)
+	__m256i k = _mm256_set1_epi64x(key);
+
+	for (i = 0 ; i < RBT_BTREE_ORDER ; i += 4) {
+		__m256i lt = _mm256_cmpgt_epi64(k,
+				_mm256_load_si256((const __m256i *) &bn->keys[i]));
+		n += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(lt)));
+	}
+#elif defined(__SSE4_2__)
+	__m128i k = _mm_set1_epi64x(key);
+
+	for (i = 0 ; i < RBT_BTREE_ORDER ; i += 2) {
+		__m128i lt = _mm_cmpgt_epi64(k,
+				_mm_load_si128((const __m128i *) &bn->keys[i]));
+		n += __builtin_popcount(_mm_movemask_pd(_mm_castsi128_pd(lt)));
+	}
+#else
+	for (i = 0 ; i < RBT_BTREE_ORDER ; ++i)
+		n += bn->keys[i] < key;
+#endif
+
+	return n;
+}
+
+// index of the child of internal node bn that covers key
+static inline uint32_t redblack_btree_child(const redblack_btree_node *bn,
+					    int64_t key)
+{
+	// number of separators <= key
+	if (key == INT64_MAX)
+		return bn->num;
+	return redblack_btree_rank(bn, key + 1);
+}
+
+static void redblack_btree_pad(redblack_btree_node *bn)
+{
+	int i;
+
+	for (i = bn->num ; i < RBT_BTREE_ORDER ; ++i)
+		bn->keys[i] = INT64_MAX;
+}
+
+static redblack_btree_node * redblack_btree_alloc(int leaf)
+{
+	redblack_btree_node *bn;
+
+	if (posix_memalign((void **) &bn, 32, sizeof(*bn)))
+		return NULL;
+
+	memset(bn, 0, sizeof(*bn));
+	bn->leaf = leaf;
+	redblack_btree_pad(bn);
+	return bn;
+}
+
+int redblack_tree_set_backend(redblack_tree *t,
+			      redblack_tree_backend backend,
+			      int64_t (*item_key)(void *item))
+{
+	// merge pending writes, an empty tree may still hold tombstones
+	redblack_tree_compact(t);
+
+	if (t->count)
+		return 0;
+
+	if (backend == RBT_BACKEND_REDBLACK) {
+		t->btree_key = NULL;
+		return 1;
+	}
+
+	if (backend != RBT_BACKEND_BTREE || !item_key || t->aggregate.combine ||
+	    t->tombstone_percent || t->buffer || t->relaxed || t->clock)
+		return 0;
+
+	t->btree_key = item_key;
+	return 1;
+}
+
+redblack_tree_node * redblack_btree_find(redblack_tree *t, void *item)
+{
+	redblack_btree_node *bn = (redblack_btree_node *) t->btree;
+	int64_t key = t->btree_key(item);
+	uint64_t depth = 0;
+	uint32_t i;
+
+	if (!bn)
+		return NULL;
+
+	while (!bn->leaf) {
+		++depth;
+		bn = bn->children[redblack_btree_child(bn, key)];
+	}
+
+	redblack_tree_stat_depth(t, depth + 1);
+
+	i = redblack_btree_rank(bn, key);
+	if (i < bn->num && bn->keys[i] == key)
+		return bn->items[i];
+
+	return NULL;
+}
+
+/*
+** Split the full child at index c of parent. The parent has room, since
+** full nodes are split on the way down.
+*/
+static int redblack_btree_split(redblack_btree_node *parent, uint32_t c)
+{
+	redblack_btree_node *child = parent->children[c];
+	redblack_btree_node *right;
+	int64_t separator;
+
+	right = redblack_btree_alloc(child->leaf);
+	if (!right)
+		return 0;
+
+	if (child->leaf) {
+		// the right leaf keeps the upper half, its first key separates
+		right->num = RBT_BTREE_ORDER - RBT_BTREE_MIN;
+		memcpy(right->keys, child->keys + RBT_BTREE_MIN,
+		       right->num * sizeof(int64_t));
+		memcpy(right->items, child->items + RBT_BTREE_MIN,
+		       right->num * sizeof(redblack_tree_node *));
+		child->num = RBT_BTREE_MIN;
+		separator = right->keys[0];
+
+		right->next = child->next;
+		child->next = right;
+	} else {
+		// the middle key moves up to the parent
+		right->num = RBT_BTREE_ORDER - RBT_BTREE_MIN - 1;
+		memcpy(right->keys, child->keys + RBT_BTREE_MIN + 1,
+		       right->num * sizeof(int64_t));
+		memcpy(right->children, child->children + RBT_BTREE_MIN + 1,
+		       (right->num + 1) * sizeof(redblack_btree_node *));
+		separator = child->keys[RBT_BTREE_MIN];
+		child->num = RBT_BTREE_MIN;
+	}
+
+	redblack_btree_pad(child);
+	redblack_btree_pad(right);
+
+	memmove(parent->keys + c + 1, parent->keys + c,
+		(parent->num - c) * sizeof(int64_t));
+	memmove(parent->children + c + 2, parent->children + c + 1,
+		(parent->num - c) * sizeof(redblack_btree_node *));
+	parent->keys[c] = separator;
+	parent->children[c + 1] = right;
+	++parent->num;
+
+	return 1;
+}
+
+int redblack_btree_insert(redblack_tree *t, void *item)
+{
+	redblack_btree_node *bn = (redblack_btree_node *) t->btree;
+	redblack_tree_node *node;
+	int64_t key = t->btree_key(item);
+	uint32_t i;
+
+	if (!bn) {
+		bn = redblack_btree_alloc(1);
+		if (!bn)
+			return 0;
+		t->btree = bn;
+	}
+
+	if (bn->num == RBT_BTREE_ORDER) {
+		redblack_btree_node *root = redblack_btree_alloc(0);
+
+		if (!root)
+			return 0;
+
+		root->children[0] = bn;
+		if (!redblack_btree_split(root, 0)) {
+			free(root);
+			return 0;
+		}
+		t->btree = bn = root;
+	}
+
+	while (!bn->leaf) {
+		i = redblack_btree_child(bn, key);
+
+		if (bn->children[i]->num == RBT_BTREE_ORDER) {
+			if (!redblack_btree_split(bn, i))
+				return 0;
+			if (key >= bn->keys[i])
+				++i;
+		}
+
+		bn = bn->children[i];
+	}
+
+	i = redblack_btree_rank(bn, key);
+	if (i < bn->num && bn->keys[i] == key)
+		return 0; // collision - item not inserted
+
+	node = redblack_tree_alloc_node(t, item);
+	if (!node)
+		return 0;
+
+	node->parent = node->left = node->right = NULL;
+	node->color = RBT_BLACK;
+
+	memmove(bn->keys + i + 1, bn->keys + i,
+		(bn->num - i) * sizeof(int64_t));
+	memmove(bn->items + i + 1, bn->items + i,
+		(bn->num - i) * sizeof(redblack_tree_node *));
+	bn->keys[i] = key;
+	bn->items[i] = node;
+	++bn->num;
+
+	if (t->hash_item)
+		redblack_tree_hash_insert(t, node);
+	if (t->filter)
+		redblack_tree_filter_add(t, node->item);
+	++t->count;
+	return 1;
+}
+
+/*
+** The child at index c of parent has fallen below RBT_BTREE_MIN.
+** Borrow from a sibling that can spare one, else merge with a sibling.
+*/
+static void redblack_btree_rebalance(redblack_btree_node *parent, uint32_t c)
+{
+	redblack_btree_node *child = parent->children[c];
+	redblack_btree_node *left = c > 0 ? parent->children[c - 1] : NULL;
+	redblack_btree_node *right = c < parent->num ? parent->children[c + 1] : NULL;
+
+	if (left && left->num > RBT_BTREE_MIN) {
+		memmove(child->keys + 1, child->keys, child->num * sizeof(int64_t));
+		if (child->leaf) {
+			memmove(child->items + 1, child->items,
+				child->num * sizeof(redblack_tree_node *));
+			child->keys[0] = left->keys[left->num - 1];
+			child->items[0] = left->items[left->num - 1];
+			parent->keys[c - 1] = child->keys[0];
+		} else {
+			memmove(child->children + 1, child->children,
+				(child->num + 1) * sizeof(redblack_btree_node *));
+			child->keys[0] = parent->keys[c - 1];
+			child->children[0] = left->children[left->num];
+			parent->keys[c - 1] = left->keys[left->num - 1];
+		}
+		++child->num;
+		--left->num;
+		redblack_btree_pad(left);
+		return;
+	}
+
+	if (right && right->num > RBT_BTREE_MIN) {
+		if (child->leaf) {
+			child->keys[child->num] = right->keys[0];
+			child->items[child->num] = right->items[0];
+			memmove(right->items, right->items + 1,
+				(right->num - 1) * sizeof(redblack_tree_node *));
+			memmove(right->keys, right->keys + 1,
+				(right->num - 1) * sizeof(int64_t));
+			parent->keys[c] = right->keys[0];
+		} else {
+			child->keys[child->num] = parent->keys[c];
+			child->children[child->num + 1] = right->children[0];
+			parent->keys[c] = right->keys[0];
+			memmove(right->children, right->children + 1,
+				right->num * sizeof(redblack_btree_node *));
+			memmove(right->keys, right->keys + 1,
+				(right->num - 1) * sizeof(int64_t));
+		}
+		++child->num;
+		--right->num;
+		redblack_btree_pad(right);
+		return;
+	}
+
+	// merge children[c] and children[c + 1] into children[c]
+	if (left) {
+		--c;
+		right = child;
+		child = left;
+	}
+
+	if (child->leaf) {
+		memcpy(child->keys + child->num, right->keys,
+		       right->num * sizeof(int64_t));
+		memcpy(child->items + child->num, right->items,
+		       right->num * sizeof(redblack_tree_node *));
+		child->num += right->num;
+		child->next = right->next;
+	} else {
+		child->keys[child->num] = parent->keys[c];
+		memcpy(child->keys + child->num + 1, right->keys,
+		       right->num * sizeof(int64_t));
+		memcpy(child->children + child->num + 1, right->children,
+		       (right->num + 1) * sizeof(redblack_btree_node *));
+		child->num += right->num + 1;
+	}
+	free(right);
+
+	memmove(parent->keys + c, parent->keys + c + 1,
+		(parent->num - c - 1) * sizeof(int64_t));
+	memmove(parent->children + c + 1, parent->children + c + 2,
+		(parent->num - c - 1) * sizeof(redblack_btree_node *));
+	--parent->num;
+	redblack_btree_pad(parent);
+}
+
+static int redblack_btree_remove_node(redblack_tree *t,
+				      redblack_btree_node *bn,
+				      int64_t key)
+{
+	uint32_t i;
+	int removed;
+
+	if (bn->leaf) {
+		i = redblack_btree_rank(bn, key);
+		if (i >= bn->num || bn->keys[i] != key)
+			return 0;
+
+		if (t->hash_item)
+			redblack_tree_hash_remove(t, bn->items[i]);
+		if (t->filter)
+			redblack_tree_filter_remove(t, bn->items[i]->item);
+		redblack_tree_release_node(t, bn->items[i]);
+
+		memmove(bn->keys + i, bn->keys + i + 1,
+			(bn->num - i - 1) * sizeof(int64_t));
+		memmove(bn->items + i, bn->items + i + 1,
+			(bn->num - i - 1) * sizeof(redblack_tree_node *));
+		--bn->num;
+		redblack_btree_pad(bn);
+		return 1;
+	}
+
+	i = redblack_btree_child(bn, key);
+	removed = redblack_btree_remove_node(t, bn->children[i], key);
+
+	if (removed && bn->children[i]->num < RBT_BTREE_MIN)
+		redblack_btree_rebalance(bn, i);
+
+	return removed;
+}
+
+int redblack_btree_remove(redblack_tree *t, void *item)
+{
+	redblack_btree_node *root = (redblack_btree_node *) t->btree;
+
+	if (!root || !redblack_btree_remove_node(t, root, t->btree_key(item)))
+		return 0;
+
+	--t->count;
+
+	if (!root->num) {
+		// the root shrinks once its last separator is gone
+		t->btree = root->leaf ? NULL : root->children[0];
+		free(root);
+	}
+
+	return 1;
+}
+
+static void redblack_btree_destroy_node(redblack_tree *t, redblack_btree_node *bn)
+{
+	uint32_t i;
+
+	if (bn->leaf) {
+		for (i = 0 ; i < bn->num ; ++i)
+			redblack_tree_release_node(t, bn->items[i]);
+	} else {
+		for (i = 0 ; i <= bn->num ; ++i)
+			redblack_btree_destroy_node(t, bn->children[i]);
+	}
+
+	free(bn);
+}
+
+void redblack_btree_destroy(redblack_tree *t)
+{
+	if (t->btree)
+		redblack_btree_destroy_node(t, (redblack_btree_node *) t->btree);
+	t->btree = NULL;
+}
+
+void redblack_btree_in_order(redblack_tree *t,
+			     void (*visitor)(redblack_tree_node *node, void *context, uint64_t level),
+			     void *context)
+{
+	redblack_btree_node *bn = (redblack_btree_node *) t->btree;
+	uint64_t level = 0;
+	uint32_t i;
+
+	if (!bn)
+		return;
+
+	while (!bn->leaf) {
+		bn = bn->children[0];
+		++level;
+	}
+
+	for ( ; bn ; bn = bn->next)
+		for (i = 0 ; i < bn->num ; ++i)
+			visitor(bn->items[i], context, level);
+}
+
+redblack_tree_node * redblack_btree_extreme(redblack_tree *t, int max)
+{
+	redblack_btree_node *bn = (redblack_btree_node *) t->btree;
+
+	if (!bn)
+		return NULL;
+
+	while (!bn->leaf)
+		bn = bn->children[max ? bn->num : 0];
+
+	return bn->items[max ? bn->num - 1 : 0];
+}
+
+redblack_tree_node * redblack_btree_first(redblack_tree *t, void **leaf, uint32_t *pos)
+{
+	redblack_btree_node *bn = (redblack_btree_node *) t->btree;
+
+	if (!bn)
+		return NULL;
+
+	while (!bn->leaf)
+		bn = bn->children[0];
+
+	*leaf = bn;
+	*pos = 0;
+	// only an empty root leaf holds no items
+	return bn->num ? bn->items[0] : NULL;
+}
+
+redblack_tree_node * redblack_btree_next(void **leaf, uint32_t *pos)
+{
+	redblack_btree_node *bn = (redblack_btree_node *) *leaf;
+
+	if (++*pos == bn->num) {
+		bn = bn->next;
+		if (!bn)
+			return NULL;
+		*leaf = bn;
+		*pos = 0;
+	}
+
+	return bn->items[*pos];
+}
+
+/*
+** Freeing always starts at the rightmost leaf, so that dropping a child
+** is just --num. An inner node left with no children becomes an empty
+** leaf, freed on the next descent like any other.
+*/
+void redblack_btree_reclaim(void **root,
+			    void (*free_node)(redblack_tree_node * ),
+			    uint64_t *budget)
+{
+	redblack_btree_node *parent;
+	redblack_btree_node *bn;
+
+	while (*root && *budget) {
+		parent = NULL;
+		bn = (redblack_btree_node *) *root;
+		while (!bn->leaf) {
+			parent = bn;
+			bn = bn->children[bn->num];
+		}
+
+		for ( ; bn->num && *budget ; --*budget)
+			free_node(bn->items[--bn->num]);
+		if (bn->num)
+			return;
+
+		free(bn);
+		if (!parent) {
+			*root = NULL;
+		} else if (parent->num) {
+			--parent->num;
+		} else {
+			parent->leaf = 1;
+		}
+	}
+}
+
+uint64_t redblack_btree_height(redblack_tree *t)
+{
+	redblack_btree_node *bn = (redblack_btree_node *) t->btree;
+	uint64_t height = 0;
+
+	for ( ; bn ; bn = bn->leaf ? NULL : bn->children[0])
+		++height;
+
+	return height;
+}
@@ -0,0 +1,188 @@
+/*
+** rbt_buffer.c : write buffer for Red-Black Trees
+** Copyright (C) 2018  Tim Whisonant
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#include <string.h>
+
+#include "rbt.h"
+#include "rbt_util.h"
+
+// 1 if item is buffered at *pos, else *pos is where it belongs
+static int redblack_tree_buffer_search(redblack_tree *t, void *item, uint32_t *pos)
+{
+	uint32_t lo = 0;
+	uint32_t hi = t->buffer_len;
+	uint32_t mid;
+	int64_t res;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		redblack_tree_stat(t, compares);
+		res = t->compare_items(item, t->buffer[mid].item);
+		if (res < 0) {
+			hi = mid;
+		} else if (res > 0) {
+			lo = mid + 1;
+		} else {
+			*pos = mid;
+			return 1;
+		}
+	}
+
+	*pos = lo;
+	return 0;
+}
+
+static redblack_tree_buffered * redblack_tree_buffer_add(redblack_tree *t,
+							 void *item,
+							 uint32_t pos)
+{
+	redblack_tree_buffered *b;
+
+	if (t->buffer_len == t->buffer_capacity) {
+		redblack_tree_flush(t);
+		pos = 0;
+	}
+
+	b = t->buffer + pos;
+	memmove(b + 1, b, (t->buffer_len - pos) * sizeof(redblack_tree_buffered));
+	++t->buffer_len;
+
+	b->item = item;
+	b->node = NULL;
+	b->remove = 0;
+	return b;
+}
+
+int redblack_tree_buffer_insert(redblack_tree *t, void *item)
+{
+	redblack_tree_node *node;
+	uint32_t pos;
+	int found = redblack_tree_buffer_search(t, item, &pos);
+
+	if (found && t->buffer[pos].node)
+		return 0;
+
+	node = redblack_tree_alloc_node(t, item);
+	if (!node)
+		return 0;
+	node->left = node->right = NULL;
+
+	if (!found)
+		redblack_tree_buffer_add(t, item, pos)->node = node;
+	else {
+		t->buffer[pos].item = item;
+		t->buffer[pos].node = node;
+	}
+
+	return 1;
+}
+
+int redblack_tree_buffer_remove(redblack_tree *t, void *item)
+{
+	redblack_tree_buffered *b;
+	uint32_t pos;
+
+	if (!redblack_tree_buffer_search(t, item, &pos)) {
+		redblack_tree_buffer_add(t, item, pos)->remove = 1;
+		return 1;
+	}
+
+	b = t->buffer + pos;
+	if (!b->node)
+		return 0;
+
+	// the buffered insert may have been a duplicate of a stored item
+	redblack_tree_release_node(t, b->node);
+	b->node = NULL;
+	b->remove = 1;
+	return 1;
+}
+
+int redblack_tree_buffer_find(redblack_tree *t,
+			      void *item,
+			      redblack_tree_node **node)
+{
+	uint32_t pos;
+
+	if (!redblack_tree_buffer_search(t, item, &pos))
+		return 0;
+
+	*node = t->buffer[pos].node;
+	return 1;
+}
+
+void redblack_tree_flush(redblack_tree *t)
+{
+	redblack_tree_node *finger = NULL;
+	redblack_tree_buffered *b;
+	uint32_t len = t->buffer_len;
+	uint32_t i;
+
+	// the merge itself may compact, which flushes
+	t->buffer_len = 0;
+
+	for (i = 0 ; i < len ; ++i) {
+		b = t->buffer + i;
+
+		if (b->remove) {
+			redblack_tree_remove_item(t, b->item);
+			finger = NULL; // may have been freed
+		}
+
+		if (b->node) {
+			redblack_tree_insert_hinted(t, b->node, &finger);
+			if (finger != b->node)
+				redblack_tree_release_node(t, b->node);
+		}
+	}
+}
+
+void redblack_tree_buffer_drop(redblack_tree *t)
+{
+	uint32_t i;
+
+	for (i = 0 ; i < t->buffer_len ; ++i)
+		if (t->buffer[i].node)
+			redblack_tree_release_node(t, t->buffer[i].node);
+
+	free(t->buffer);
+	t->buffer = NULL;
+	t->buffer_len = 0;
+	t->buffer_capacity = 0;
+}
+
+int redblack_tree_set_write_buffer(redblack_tree *t, uint32_t capacity)
+{
+	redblack_tree_flush(t);
+	redblack_tree_buffer_drop(t);
+
+	if (!capacity)
+		return 1;
+
+	if (t->btree_key || t->arena || t->clock)
+		return 0;
+
+	t->buffer = (redblack_tree_buffered *)
+		calloc(capacity, sizeof(redblack_tree_buffered));
+	if (!t->buffer)
+		return 0;
+
+	t->buffer_capacity = capacity;
+	return 1;
+}
+
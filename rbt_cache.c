@@ -0,0 +1,57 @@
+/*
+** rbt_cache.c : hot-key lookup cache for Red-Black Trees
+** Copyright (C) 2018  Tim Whisonant
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#include "rbt.h"
+#include "rbt_util.h"
+
+int redblack_tree_set_cache(redblack_tree *t,
+			    uint32_t slots,
+			    uint64_t (*hash_item)(void *item))
+{
+	uint64_t size = 1;
+
+	free(t->cache);
+	t->cache = NULL;
+	t->cache_hash = NULL;
+	t->cache_mask = 0;
+	t->cache_hits = 0;
+	t->cache_misses = 0;
+
+	if (!slots || !hash_item)
+		return 1;
+
+	while (size < slots)
+		size *= 2;
+
+	t->cache = (redblack_tree_node **)
+		calloc(size, sizeof(redblack_tree_node *));
+	if (!t->cache)
+		return 0;
+
+	t->cache_hash = hash_item;
+	t->cache_mask = size - 1;
+	return 1;
+}
+
+void redblack_tree_get_cache_stats(redblack_tree *t,
+				   uint64_t *hits,
+				   uint64_t *misses)
+{
+	*hits = t->cache_hits;
+	*misses = t->cache_misses;
+}
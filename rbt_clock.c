@@ -0,0 +1,91 @@
+/*
+** rbt_clock.c : CLOCK eviction for bounded Red-Black Trees
+** Copyright (C) 2018  Tim Whisonant
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#include "rbt.h"
+#include "rbt_util.h"
+
+/*
+** The reference bits live in node->flags, so a bounded tree costs no
+** memory per item over an unbounded one, and a find only sets a bit in
+** a node it has already loaded. Each eviction clears at most one bit
+** per live node, and advancing the hand in key order is O(1) amortized,
+** leaving the unlinking itself, O(log n), as the main cost.
+*/
+
+void redblack_tree_clock_evict(redblack_tree *t)
+{
+	redblack_tree_clock *c = t->clock;
+	redblack_tree_node *node;
+	void *item;
+
+	while (t->count > c->capacity) {
+		node = c->hand;
+		for (;;) {
+			if (!node)
+				node = t->leftmost;
+			if (redblack_tree_is_tombstone(node)) {
+				node = redblack_tree_next(node);
+			} else if (node->flags & RBT_NODE_RECENT) {
+				node->flags &= ~RBT_NODE_RECENT;
+				node = redblack_tree_next(node);
+			} else {
+				break;
+			}
+		}
+
+		c->hand = redblack_tree_next(node);
+		item = node->item;
+		++c->evictions;
+
+		// unlinked even under lazy removal, so that evict may free the item
+		redblack_tree_stat(t, removes);
+		redblack_tree_remove_found(t, node);
+
+		if (c->evict)
+			c->evict(item, c->context);
+	}
+}
+
+int redblack_tree_set_capacity(redblack_tree *t,
+			       uint64_t capacity,
+			       void (*evict)(void *item, void *context),
+			       void *context)
+{
+	if (!capacity) {
+		free(t->clock);
+		t->clock = NULL;
+		return 1;
+	}
+
+	if (t->btree_key || t->buffer || t->relaxed || t->arena)
+		return 0;
+
+	if (!t->clock) {
+		t->clock = (redblack_tree_clock *) calloc(1, sizeof(redblack_tree_clock));
+		if (!t->clock)
+			return 0;
+	}
+
+	t->clock->capacity = capacity;
+	t->clock->evict = evict;
+	t->clock->context = context;
+
+	if (t->count > capacity)
+		redblack_tree_clock_evict(t);
+	return 1;
+}
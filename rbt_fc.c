@@ -0,0 +1,195 @@
+/*
+** rbt_fc.c : flat-combining front end for Red-Black Trees
+** Copyright (C) 2018  Tim Whisonant
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#include <sched.h>
+#include <string.h>
+
+#include "rbt.h"
+#include "rbt_util.h"
+
+/*
+** Flat combining: a thread stores its request in its slot, then either
+** wins the lock and serves every pending slot, its own included, or
+** waits for the winner to serve it. The tree is only ever touched by the
+** lock holder, so only the slots are shared between cores.
+*/
+#define RBT_FC_PASSES 3  // rounds a combiner runs while requests keep coming
+#define RBT_FC_TRY    16 // spins on the slot between attempts at the lock
+#define RBT_FC_YIELD  1024
+
+#define RBT_FC_REBALANCE 0 // op besides those of redblack_tree_trace_op
+
+static inline void redblack_tree_fc_pause(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+int redblack_tree_fc_init(redblack_tree_fc *fc, redblack_tree *t, uint32_t max_threads)
+{
+	fc->t = t;
+	fc->num_slots = max_threads;
+	fc->registered = 0;
+	fc->combines = 0;
+	fc->combined = 0;
+
+	if (posix_memalign((void **) &fc->slots, 64,
+			   max_threads * sizeof(redblack_tree_fc_slot)))
+		return 0;
+
+	fc->batch = (redblack_tree_fc_slot **)
+		malloc(max_threads * sizeof(redblack_tree_fc_slot *));
+	if (!fc->batch) {
+		free(fc->slots);
+		return 0;
+	}
+
+	memset(fc->slots, 0, max_threads * sizeof(redblack_tree_fc_slot));
+	pthread_mutex_init(&fc->lock, NULL);
+	return 1;
+}
+
+void redblack_tree_fc_destroy(redblack_tree_fc *fc)
+{
+	pthread_mutex_destroy(&fc->lock);
+	free(fc->slots);
+	free(fc->batch);
+	fc->slots = NULL;
+	fc->batch = NULL;
+}
+
+int redblack_tree_fc_register(redblack_tree_fc *fc)
+{
+	uint32_t slot = __atomic_fetch_add(&fc->registered, 1, __ATOMIC_RELAXED);
+
+	return slot < fc->num_slots ? (int) slot : -1;
+}
+
+// Batches are as small as the thread count, so insertion sort will do.
+// Rebalance requests carry no item and sort first.
+static void redblack_tree_fc_sort(redblack_tree *t, redblack_tree_fc_slot **batch, uint32_t n)
+{
+	redblack_tree_fc_slot *s;
+	uint32_t i;
+	uint32_t j;
+
+	for (i = 1 ; i < n ; ++i) {
+		s = batch[i];
+		for (j = i ; j && batch[j - 1]->op != RBT_FC_REBALANCE &&
+			     (s->op == RBT_FC_REBALANCE ||
+			      t->compare_items(s->item, batch[j - 1]->item) < 0) ; --j)
+			batch[j] = batch[j - 1];
+		batch[j] = s;
+	}
+}
+
+static void redblack_tree_fc_combine(redblack_tree_fc *fc)
+{
+	redblack_tree *t = fc->t;
+	redblack_tree_fc_slot *s;
+	uint32_t pass;
+	uint32_t n;
+	uint32_t i;
+
+	for (pass = 0 ; pass < RBT_FC_PASSES ; ++pass) {
+
+		n = 0;
+		for (i = 0 ; i < fc->num_slots ; ++i)
+			if (__atomic_load_n(&fc->slots[i].pending, __ATOMIC_ACQUIRE))
+				fc->batch[n++] = &fc->slots[i];
+
+		if (!n)
+			return;
+
+		redblack_tree_fc_sort(t, fc->batch, n);
+
+		for (i = 0 ; i < n ; ++i) {
+			s = fc->batch[i];
+
+			switch (s->op) {
+			case RBT_TRACE_INSERT:
+				s->result = redblack_tree_insert(t, s->item);
+				break;
+			case RBT_TRACE_REMOVE:
+				s->result = redblack_tree_remove(t, s->item);
+				break;
+			case RBT_FC_REBALANCE:
+				s->result = (int) redblack_tree_rebalance(t, (uint32_t) (uintptr_t) s->item);
+				break;
+			default:
+				s->node = redblack_tree_find(t, s->item);
+				s->result = s->node != NULL;
+				break;
+			}
+
+			__atomic_store_n(&s->pending, 0, __ATOMIC_RELEASE);
+		}
+
+		++fc->combines;
+		fc->combined += n;
+	}
+}
+
+static redblack_tree_fc_slot * redblack_tree_fc_run(redblack_tree_fc *fc,
+						    int slot,
+						    int op,
+						    void *item)
+{
+	redblack_tree_fc_slot *s = &fc->slots[slot];
+	uint32_t spins = 0;
+
+	s->item = item;
+	s->op = op;
+	__atomic_store_n(&s->pending, 1, __ATOMIC_RELEASE);
+
+	// spin on the own slot, which only the combiner writes
+	while (__atomic_load_n(&s->pending, __ATOMIC_ACQUIRE)) {
+		if (spins % RBT_FC_TRY == 0 && !pthread_mutex_trylock(&fc->lock)) {
+			redblack_tree_fc_combine(fc);
+			pthread_mutex_unlock(&fc->lock);
+		} else if (spins % RBT_FC_YIELD == RBT_FC_YIELD - 1)
+			sched_yield();
+		else
+			redblack_tree_fc_pause();
+		++spins;
+	}
+
+	return s;
+}
+
+int redblack_tree_fc_insert(redblack_tree_fc *fc, int slot, void *item)
+{
+	return redblack_tree_fc_run(fc, slot, RBT_TRACE_INSERT, item)->result;
+}
+
+int redblack_tree_fc_remove(redblack_tree_fc *fc, int slot, void *item)
+{
+	return redblack_tree_fc_run(fc, slot, RBT_TRACE_REMOVE, item)->result;
+}
+
+redblack_tree_node * redblack_tree_fc_find(redblack_tree_fc *fc, int slot, void *item)
+{
+	return redblack_tree_fc_run(fc, slot, RBT_TRACE_FIND, item)->node;
+}
+
+uint32_t redblack_tree_fc_rebalance(redblack_tree_fc *fc, int slot, uint32_t budget)
+{
+	return (uint32_t) redblack_tree_fc_run(fc, slot, RBT_FC_REBALANCE,
+					       (void *) (uintptr_t) budget)->result;
+}
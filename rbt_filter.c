@@ -0,0 +1,254 @@
+/*
+** rbt_filter.c : Bloom filter for finds in Red-Black Trees
+** Copyright (C) 2018  Tim Whisonant
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#include <stdlib.h>
+#include <string.h>
+
+#include "rbt.h"
+#include "rbt_util.h"
+
+/*
+** A counting Bloom filter of 4-bit counters, so that removes can take
+** items back out. The num_hashes counters of an item come from one
+** item hash by double hashing, and are mapped onto num_counters by a
+** multiply-shift rather than a modulo. A counter stuck at 15 is never
+** decremented again: it may then report an item that is gone, but
+** never miss one that is present.
+*/
+#define RBT_FILTER_MAX_HASHES 16
+#define RBT_FILTER_MIN_ITEMS  64
+
+static inline uint64_t redblack_tree_filter_index(redblack_tree_filter *f,
+						  uint64_t h)
+{
+	return (uint64_t) (((unsigned __int128) h * f->num_counters) >> 64);
+}
+
+static inline void redblack_tree_filter_hashes(redblack_tree_filter *f,
+					       void *item,
+					       uint64_t *h1,
+					       uint64_t *h2)
+{
+	uint64_t h = redblack_tree_hash_mix(f->hash_item(item));
+
+	*h1 = h;
+	*h2 = ((h >> 32) | (h << 32)) | 1;
+}
+
+int redblack_tree_filter_test(redblack_tree_filter *f, void *item)
+{
+	uint64_t h1;
+	uint64_t h2;
+	uint64_t i;
+	uint32_t k;
+
+	redblack_tree_filter_hashes(f, item, &h1, &h2);
+
+	for (k = 0 ; k < f->num_hashes ; ++k, h1 += h2) {
+		i = redblack_tree_filter_index(f, h1);
+		if (!((f->counters[i / 2] >> (4 * (i & 1))) & 0xf))
+			return 0;
+	}
+
+	return 1;
+}
+
+static void redblack_tree_filter_count(redblack_tree_filter *f,
+				       void *item,
+				       int add)
+{
+	uint64_t h1;
+	uint64_t h2;
+	uint64_t i;
+	uint32_t k;
+	uint8_t c;
+	int shift;
+
+	redblack_tree_filter_hashes(f, item, &h1, &h2);
+
+	for (k = 0 ; k < f->num_hashes ; ++k, h1 += h2) {
+		i = redblack_tree_filter_index(f, h1);
+		shift = 4 * (i & 1);
+		c = (f->counters[i / 2] >> shift) & 0xf;
+		if (c == 0xf)
+			continue; // saturated
+		redblack_tree_assert(add || c);
+		c = add ? c + 1 : c - 1;
+		f->counters[i / 2] = (f->counters[i / 2] & ~(0xf << shift)) |
+				     (c << shift);
+	}
+}
+
+// the walks can't use redblack_tree_in_order, which merges the write buffer
+static void redblack_tree_filter_fill_node(redblack_tree_filter *f,
+					   redblack_tree_node *node)
+{
+	for ( ; node ; node = node->right) {
+		redblack_tree_filter_fill_node(f, node->left);
+		if (!redblack_tree_is_tombstone(node))
+			redblack_tree_filter_count(f, node->item, 1);
+	}
+}
+
+static void redblack_tree_filter_fill_visitor(redblack_tree_node *node,
+					      void *context,
+					      uint64_t level)
+{
+	(void) level;
+	redblack_tree_filter_count((redblack_tree_filter *) context, node->item, 1);
+}
+
+// size f for capacity items and count the items of t; 0 if out of memory
+static int redblack_tree_filter_fill(redblack_tree *t,
+				     redblack_tree_filter *f,
+				     uint64_t capacity)
+{
+	uint64_t num_counters = (capacity * f->bits_per_item + 15) / 16;
+	uint8_t *counters = (uint8_t *) calloc((num_counters + 1) / 2, 1);
+
+	if (!counters)
+		return 0;
+
+	free(f->counters);
+	f->counters = counters;
+	f->num_counters = num_counters;
+	f->capacity = capacity;
+
+	if (t->btree_key)
+		redblack_btree_in_order(t, redblack_tree_filter_fill_visitor, f);
+	else
+		redblack_tree_filter_fill_node(f, t->root);
+	return 1;
+}
+
+void redblack_tree_filter_add(redblack_tree *t, void *item)
+{
+	redblack_tree_filter *f = t->filter;
+
+	// item is linked already, so a rebuild counts it too; should the
+	// larger filter not fit, the old one only gets less selective
+	if (t->count + 1 > f->capacity &&
+	    redblack_tree_filter_fill(t, f, 2 * f->capacity))
+		return;
+
+	redblack_tree_filter_count(f, item, 1);
+}
+
+void redblack_tree_filter_remove(redblack_tree *t, void *item)
+{
+	redblack_tree_filter_count(t->filter, item, 0);
+}
+
+void redblack_tree_filter_rebuild(redblack_tree *t)
+{
+	redblack_tree_filter *f = t->filter;
+
+	if (!f)
+		return;
+
+	// clearing in place needs no memory, so it can't fail
+	memset(f->counters, 0, (f->num_counters + 1) / 2);
+	if (t->btree_key)
+		redblack_btree_in_order(t, redblack_tree_filter_fill_visitor, f);
+	else
+		redblack_tree_filter_fill_node(f, t->root);
+
+	if (t->count > f->capacity)
+		redblack_tree_filter_fill(t, f, 2 * t->count);
+}
+
+// log2(x) for x >= 1, to 1/256, without libm
+static double redblack_tree_filter_log2(double x)
+{
+	double log = 0;
+	double bit = 1;
+	int i;
+
+	while (x >= 2) {
+		x /= 2;
+		++log;
+	}
+	for (i = 0 ; i < 8 ; ++i) {
+		x *= x;
+		bit /= 2;
+		if (x >= 2) {
+			x /= 2;
+			log += bit;
+		}
+	}
+	return log;
+}
+
+int redblack_tree_set_filter(redblack_tree *t,
+			     uint64_t expected_items,
+			     double fp_rate,
+			     uint64_t (*hash_item)(void *item))
+{
+	redblack_tree_filter *f;
+	double bits;
+
+	if (t->filter) {
+		free(t->filter->counters);
+		free(t->filter);
+		t->filter = NULL;
+	}
+
+	if (!hash_item)
+		return 1;
+
+	if (!(fp_rate > 0 && fp_rate < 1))
+		return 0;
+
+	f = (redblack_tree_filter *) calloc(1, sizeof(redblack_tree_filter));
+	if (!f)
+		return 0;
+
+	// k = log2(1 / p) hashes, with k / ln 2 counters per item
+	bits = redblack_tree_filter_log2(1 / fp_rate);
+	f->num_hashes = (uint32_t) (bits + 0.5);
+	if (f->num_hashes < 1)
+		f->num_hashes = 1;
+	if (f->num_hashes > RBT_FILTER_MAX_HASHES)
+		f->num_hashes = RBT_FILTER_MAX_HASHES;
+	f->bits_per_item = (uint32_t) (bits * 1.4427 * 16 + 0.5);
+	if (f->bits_per_item < 16)
+		f->bits_per_item = 16;
+	f->hash_item = hash_item;
+
+	expected_items = redblack_tree_max(expected_items, t->count);
+	if (!redblack_tree_filter_fill(t, f,
+		redblack_tree_max(expected_items, (uint64_t) RBT_FILTER_MIN_ITEMS))) {
+		free(f);
+		return 0;
+	}
+
+	t->filter = f;
+	return 1;
+}
+
+void redblack_tree_get_filter_stats(redblack_tree *t,
+				    uint64_t *rejected,
+				    uint64_t *passed,
+				    uint64_t *false_positives)
+{
+	redblack_tree_filter *f = t->filter;
+
+	*rejected = f ? f->rejected : 0;
+	*passed = f ? f->passed : 0;
+	*false_positives = f ? f->false_positives : 0;
+}
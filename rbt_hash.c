@@ -0,0 +1,205 @@
+/*
+** rbt_hash.c : implementation of the Red-Black Tree hash index
+** Copyright (C) 2018  Tim Whisonant
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#include <string.h>
+
+#include "rbt.h"
+#include "rbt_util.h"
+
+/*
+** Linear probing table of node pointers, at most half full. Deletions
+** shift the following entries back instead of leaving tombstones, so a
+** probe always ends at the first empty slot.
+*/
+#define RBT_HASH_MIN_CAPACITY 16
+
+static inline uint64_t redblack_tree_hash_slot(redblack_tree *t, void *item)
+{
+	return redblack_tree_hash_mix(t->hash_item(item)) & (t->hash_capacity - 1);
+}
+
+void redblack_tree_hash_clear(redblack_tree *t)
+{
+	free(t->hash_table);
+	t->hash_table = NULL;
+	t->hash_capacity = 0;
+}
+
+static void redblack_tree_hash_drop(redblack_tree *t)
+{
+	redblack_tree_hash_clear(t);
+	t->hash_item = NULL;
+}
+
+static void redblack_tree_hash_place(redblack_tree *t, redblack_tree_node *node)
+{
+	uint64_t i = redblack_tree_hash_slot(t, node->item);
+
+	while (t->hash_table[i])
+		i = (i + 1) & (t->hash_capacity - 1);
+
+	t->hash_table[i] = node;
+}
+
+static int redblack_tree_hash_resize(redblack_tree *t, uint64_t capacity)
+{
+	redblack_tree_node **old = t->hash_table;
+	uint64_t old_capacity = t->hash_capacity;
+	uint64_t i;
+
+	t->hash_table = (redblack_tree_node **)
+		calloc(capacity, sizeof(redblack_tree_node *));
+	if (!t->hash_table) {
+		t->hash_table = old;
+		return 0;
+	}
+	t->hash_capacity = capacity;
+
+	for (i = 0 ; i < old_capacity ; ++i)
+		if (old[i])
+			redblack_tree_hash_place(t, old[i]);
+
+	free(old);
+	return 1;
+}
+
+void redblack_tree_hash_insert(redblack_tree *t, redblack_tree_node *node)
+{
+	uint64_t capacity = t->hash_capacity ?
+		2 * t->hash_capacity : RBT_HASH_MIN_CAPACITY;
+
+	if (2 * (t->count + 1) > t->hash_capacity &&
+	    !redblack_tree_hash_resize(t, capacity)) {
+		redblack_tree_hash_drop(t);
+		return;
+	}
+
+	redblack_tree_hash_place(t, node);
+}
+
+static uint64_t redblack_tree_hash_index_of(redblack_tree *t,
+					    redblack_tree_node *node)
+{
+	uint64_t i = redblack_tree_hash_slot(t, node->item);
+
+	while (t->hash_table[i] != node) {
+		redblack_tree_assert(t->hash_table[i]);
+		i = (i + 1) & (t->hash_capacity - 1);
+	}
+
+	return i;
+}
+
+void redblack_tree_hash_remove(redblack_tree *t, redblack_tree_node *node)
+{
+	uint64_t mask = t->hash_capacity - 1;
+	uint64_t hole = redblack_tree_hash_index_of(t, node);
+	uint64_t i = hole;
+	uint64_t home;
+
+	for (;;) {
+		t->hash_table[hole] = NULL;
+
+		// find an entry after the hole that may move back into it
+		for (;;) {
+			i = (i + 1) & mask;
+			if (!t->hash_table[i])
+				return;
+			home = redblack_tree_hash_slot(t, t->hash_table[i]->item);
+			// stays put if its home lies cyclically in (hole, i]
+			if (((i - home) & mask) >= ((i - hole) & mask))
+				break;
+		}
+
+		t->hash_table[hole] = t->hash_table[i];
+		hole = i;
+	}
+}
+
+void redblack_tree_hash_move(redblack_tree *t,
+			     redblack_tree_node *from,
+			     redblack_tree_node *to)
+{
+	t->hash_table[redblack_tree_hash_index_of(t, from)] = to;
+}
+
+redblack_tree_node * redblack_tree_hash_find(redblack_tree *t, void *item)
+{
+	redblack_tree_node *node;
+	uint64_t i;
+
+	redblack_tree_stat(t, finds);
+
+	if (!t->hash_capacity)
+		return NULL;
+
+	i = redblack_tree_hash_slot(t, item);
+
+	while ((node = t->hash_table[i])) {
+		redblack_tree_stat(t, compares);
+		if (!t->compare_items(item, node->item))
+			return node;
+		i = (i + 1) & (t->hash_capacity - 1);
+	}
+
+	return NULL;
+}
+
+static void redblack_tree_hash_visitor(redblack_tree_node *node, void *context)
+{
+	redblack_tree_hash_place((redblack_tree *) context, node);
+}
+
+void redblack_tree_hash_rebuild(redblack_tree *t)
+{
+	uint64_t capacity = RBT_HASH_MIN_CAPACITY;
+
+	if (!t->hash_item)
+		return;
+
+	while (capacity < 2 * t->count)
+		capacity *= 2;
+
+	if (capacity != t->hash_capacity) {
+		free(t->hash_table);
+		t->hash_table = (redblack_tree_node **)
+			calloc(capacity, sizeof(redblack_tree_node *));
+		if (!t->hash_table) {
+			redblack_tree_hash_drop(t);
+			return;
+		}
+		t->hash_capacity = capacity;
+	} else
+		memset(t->hash_table, 0, capacity * sizeof(redblack_tree_node *));
+
+	redblack_tree_in_order(t, redblack_tree_hash_visitor, t);
+}
+
+int redblack_tree_set_hash_index(redblack_tree *t,
+				 uint64_t (*hash_item)(void *item))
+{
+	redblack_tree_hash_drop(t);
+
+	if (!hash_item)
+		return 1;
+
+	t->hash_item = hash_item;
+	redblack_tree_hash_rebuild(t);
+
+	return t->hash_item != NULL;
+}
@@ -19,7 +19,7 @@
 #include "rbt.h"
 #include "rbt_util.h"
 
-static inline void redblack_tree_insert_repair_case_4_2(redblack_tree_node **root,
+static inline void redblack_tree_insert_repair_case_4_2(redblack_tree *t,
 							redblack_tree_node *n)
 {
 /*
@@ -46,15 +46,17 @@ static inline void redblack_tree_insert_repair_case_4_2(redblack_tree_node **roo
 	redblack_tree_assert(gp);
 
 	if (n == p->left)
-		ror(root, gp);
+		redblack_tree_ror(t, gp);
 	else
-		rol(root, gp);
+		redblack_tree_rol(t, gp);
+
+	redblack_tree_stat(t, insert_cases[4]);
 
 	p->color = RBT_BLACK;
 	gp->color = RBT_RED;
 }
 
-static void redblack_tree_insert_repair(redblack_tree_node **root,
+static void redblack_tree_insert_repair(redblack_tree *t,
 					redblack_tree_node *n)
 {
 	redblack_tree_node *p = parent(n);
@@ -64,12 +66,14 @@ static void redblack_tree_insert_repair(redblack_tree_node **root,
 /*
 ** Case 1: if the new node is the root, then color it black.
 */
+		redblack_tree_stat(t, insert_cases[0]);
 		n->color = RBT_BLACK;
 	} else if (p->color == RBT_BLACK) {
 /*
 ** Case 2: the parent is black, so there is no color violation.
 **         (nothing to do)
 */
+		redblack_tree_stat(t, insert_cases[1]);
 		return;
 	} else if (u && u->color == RBT_RED) {
 /*
@@ -85,9 +89,10 @@ static void redblack_tree_insert_repair(redblack_tree_node **root,
 **  Nr          Nr
 */
 		redblack_tree_node *gp = parent(p);
+		redblack_tree_stat(t, insert_cases[2]);
 		p->color = u->color = RBT_BLACK;
 		gp->color = RBT_RED;
-		redblack_tree_insert_repair(root, gp);
+		redblack_tree_insert_repair(t, gp);
 	} else {
 /*
 ** Case 4.1: the parent is red, the uncle is black.
@@ -111,48 +116,158 @@ static void redblack_tree_insert_repair(redblack_tree_node **root,
 		redblack_tree_assert(gp);
 
 		if (gp->left && n == gp->left->right) {
-			rol(root, p);
+			redblack_tree_stat(t, insert_cases[3]);
+			redblack_tree_rol(t, p);
 			n = n->left;
 		} else if (gp->right && n == gp->right->left) {
-			ror(root, p);
+			redblack_tree_stat(t, insert_cases[3]);
+			redblack_tree_ror(t, p);
 			n = n->right;
 		}
-		redblack_tree_insert_repair_case_4_2(root, n);
+		redblack_tree_insert_repair_case_4_2(t, n);
 	}
 }
 
-int redblack_tree_insert(redblack_tree *t, void *item)
+/*
+** Descend from *link, whose subtree must hold the place of item, and
+** link fresh there, or a new node if fresh is NULL. *where is set to the
+** node holding item afterwards, NULL if allocation failed.
+*/
+static int redblack_tree_insert_at(redblack_tree *t,
+				   redblack_tree_node **node,
+				   redblack_tree_node *parent,
+				   void *item,
+				   redblack_tree_node *fresh,
+				   redblack_tree_node **where)
 {
 	int64_t res;
 	int inserted = 0;
-	redblack_tree_node **node;
-	redblack_tree_node *parent;
+	uint64_t depth = 0;
 
-	node = &t->root;
-	parent = NULL;
+	redblack_tree_stat(t, inserts);
 
 	while (*node) {
 		parent = *node;
+		++depth;
+		redblack_tree_stat(t, compares);
 		res = t->compare_items(item, (*node)->item);
 		if (res < 0)
 			node = &(*node)->left;
 		else if (res > 0)
 			node = &(*node)->right;
 		else // collision - item not inserted
-			return inserted;
+			break;
+	}
+
+	redblack_tree_stat_depth(t, depth);
+
+	*where = *node;
+
+	if (*node) {
+		if (redblack_tree_is_tombstone(*node) &&
+		    redblack_tree_arena_change(t)) {
+			redblack_tree_revive(t, *node, item);
+			inserted = 1;
+		}
+		return inserted;
 	}
 
 	// New item inserted at *node
 
-	*node = t->allocate_node(item);
+	*node = fresh ? fresh : redblack_tree_alloc_node(t, item);
 	if (!*node)
 		return inserted;
 
+	*where = *node;
 	(*node)->parent = parent;
-	(*node)->color = RBT_RED;
+	(*node)->color = t->balance == RBT_BALANCE_WAVL ? 0 : RBT_RED;
+	redblack_tree_track_insert(t, *node);
 	inserted = 1;
+	if (t->hash_item)
+		redblack_tree_hash_insert(t, *node);
+	if (t->filter)
+		redblack_tree_filter_add(t, item);
+	if (t->clock)
+		(*node)->flags |= RBT_NODE_RECENT;
+	++t->count;
+
+	redblack_tree_augment_path(t, *node);
+	redblack_tree_probe(insert_repair, t, *node);
+	if (t->relaxed) {
+		// relaxed mode leaves a red parent for redblack_tree_rebalance
+		if (!parent)
+			(*node)->color = RBT_BLACK;
+		else if (parent->color == RBT_RED)
+			redblack_tree_relaxed_red(t, *node);
+	} else if (t->balance == RBT_BALANCE_WAVL)
+		redblack_tree_wavl_insert_repair(t, *node);
+	else
+		redblack_tree_insert_repair(t, *node);
+	redblack_tree_probe(insert_repair_done, t, *node);
+
+	return inserted;
+}
+
+static int redblack_tree_insert_item(redblack_tree *t, void *item)
+{
+	redblack_tree_node *where;
+
+	return redblack_tree_insert_at(t, &t->root, NULL, item, NULL, &where);
+}
+
+/*
+** Items of a sorted batch land close to each other, so instead of from
+** the root, descend from the lowest ancestor of the previous node whose
+** subtree holds the place of the new item. Climbing past a left child
+** costs one compare against its parent, the upper bound of its subtree.
+*/
+int redblack_tree_insert_hinted(redblack_tree *t,
+				redblack_tree_node *node,
+				redblack_tree_node **finger)
+{
+	redblack_tree_node *start = *finger;
+	redblack_tree_node **link = &t->root;
+	redblack_tree_node *parent = NULL;
+
+	if (start) {
+		while (start->parent) {
+			if (start == start->parent->left) {
+				redblack_tree_stat(t, compares);
+				if (t->compare_items(node->item, start->parent->item) < 0)
+					break;
+			}
+			start = start->parent;
+		}
+
+		parent = start->parent;
+		if (parent)
+			link = start == parent->left ? &parent->left : &parent->right;
+	}
+
+	return redblack_tree_insert_at(t, link, parent, node->item, node, finger);
+}
+
+int redblack_tree_insert(redblack_tree *t, void *item)
+{
+	uint64_t start = redblack_tree_latency_start(t);
+	int inserted;
+
+	redblack_tree_probe(insert, t, item);
+
+	if (t->btree_key)
+		inserted = redblack_btree_insert(t, item);
+	else if (t->buffer)
+		inserted = redblack_tree_buffer_insert(t, item);
+	else
+		inserted = redblack_tree_insert_item(t, item);
+
+	if (t->clock && t->count > t->clock->capacity)
+		redblack_tree_clock_evict(t);
 
-	redblack_tree_insert_repair(&t->root, *node);
+	if (t->trace)
+		redblack_tree_trace_record_op(t, RBT_TRACE_INSERT, item, inserted);
 
+	redblack_tree_latency_record(t, RBT_TRACE_INSERT, start);
+	redblack_tree_probe(insert_done, t, inserted);
 	return inserted;
 }
@@ -0,0 +1,96 @@
+/*
+** rbt_interval.c : implementation of Red-Black interval trees
+** Copyright (C) 2018  Tim Whisonant
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#include "rbt.h"
+#include "rbt_util.h"
+
+static int64_t redblack_tree_interval_combine(int64_t a, int64_t b)
+{
+	return redblack_tree_max(a, b);
+}
+
+int redblack_tree_set_interval(redblack_tree *t,
+			       int64_t (*interval_start)(void *item),
+			       int64_t (*interval_end)(void *item))
+{
+	redblack_tree_aggregate max_end;
+
+	if (!interval_start || !interval_end)
+		return redblack_tree_set_aggregate(t, NULL);
+
+	max_end.identity = INT64_MIN;
+	max_end.value = interval_end;
+	max_end.combine = redblack_tree_interval_combine;
+
+	if (!redblack_tree_set_aggregate(t, &max_end))
+		return 0;
+	t->interval_start = interval_start;
+	return 1;
+}
+
+/*
+** A subtree whose maximum end is <= start cannot overlap, and since
+** items are ordered by start, nothing at or right of a node starting
+** at or after end can overlap either.
+*/
+static void redblack_tree_overlap_node(redblack_tree *t,
+				       redblack_tree_node *node,
+				       int64_t start,
+				       int64_t end,
+				       void (*visitor)(redblack_tree_node *node, void *context),
+				       void *context)
+{
+	while (node && node->aggregate > start) {
+
+		redblack_tree_overlap_node(t, node->left, start, end,
+					   visitor, context);
+
+		if (t->interval_start(node->item) >= end)
+			return;
+
+		if (redblack_tree_node_value(t, node) > start)
+			visitor(node, context);
+
+		node = node->right;
+	}
+}
+
+void redblack_tree_overlap(redblack_tree *t,
+			   int64_t start,
+			   int64_t end,
+			   void (*visitor)(redblack_tree_node *node, void *context),
+			   void *context)
+{
+	if (!t->interval_start || start >= end)
+		return;
+
+	redblack_tree_flush(t);
+
+	redblack_tree_overlap_node(t, t->root, start, end, visitor, context);
+}
+
+void redblack_tree_stab(redblack_tree *t,
+			int64_t point,
+			void (*visitor)(redblack_tree_node *node, void *context),
+			void *context)
+{
+	if (point == INT64_MAX) // [point, point + 1) would overflow
+		return;
+
+	redblack_tree_overlap(t, point, point + 1, visitor, context);
+}
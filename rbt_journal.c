@@ -0,0 +1,410 @@
+/*
+** rbt_journal.c : implementation of Red-Black Tree write-ahead log
+** Copyright (C) 2018  Tim Whisonant
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "rbt.h"
+#include "rbt_util.h"
+
+/*
+** Log record (integers are little-endian):
+**
+**   op:u8 len:u32 payload[len] check:u32
+**
+** payload is the item as written by codec->save_item, and check is the
+** FNV-1a hash of op, len and payload. A record that is short or fails
+** the check marks the end of the log.
+*/
+#define RBT_JOURNAL_INSERT 1
+#define RBT_JOURNAL_REMOVE 2
+
+#define RBT_JOURNAL_HEADER 5
+#define RBT_JOURNAL_TRAILER 4
+
+static uint32_t redblack_tree_journal_hash(const uint8_t *buf, size_t len)
+{
+	uint32_t h = 2166136261u;
+
+	while (len--) {
+		h ^= *buf++;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+static void redblack_tree_journal_put32(uint8_t *buf, uint32_t v)
+{
+	buf[0] = (uint8_t) v;
+	buf[1] = (uint8_t) (v >> 8);
+	buf[2] = (uint8_t) (v >> 16);
+	buf[3] = (uint8_t) (v >> 24);
+}
+
+static uint32_t redblack_tree_journal_get32(const uint8_t *buf)
+{
+	return (uint32_t) buf[0] |
+	       ((uint32_t) buf[1] << 8) |
+	       ((uint32_t) buf[2] << 16) |
+	       ((uint32_t) buf[3] << 24);
+}
+
+static int redblack_tree_journal_reserve(redblack_tree_journal *j, size_t len)
+{
+	uint8_t *buf;
+	size_t capacity;
+
+	if (j->len + len <= j->capacity)
+		return 1;
+
+	capacity = j->capacity ? j->capacity : 4096;
+	while (capacity < j->len + len)
+		capacity *= 2;
+
+	buf = (uint8_t *) realloc(j->buf, capacity);
+	if (!buf)
+		return 0;
+
+	j->buf = buf;
+	j->capacity = capacity;
+	return 1;
+}
+
+// stream handed to codec->save_item, appending to the record buffer
+static int redblack_tree_journal_write(void *context, const void *buf, size_t len)
+{
+	redblack_tree_journal *j = (redblack_tree_journal *) context;
+
+	if (!redblack_tree_journal_reserve(j, len))
+		return 0;
+
+	memcpy(j->buf + j->len, buf, len);
+	j->len += len;
+	return 1;
+}
+
+// add the record of op to the buffer; 0 if it could not be encoded
+static int redblack_tree_journal_encode(redblack_tree_journal *j,
+					uint8_t op,
+					void *item)
+{
+	redblack_tree_stream s;
+	size_t start = j->len;
+	size_t payload;
+
+	if (j->error)
+		return 0;
+
+	s.write = redblack_tree_journal_write;
+	s.read = NULL;
+	s.context = j;
+
+	if (!redblack_tree_journal_reserve(j, RBT_JOURNAL_HEADER))
+		goto out_error;
+
+	j->buf[j->len] = op;
+	j->len += RBT_JOURNAL_HEADER;
+
+	if (!j->codec->save_item(&s, item))
+		goto out_error;
+
+	payload = j->len - start - RBT_JOURNAL_HEADER;
+	redblack_tree_journal_put32(j->buf + start + 1, (uint32_t) payload);
+
+	if (!redblack_tree_journal_reserve(j, RBT_JOURNAL_TRAILER))
+		goto out_error;
+
+	redblack_tree_journal_put32(j->buf + j->len,
+			redblack_tree_journal_hash(j->buf + start,
+						   j->len - start));
+	j->len += RBT_JOURNAL_TRAILER;
+	return 1;
+
+out_error:
+	j->len = start;
+	j->error = 1;
+	return 0;
+}
+
+int redblack_tree_journal_open(redblack_tree_journal *j,
+			       redblack_tree *t,
+			       const char *path,
+			       const redblack_tree_codec *codec,
+			       uint32_t sync_batch)
+{
+	j->t = t;
+	j->codec = codec;
+	j->error = 0;
+	j->buf = NULL;
+	j->len = 0;
+	j->capacity = 0;
+	j->sync_batch = sync_batch;
+	j->pending = 0;
+
+	if (!codec->save_item)
+		return 0;
+
+	j->fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+
+	return j->fd >= 0;
+}
+
+/*
+** The record is encoded before the tree changes, and dropped again if
+** the tree doesn't, so a change that can't be logged is never made.
+** Only a failed group commit leaves the tree ahead of the log.
+*/
+static int redblack_tree_journal_apply(redblack_tree_journal *j,
+				       uint8_t op,
+				       void *item)
+{
+	size_t start = j->len;
+	int changed;
+
+	if (!redblack_tree_journal_encode(j, op, item))
+		return 0;
+
+	if (op == RBT_JOURNAL_INSERT)
+		changed = redblack_tree_insert(j->t, item);
+	else
+		changed = redblack_tree_remove(j->t, item);
+
+	if (!changed) {
+		j->len = start;
+		return 0;
+	}
+
+	if (j->sync_batch && ++j->pending >= j->sync_batch)
+		return redblack_tree_journal_commit(j);
+
+	return 1;
+}
+
+int redblack_tree_journal_insert(redblack_tree_journal *j, void *item)
+{
+	return redblack_tree_journal_apply(j, RBT_JOURNAL_INSERT, item);
+}
+
+int redblack_tree_journal_remove(redblack_tree_journal *j, void *item)
+{
+	return redblack_tree_journal_apply(j, RBT_JOURNAL_REMOVE, item);
+}
+
+int redblack_tree_journal_commit(redblack_tree_journal *j)
+{
+	size_t done = 0;
+	ssize_t res;
+
+	if (j->error)
+		return 0;
+
+	while (done < j->len) {
+		res = write(j->fd, j->buf + done, j->len - done);
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			j->error = 1;
+			return 0;
+		}
+		done += res;
+	}
+
+	if (j->len && fdatasync(j->fd)) {
+		j->error = 1;
+		return 0;
+	}
+
+	j->len = 0;
+	j->pending = 0;
+	return 1;
+}
+
+int redblack_tree_journal_truncate(redblack_tree_journal *j)
+{
+	j->len = 0;
+	j->pending = 0;
+
+	if (j->error)
+		return 0;
+
+	if (ftruncate(j->fd, 0) || fdatasync(j->fd)) {
+		j->error = 1;
+		return 0;
+	}
+
+	return 1;
+}
+
+int redblack_tree_journal_close(redblack_tree_journal *j)
+{
+	int res = redblack_tree_journal_commit(j);
+
+	if (close(j->fd))
+		res = 0;
+
+	free(j->buf);
+	j->buf = NULL;
+	j->capacity = j->len = 0;
+	j->fd = -1;
+
+	return res;
+}
+
+typedef struct _redblack_tree_journal_payload {
+	const uint8_t *buf;
+	size_t len;
+	size_t pos;
+} redblack_tree_journal_payload;
+
+// stream handed to codec->load_item, reading one record's payload
+static int redblack_tree_journal_read(void *context, void *buf, size_t len)
+{
+	redblack_tree_journal_payload *p =
+		(redblack_tree_journal_payload *) context;
+
+	if (p->pos + len > p->len)
+		return 0;
+
+	memcpy(buf, p->buf + p->pos, len);
+	p->pos += len;
+	return 1;
+}
+
+/*
+** The item the tree stored for the key leaves with its node, so it goes
+** to free_item as well: the tree must let go of it right away, neither
+** buffering the remove nor leaving a tombstone that still compares it.
+** Arena nodes hold copies, which are not the codec's.
+*/
+static void redblack_tree_journal_replay_remove(redblack_tree *t,
+						const redblack_tree_codec *codec,
+						void *item)
+{
+	uint32_t lazy = t->tombstone_percent;
+	redblack_tree_node *node;
+	void *stored = NULL;
+
+	if (!codec->free_item) {
+		redblack_tree_remove(t, item);
+		return;
+	}
+
+	redblack_tree_flush(t);
+	node = redblack_tree_find(t, item);
+	if (node && !t->arena)
+		stored = node->item;
+
+	t->tombstone_percent = 0;
+	redblack_tree_remove(t, item);
+	t->tombstone_percent = lazy;
+	redblack_tree_flush(t);
+	redblack_tree_rebalance(t, 0);
+
+	if (stored && stored != item)
+		redblack_tree_codec_release(codec, stored);
+	redblack_tree_codec_release(codec, item);
+}
+
+int redblack_tree_journal_replay(redblack_tree *t,
+				 const char *path,
+				 const redblack_tree_codec *codec)
+{
+	redblack_tree_journal_payload payload;
+	redblack_tree_stream s;
+	uint8_t *buf = NULL;
+	size_t capacity = 0;
+	size_t len;
+	void *item;
+	FILE *fp;
+	int res = 1;
+
+	if (!codec->load_item)
+		return 0;
+
+	fp = fopen(path, "rb");
+	if (!fp)
+		return errno == ENOENT;
+
+	s.write = NULL;
+	s.read = redblack_tree_journal_read;
+	s.context = &payload;
+
+	for (;;) {
+		uint8_t header[RBT_JOURNAL_HEADER];
+
+		if (fread(header, 1, sizeof(header), fp) != sizeof(header))
+			break;
+
+		len = RBT_JOURNAL_HEADER +
+		      redblack_tree_journal_get32(header + 1) +
+		      RBT_JOURNAL_TRAILER;
+
+		if (len > capacity) {
+			uint8_t *grown = (uint8_t *) realloc(buf, len);
+			if (!grown) {
+				res = 0;
+				break;
+			}
+			buf = grown;
+			capacity = len;
+		}
+
+		memcpy(buf, header, sizeof(header));
+		if (fread(buf + sizeof(header), 1, len - sizeof(header), fp) !=
+		    len - sizeof(header))
+			break;
+
+		if (redblack_tree_journal_hash(buf, len - RBT_JOURNAL_TRAILER) !=
+		    redblack_tree_journal_get32(buf + len - RBT_JOURNAL_TRAILER))
+			break;
+
+		// the hash matched, so this is no torn record but a corrupt one
+		if (buf[0] != RBT_JOURNAL_INSERT && buf[0] != RBT_JOURNAL_REMOVE) {
+			res = 0;
+			break;
+		}
+
+		payload.buf = buf + RBT_JOURNAL_HEADER;
+		payload.len = len - RBT_JOURNAL_HEADER - RBT_JOURNAL_TRAILER;
+		payload.pos = 0;
+
+		if (!codec->load_item(&s, &item)) {
+			res = 0;
+			break;
+		}
+
+		if (buf[0] == RBT_JOURNAL_INSERT) {
+			// an arena node takes a copy of the item
+			if (!redblack_tree_insert(t, item) || t->arena)
+				redblack_tree_codec_release(codec, item);
+		} else {
+			redblack_tree_journal_replay_remove(t, codec, item);
+		}
+	}
+
+	if (ferror(fp))
+		res = 0;
+
+	free(buf);
+	fclose(fp);
+	return res;
+}
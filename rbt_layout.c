@@ -0,0 +1,258 @@
+/*
+** rbt_layout.c : relayout of the nodes of Red-Black Trees
+** Copyright (C) 2018  Tim Whisonant
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#include <stdlib.h>
+
+#include "rbt.h"
+#include "rbt_util.h"
+
+/*
+** A pass copies the nodes in key order, from t->layout->next onwards,
+** into the open slab, and frees each original right away, so it needs
+** memory for one extra copy of the tree at most. next follows the tree
+** the way t->leftmost does: rotations keep it, and redblack_tree_track_remove
+** hands it on to the successor of a node being unlinked. Nodes inserted
+** behind it keep their place until the next pass.
+*/
+
+#define RBT_SLAB_MIN 64 // nodes in a slab added during a pass
+
+static int redblack_tree_slab_of(redblack_tree_layout *l,
+				 redblack_tree_node *node)
+{
+	uint32_t i;
+
+	for (i = 0 ; i < l->num_slabs ; ++i)
+		if (node >= l->slabs[i].nodes &&
+		    node < l->slabs[i].nodes + l->slabs[i].size)
+			return (int) i;
+
+	redblack_tree_assert(0);
+	return -1;
+}
+
+static void redblack_tree_slab_drop(redblack_tree_layout *l, int i)
+{
+	free(l->slabs[i].nodes);
+	l->slabs[i] = l->slabs[--l->num_slabs];
+	if (l->open == (int) l->num_slabs)
+		l->open = i;
+}
+
+// end the pass; the open slab stays as long as it has nodes
+static void redblack_tree_layout_close(redblack_tree_layout *l)
+{
+	int i = l->open;
+
+	l->next = NULL;
+	l->open = -1;
+	if (i >= 0 && !l->slabs[i].live)
+		redblack_tree_slab_drop(l, i);
+}
+
+int redblack_tree_layout_free(redblack_tree *t, redblack_tree_node *node)
+{
+	redblack_tree_layout *l = t->layout;
+	int i;
+
+	// only compaction and destroy free nodes without unlinking them
+	if (node == l->next)
+		redblack_tree_layout_close(l);
+
+	if (!(node->flags & RBT_NODE_SLAB))
+		return 0;
+
+	i = redblack_tree_slab_of(l, node);
+	if (!--l->slabs[i].live && i != l->open)
+		redblack_tree_slab_drop(l, i);
+	return 1;
+}
+
+void redblack_tree_layout_release(redblack_tree_layout *l)
+{
+	while (l->num_slabs)
+		redblack_tree_slab_drop(l, 0);
+	free(l->slabs);
+	free(l);
+}
+
+void redblack_tree_layout_destroy(redblack_tree *t)
+{
+	if (!t->layout)
+		return;
+
+	// every node has been released, only an empty open slab may be left
+	redblack_tree_layout_release(t->layout);
+	t->layout = NULL;
+}
+
+static redblack_tree_node * redblack_tree_layout_slot(redblack_tree *t)
+{
+	redblack_tree_layout *l = t->layout;
+	redblack_tree_slab *slab;
+	uint64_t size;
+
+	if (l->open >= 0) {
+		slab = &l->slabs[l->open];
+		if (slab->used < slab->size) {
+			++slab->live;
+			return &slab->nodes[slab->used++];
+		}
+		// inserts ahead of the pass filled it up
+		size = redblack_tree_max((t->count + t->tombstones) / 16,
+					 (uint64_t) RBT_SLAB_MIN);
+		if (!slab->live)
+			redblack_tree_slab_drop(l, l->open);
+	} else
+		size = t->count + t->tombstones;
+
+	l->open = -1;
+
+	if (l->num_slabs == l->capacity) {
+		uint32_t capacity = l->capacity ? 2 * l->capacity : 4;
+		redblack_tree_slab *slabs = (redblack_tree_slab *)
+			realloc(l->slabs, capacity * sizeof(redblack_tree_slab));
+		if (!slabs)
+			return NULL;
+		l->slabs = slabs;
+		l->capacity = capacity;
+	}
+
+	slab = &l->slabs[l->num_slabs];
+	slab->nodes = (redblack_tree_node *)
+		malloc(size * sizeof(redblack_tree_node));
+	if (!slab->nodes)
+		return NULL;
+	slab->size = size;
+	slab->used = 1;
+	slab->live = 1;
+	l->open = (int) l->num_slabs++;
+	return slab->nodes;
+}
+
+// put copy in the place of node, which is released
+static void redblack_tree_layout_move(redblack_tree *t,
+				      redblack_tree_node *node,
+				      redblack_tree_node *copy)
+{
+	*copy = *node;
+	copy->flags |= RBT_NODE_SLAB;
+
+	if (!node->parent)
+		t->root = copy;
+	else if (node == node->parent->left)
+		node->parent->left = copy;
+	else
+		node->parent->right = copy;
+	if (node->left)
+		node->left->parent = copy;
+	if (node->right)
+		node->right->parent = copy;
+
+	if (t->leftmost == node)
+		t->leftmost = copy;
+	if (t->rightmost == node)
+		t->rightmost = copy;
+	if (t->clock && t->clock->hand == node)
+		t->clock->hand = copy;
+
+	if (t->hash_item && !redblack_tree_is_tombstone(node))
+		redblack_tree_hash_move(t, node, copy);
+	if (t->cache) {
+		redblack_tree_node **slot = redblack_tree_cache_slot(t, node->item);
+		if (*slot == node)
+			*slot = copy;
+	}
+	if (node->flags & RBT_NODE_PENDING)
+		redblack_tree_relaxed_move(t, node, copy);
+
+	// a copy, not an item leaving the tree: no stats, no probes
+	if (!redblack_tree_layout_free(t, node))
+		t->free_node(node);
+}
+
+// 1 while nodes are left, 0 once the pass is done, -1 if out of memory
+static int redblack_tree_layout_run(redblack_tree *t, uint32_t budget)
+{
+	redblack_tree_layout *l = t->layout;
+	redblack_tree_node *node;
+	redblack_tree_node *copy;
+	uint32_t moved = 0;
+
+	if (!l->next) {
+		// a pass whose last nodes were removed is done
+		if (l->open >= 0) {
+			redblack_tree_layout_close(l);
+			return 0;
+		}
+		if (!t->root)
+			return 0;
+		l->next = t->leftmost;
+	}
+
+	while (l->next) {
+		if (budget && moved++ == budget)
+			return 1;
+
+		copy = redblack_tree_layout_slot(t);
+		if (!copy) {
+			redblack_tree_layout_close(l);
+			return -1;
+		}
+
+		node = l->next;
+		l->next = redblack_tree_next(node);
+		redblack_tree_layout_move(t, node, copy);
+	}
+
+	redblack_tree_layout_close(l);
+	return 0;
+}
+
+static int redblack_tree_layout_init(redblack_tree *t)
+{
+	if (t->btree_key || t->arena)
+		return 0;
+
+	if (!t->layout) {
+		t->layout = (redblack_tree_layout *)
+			calloc(1, sizeof(redblack_tree_layout));
+		if (!t->layout)
+			return 0;
+		t->layout->open = -1;
+	}
+	return 1;
+}
+
+int redblack_tree_relayout(redblack_tree *t)
+{
+	if (!redblack_tree_layout_init(t))
+		return 0;
+
+	// a pass under way would leave the nodes in two slabs
+	redblack_tree_layout_close(t->layout);
+	return redblack_tree_layout_run(t, 0) == 0;
+}
+
+int redblack_tree_relayout_step(redblack_tree *t, uint32_t budget)
+{
+	if (!redblack_tree_layout_init(t))
+		return 0;
+
+	return redblack_tree_layout_run(t, budget) == 1;
+}
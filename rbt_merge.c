@@ -0,0 +1,214 @@
+/*
+** rbt_merge.c : ordered merge of Red-Black Trees
+** Copyright (C) 2018  Tim Whisonant
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#include <stdlib.h>
+
+#include "rbt.h"
+#include "rbt_util.h"
+
+/*
+** Red-black cursors walk with a stack of the ancestors whose items are
+** still to come, rather than by parent links: on trees much larger than
+** the cache, climbing back up reloads nodes long evicted. Relaxed trees
+** are rebalanced first, so no tree is deeper than 2 * log2(n + 1).
+*/
+#define RBT_MERGE_STACK 128
+
+// push the left spine of node, then pop the next node that is no tombstone
+static void redblack_tree_merge_descend(redblack_tree_merge_cursor *c,
+					redblack_tree_node *node)
+{
+	for (;;) {
+		while (node) {
+			redblack_tree_assert(c->top < RBT_MERGE_STACK);
+			c->stack[c->top++] = node;
+			node = node->left;
+		}
+
+		if (!c->top) {
+			c->node = NULL;
+			return;
+		}
+
+		c->node = c->stack[--c->top];
+		node = c->node->right;
+		if (!redblack_tree_is_tombstone(c->node)) {
+			// needed when this cursor moves on, likely a few items later
+			if (node)
+				__builtin_prefetch(node);
+			return;
+		}
+	}
+}
+
+static void redblack_tree_merge_advance(redblack_tree_merge_cursor *c)
+{
+	if (c->t->btree_key)
+		c->node = redblack_btree_next(&c->leaf, &c->pos);
+	else
+		redblack_tree_merge_descend(c, c->node->right);
+
+	if (c->node)
+		c->item = c->node->item;
+}
+
+/*
+** Cursor a beats cursor b: it has a node left and, unless b is done,
+** a smaller item, or an equal one from an earlier tree.
+*/
+static inline int redblack_tree_merge_wins(redblack_tree_merge *m,
+					   uint32_t a,
+					   uint32_t b)
+{
+	int64_t res;
+
+	if (!m->cursors[a].node)
+		return 0;
+	if (!m->cursors[b].node)
+		return 1;
+
+	res = m->cursors[0].t->compare_items(m->cursors[a].item,
+					     m->cursors[b].item);
+	return res < 0 || (!res && a < b);
+}
+
+/*
+** Cursor i sits below the match at (i + num_trees) / 2. Once it has
+** moved on, it replays the matches up to the root against their losers.
+*/
+static void redblack_tree_merge_replay(redblack_tree_merge *m, uint32_t i)
+{
+	uint32_t winner = i;
+	uint32_t loser;
+	uint32_t p;
+
+	for (p = (i + m->num_trees) / 2 ; p > 0 ; p /= 2) {
+		loser = m->losers[p];
+		if (redblack_tree_merge_wins(m, loser, winner)) {
+			m->losers[p] = winner;
+			winner = loser;
+		}
+	}
+	m->losers[0] = winner;
+}
+
+int redblack_tree_merge_init(redblack_tree_merge *m,
+			     redblack_tree **trees,
+			     uint32_t num_trees,
+			     int distinct)
+{
+	redblack_tree_merge_cursor *c;
+	uint32_t *winners;
+	uint32_t i;
+
+	m->cursors = (redblack_tree_merge_cursor *)
+		malloc((num_trees + 1) * sizeof(redblack_tree_merge_cursor));
+	m->losers = (uint32_t *) malloc((num_trees + 1) * sizeof(uint32_t));
+	m->stacks = (redblack_tree_node **)
+		malloc((num_trees + 1) * RBT_MERGE_STACK * sizeof(redblack_tree_node *));
+	winners = (uint32_t *) malloc(2 * (num_trees + 1) * sizeof(uint32_t));
+	if (!m->cursors || !m->losers || !m->stacks || !winners) {
+		free(m->cursors);
+		free(m->losers);
+		free(m->stacks);
+		free(winners);
+		return 0;
+	}
+
+	m->num_trees = num_trees;
+	m->distinct = distinct;
+
+	for (i = 0 ; i < num_trees ; ++i) {
+		c = &m->cursors[i];
+		c->t = trees[i];
+		c->stack = m->stacks + (size_t) i * RBT_MERGE_STACK;
+		c->top = 0;
+		c->leaf = NULL;
+		c->pos = 0;
+
+		redblack_tree_flush(c->t);
+		redblack_tree_rebalance(c->t, 0);
+		if (c->t->btree_key)
+			c->node = redblack_btree_first(c->t, &c->leaf, &c->pos);
+		else
+			redblack_tree_merge_descend(c, c->t->root);
+		if (c->node)
+			c->item = c->node->item;
+
+		winners[num_trees + i] = i;
+	}
+
+	// play every match once, from the bottom up
+	for (i = num_trees - 1 ; i > 0 && i < num_trees ; --i) {
+		uint32_t a = winners[2 * i];
+		uint32_t b = winners[2 * i + 1];
+
+		if (redblack_tree_merge_wins(m, a, b)) {
+			winners[i] = a;
+			m->losers[i] = b;
+		} else {
+			winners[i] = b;
+			m->losers[i] = a;
+		}
+	}
+	m->losers[0] = num_trees > 1 ? winners[1] : 0;
+
+	free(winners);
+	return 1;
+}
+
+redblack_tree_node * redblack_tree_merge_next(redblack_tree_merge *m, uint32_t *tree)
+{
+	redblack_tree_merge_cursor *c;
+	redblack_tree_node *node;
+	uint32_t winner;
+
+	if (!m->num_trees)
+		return NULL;
+
+	winner = m->losers[0];
+	c = &m->cursors[winner];
+	node = c->node;
+	if (!node)
+		return NULL;
+	if (tree)
+		*tree = winner;
+
+	do {
+		redblack_tree_merge_advance(c);
+		redblack_tree_merge_replay(m, winner);
+
+		// the copies in later trees win next
+		winner = m->losers[0];
+		c = &m->cursors[winner];
+	} while (m->distinct && c->node &&
+		 !m->cursors[0].t->compare_items(node->item, c->item));
+
+	return node;
+}
+
+void redblack_tree_merge_destroy(redblack_tree_merge *m)
+{
+	free(m->cursors);
+	free(m->losers);
+	free(m->stacks);
+	m->cursors = NULL;
+	m->losers = NULL;
+	m->stacks = NULL;
+	m->num_trees = 0;
+}
@@ -0,0 +1,82 @@
+/*
+** rbt_probe.c : latency histograms and the probe hook
+** Copyright (C) 2018  Tim Whisonant
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#include <stdlib.h>
+#include <string.h>
+
+#include "rbt.h"
+#include "rbt_util.h"
+
+#if defined(RBT_PROBES) && !__has_include(<sys/sdt.h>)
+/*
+** Without USDT support every probe lands here. Keep the call and its
+** arguments observable: uprobe:librbt.so:redblack_tree_probe_hook
+*/
+__attribute__((noinline)) void redblack_tree_probe_hook(const char *name,
+							 void *t,
+							 uint64_t arg)
+{
+	__asm__ __volatile__("" : : "r" (name), "r" (t), "r" (arg) : "memory");
+}
+#endif
+
+int redblack_tree_set_latency_histograms(redblack_tree *t, int on)
+{
+	if (!on) {
+		free(t->latency);
+		t->latency = NULL;
+		return 1;
+	}
+
+	if (!t->latency)
+		t->latency = (redblack_tree_latency *)
+				calloc(1, sizeof(redblack_tree_latency));
+
+	return t->latency != NULL;
+}
+
+int redblack_tree_get_latency(redblack_tree *t,
+			      int op,
+			      uint64_t counts[RBT_LATENCY_BUCKETS])
+{
+	int i;
+
+	memset(counts, 0, RBT_LATENCY_BUCKETS * sizeof(uint64_t));
+
+	if (!t->latency || op < RBT_TRACE_INSERT || op > RBT_TRACE_REMOVE)
+		return 0;
+
+	for (i = 0 ; i < RBT_LATENCY_BUCKETS ; ++i)
+		counts[i] = __atomic_load_n(&t->latency->counts[op - 1][i],
+					    __ATOMIC_RELAXED);
+	return 1;
+}
+
+void redblack_tree_reset_latency(redblack_tree *t)
+{
+	int op;
+	int i;
+
+	if (!t->latency)
+		return;
+
+	for (op = 0 ; op < 3 ; ++op)
+		for (i = 0 ; i < RBT_LATENCY_BUCKETS ; ++i)
+			__atomic_store_n(&t->latency->counts[op][i], 0,
+					 __ATOMIC_RELAXED);
+}
@@ -0,0 +1,121 @@
+/*
+** rbt_reclaim.c : deferred destruction of Red-Black Trees
+** Copyright (C) 2018  Tim Whisonant
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#include "rbt.h"
+#include "rbt_util.h"
+
+/*
+** Detached nodes are freed by rotating each left child up until the
+** top node has none, then freeing it and going on with its right child.
+** Every node is rotated at most once, and the only state kept between
+** steps is the top node, so the walk needs no stack however deep the
+** tree is.
+*/
+
+int redblack_tree_detach(redblack_tree *t, redblack_tree_reclaim *r)
+{
+	if (t->arena)
+		return 0;
+
+	// buffered writes belong to the contents handed over
+	redblack_tree_flush(t);
+
+	r->root = t->root;
+	r->btree = t->btree;
+	r->layout = t->layout;
+	r->free_node = t->free_node;
+	r->running = 0;
+
+#ifdef RBT_STATS
+	t->stats.frees += t->count + t->tombstones;
+#endif // RBT_STATS
+
+	// forget the nodes, keeping the configuration
+	t->root = NULL;
+	t->btree = NULL;
+	t->layout = NULL;
+	t->leftmost = NULL;
+	t->rightmost = NULL;
+	t->count = 0;
+	t->tombstones = 0;
+	if (t->cache)
+		memset(t->cache, 0, (t->cache_mask + 1) * sizeof(redblack_tree_node *));
+	if (t->clock)
+		t->clock->hand = NULL;
+	redblack_tree_relaxed_clear(t);
+	redblack_tree_hash_rebuild(t);
+	redblack_tree_filter_rebuild(t);
+	return 1;
+}
+
+int redblack_tree_reclaim_step(redblack_tree_reclaim *r, uint64_t budget)
+{
+	redblack_tree_node *node;
+	redblack_tree_node *left;
+
+	redblack_btree_reclaim(&r->btree, r->free_node, &budget);
+
+	for ( ; r->root && budget ; --budget) {
+		node = r->root;
+		left = node->left;
+		if (left) {
+			node->left = left->right;
+			left->right = node;
+			r->root = left;
+		} else {
+			r->root = node->right;
+			// slab nodes go with their slab
+			if (!(node->flags & RBT_NODE_SLAB))
+				r->free_node(node);
+		}
+	}
+
+	if (r->root || r->btree)
+		return 1;
+
+	if (r->layout) {
+		redblack_tree_layout_release(r->layout);
+		r->layout = NULL;
+	}
+	return 0;
+}
+
+static void * redblack_tree_reclaim_run(void *context)
+{
+	redblack_tree_reclaim_step((redblack_tree_reclaim *) context, UINT64_MAX);
+	return NULL;
+}
+
+int redblack_tree_reclaim_start(redblack_tree_reclaim *r)
+{
+	if (pthread_create(&r->thread, NULL, redblack_tree_reclaim_run, r))
+		return 0;
+
+	r->running = 1;
+	return 1;
+}
+
+void redblack_tree_reclaim_wait(redblack_tree_reclaim *r)
+{
+	if (r->running) {
+		pthread_join(r->thread, NULL);
+		r->running = 0;
+	}
+
+	redblack_tree_reclaim_step(r, UINT64_MAX);
+}
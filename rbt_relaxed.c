@@ -0,0 +1,253 @@
+/*
+** rbt_relaxed.c : relaxed balance with deferred repairs
+** Copyright (C) 2018  Tim Whisonant
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#include <stdlib.h>
+
+#include "rbt.h"
+#include "rbt_util.h"
+
+/*
+** In relaxed mode the tree may break one rule only: red nodes may have
+** red parents. An insert links a red leaf and never changes a black
+** height; a remove either unlinks a node in O(1) - a red one, or a black
+** one whose red child turns black - or leaves the node in place as a
+** tombstone. Every red node under a red parent is listed in reds, as
+** it was linked there or because it was already one when a repair moved
+** it; the repairs below only ever move red nodes under red parents that
+** were red under red parents before.
+*/
+
+int redblack_tree_set_relaxed(redblack_tree *t, uint32_t max_pending)
+{
+	redblack_tree_relaxed *r;
+
+	if (t->relaxed) {
+		redblack_tree_rebalance(t, 0);
+		free(t->relaxed->reds);
+		free(t->relaxed->dead);
+		free(t->relaxed);
+		t->relaxed = NULL;
+	}
+
+	if (!max_pending)
+		return 1;
+
+	if (t->btree_key || t->balance == RBT_BALANCE_WAVL ||
+	    t->tombstone_percent || t->arena || t->clock)
+		return 0;
+
+	r = (redblack_tree_relaxed *) calloc(1, sizeof(redblack_tree_relaxed));
+	if (!r)
+		return 0;
+
+	// one spare entry, see redblack_tree_relaxed_list
+	r->reds = (redblack_tree_node **)
+		malloc((max_pending + 1) * sizeof(redblack_tree_node *));
+	r->dead = (redblack_tree_node **)
+		malloc((max_pending + 1) * sizeof(redblack_tree_node *));
+	if (!r->reds || !r->dead) {
+		free(r->reds);
+		free(r->dead);
+		free(r);
+		return 0;
+	}
+
+	r->capacity = max_pending;
+	t->relaxed = r;
+	return 1;
+}
+
+/*
+** x is red under a red parent. The repairs of rbt_insert.c need a black
+** grandparent, so the topmost of a run of red nodes goes first; case 3
+** may then push the violation up to the grandparent, and once x is no
+** longer red under red, neither is anything between it and the root.
+*/
+static void redblack_tree_relaxed_fix(redblack_tree *t, redblack_tree_node *x)
+{
+	redblack_tree_node *bottom = x;
+	redblack_tree_node *p;
+	redblack_tree_node *gp;
+	redblack_tree_node *u;
+
+	for (;;) {
+		p = x->parent;
+		if (!p)
+			x->color = RBT_BLACK;
+		if (x->color != RBT_RED || !p || p->color != RBT_RED) {
+			if (x == bottom)
+				return;
+			x = bottom;
+			continue;
+		}
+
+		gp = p->parent;
+		if (!gp) {
+			redblack_tree_stat(t, insert_cases[0]);
+			p->color = RBT_BLACK;
+			continue;
+		}
+
+		if (gp->color == RBT_RED) {
+			x = p;
+			continue;
+		}
+
+		u = p == gp->left ? gp->right : gp->left;
+		if (u && u->color == RBT_RED) {
+			redblack_tree_stat(t, insert_cases[2]);
+			p->color = u->color = RBT_BLACK;
+			gp->color = RBT_RED;
+			x = gp;
+			continue;
+		}
+
+		if (x == p->right && p == gp->left) {
+			redblack_tree_stat(t, insert_cases[3]);
+			redblack_tree_rol(t, p);
+			x = p;
+			p = x->parent;
+		} else if (x == p->left && p == gp->right) {
+			redblack_tree_stat(t, insert_cases[3]);
+			redblack_tree_ror(t, p);
+			x = p;
+			p = x->parent;
+		}
+
+		redblack_tree_stat(t, insert_cases[4]);
+		p->color = RBT_BLACK;
+		gp->color = RBT_RED;
+		if (x == p->left)
+			redblack_tree_ror(t, gp);
+		else
+			redblack_tree_rol(t, gp);
+	}
+}
+
+/*
+** Tombstones are unlinked with the repairs of rbt_remove.c, which need
+** a valid tree, so all reds are repaired before any of them. Lists are
+** worked from the end.
+*/
+uint32_t redblack_tree_rebalance(redblack_tree *t, uint32_t budget)
+{
+	redblack_tree_relaxed *r = t->relaxed;
+	redblack_tree_node *node;
+	uint32_t done = 0;
+
+	if (!r)
+		return 0;
+
+	while (r->num_reds + r->num_dead && (!budget || done < budget)) {
+		if (r->num_reds) {
+			node = r->reds[--r->num_reds];
+			if (!node)
+				continue;
+			// unless it was buried since, it is listed no more
+			if (!redblack_tree_is_tombstone(node))
+				node->flags &= ~RBT_NODE_PENDING;
+			redblack_tree_relaxed_fix(t, node);
+		} else {
+			// a tombstone is listed once, see redblack_tree_relaxed_revive
+			node = r->dead[--r->num_dead];
+			if (!node)
+				continue;
+			node->flags &= ~RBT_NODE_PENDING;
+			redblack_tree_remove_found(t, node);
+		}
+		++done;
+	}
+
+	return r->num_reds + r->num_dead;
+}
+
+/*
+** node is listed before room is made, as making room may unlink nodes
+** and move the items of others; listed nodes are kept track of.
+*/
+static void redblack_tree_relaxed_list(redblack_tree *t,
+				       redblack_tree_node **list,
+				       uint32_t *num,
+				       redblack_tree_node *node)
+{
+	node->flags |= RBT_NODE_PENDING;
+	list[(*num)++] = node;
+
+	while (*num > t->relaxed->capacity)
+		redblack_tree_rebalance(t, 1);
+}
+
+void redblack_tree_relaxed_red(redblack_tree *t, redblack_tree_node *node)
+{
+	redblack_tree_relaxed_list(t, t->relaxed->reds, &t->relaxed->num_reds, node);
+}
+
+int redblack_tree_relaxed_remove(redblack_tree *t, redblack_tree_node *node)
+{
+	redblack_tree_node *unlinked = is_internal(node) ? successor(node) : node;
+
+	// unlinking a black leaf needs the repair
+	if (unlinked->color != RBT_BLACK || !is_leaf(unlinked) ||
+	    !unlinked->parent)
+		return 0;
+
+	redblack_tree_bury(t, node);
+	redblack_tree_relaxed_list(t, t->relaxed->dead, &t->relaxed->num_dead, node);
+	return 1;
+}
+
+static void redblack_tree_relaxed_replace(redblack_tree_node **list,
+					  uint32_t num,
+					  redblack_tree_node *from,
+					  redblack_tree_node *to)
+{
+	uint32_t i;
+
+	for (i = 0 ; i < num ; ++i)
+		if (list[i] == from)
+			list[i] = to;
+}
+
+void redblack_tree_relaxed_move(redblack_tree *t,
+				redblack_tree_node *from,
+				redblack_tree_node *to)
+{
+	redblack_tree_relaxed *r = t->relaxed;
+
+	from->flags &= ~RBT_NODE_PENDING;
+	if (!r)
+		return;
+
+	if (to)
+		to->flags |= RBT_NODE_PENDING;
+	redblack_tree_relaxed_replace(r->reds, r->num_reds, from, to);
+	redblack_tree_relaxed_replace(r->dead, r->num_dead, from, to);
+}
+
+void redblack_tree_relaxed_revive(redblack_tree *t, redblack_tree_node *node)
+{
+	if (t->relaxed)
+		redblack_tree_relaxed_replace(t->relaxed->dead,
+					      t->relaxed->num_dead, node, NULL);
+}
+
+void redblack_tree_relaxed_clear(redblack_tree *t)
+{
+	if (t->relaxed)
+		t->relaxed->num_reds = t->relaxed->num_dead = 0;
+}
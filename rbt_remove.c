@@ -19,28 +19,29 @@
 #include "rbt.h"
 #include "rbt_util.h"
 
-static inline void redblack_tree_remove_repair_case6(redblack_tree_node **root,
+static inline void redblack_tree_remove_repair_case6(redblack_tree *t,
 						     redblack_tree_node *node)
 {
 	redblack_tree_node *s = sibling(node);
 
 	if (s) {
+		redblack_tree_stat(t, remove_cases[5]);
 		s->color = node->parent->color;
 		node->parent->color = RBT_BLACK;
 
 		if (node == node->parent->left) {
 			if (s->right)
 				s->right->color = RBT_BLACK;
-			rol(root, node->parent);
+			redblack_tree_rol(t, node->parent);
 		} else {
 			if (s->left)
 				s->left->color = RBT_BLACK;
-			ror(root, node->parent);
+			redblack_tree_ror(t, node->parent);
 		}
 	}
 }
 
-static inline void redblack_tree_remove_repair_case5(redblack_tree_node **root,
+static inline void redblack_tree_remove_repair_case5(redblack_tree *t,
 						     redblack_tree_node *node)
 {
 	redblack_tree_node *s = sibling(node);
@@ -49,22 +50,24 @@ static inline void redblack_tree_remove_repair_case5(redblack_tree_node **root,
 		if ((node == node->parent->left) &&
 		    (color(s->right) == RBT_BLACK) &&
 		    (s->left && s->left->color == RBT_RED)) {
+			redblack_tree_stat(t, remove_cases[4]);
 			s->color = RBT_RED;
 			s->left->color = RBT_BLACK;
-			ror(root, s);
+			redblack_tree_ror(t, s);
 		} else if ((node == node->parent->right) &&
 			   (color(s->left) == RBT_BLACK) &&
 			   (s->right && s->right->color == RBT_RED)) {
+			redblack_tree_stat(t, remove_cases[4]);
 			s->color = RBT_RED;
 			s->right->color = RBT_BLACK;
-			rol(root, s);
+			redblack_tree_rol(t, s);
 		}
 	}
 
-	redblack_tree_remove_repair_case6(root, node);
+	redblack_tree_remove_repair_case6(t, node);
 }
 
-static inline void redblack_tree_remove_repair_case4(redblack_tree_node **root,
+static inline void redblack_tree_remove_repair_case4(redblack_tree *t,
 						     redblack_tree_node *node)
 {
 	redblack_tree_node *s = sibling(node);
@@ -74,16 +77,17 @@ static inline void redblack_tree_remove_repair_case4(redblack_tree_node **root,
 	    (color(s) == RBT_BLACK) &&
 	    (color(s->left) == RBT_BLACK) &&
 	    (color(s->right) == RBT_BLACK)) {
+		redblack_tree_stat(t, remove_cases[3]);
 		s->color = RBT_RED;
 		node->parent->color = RBT_BLACK;
 	} else
-		redblack_tree_remove_repair_case5(root, node);
+		redblack_tree_remove_repair_case5(t, node);
 }
 
-static inline void redblack_tree_remove_repair_case1(redblack_tree_node **root,
+static inline void redblack_tree_remove_repair_case1(redblack_tree *t,
 						     redblack_tree_node *n);
 
-static inline void redblack_tree_remove_repair_case3(redblack_tree_node **root,
+static inline void redblack_tree_remove_repair_case3(redblack_tree *t,
 						     redblack_tree_node *node)
 {
 	redblack_tree_node *s = sibling(node);
@@ -93,74 +97,97 @@ static inline void redblack_tree_remove_repair_case3(redblack_tree_node **root,
 	    (color(s) == RBT_BLACK) &&
 	    (color(s->left) == RBT_BLACK) &&
 	    (color(s->right) == RBT_BLACK)) {
+		redblack_tree_stat(t, remove_cases[2]);
 		s->color = RBT_RED;
-		redblack_tree_remove_repair_case1(root, node->parent);
+		redblack_tree_remove_repair_case1(t, node->parent);
 	} else
-		redblack_tree_remove_repair_case4(root, node);
+		redblack_tree_remove_repair_case4(t, node);
 }
 
-static inline void redblack_tree_remove_repair_case2(redblack_tree_node **root,
+static inline void redblack_tree_remove_repair_case2(redblack_tree *t,
 						     redblack_tree_node *node)
 {
 	redblack_tree_node *s = sibling(node);
 
 	if (s && s->color == RBT_RED) {
+		redblack_tree_stat(t, remove_cases[1]);
 		node->parent->color = RBT_RED;
 		s->color = RBT_BLACK;
 		if (node == node->parent->left)
-			rol(root, node->parent);
+			redblack_tree_rol(t, node->parent);
 		else
-			ror(root, node->parent);
+			redblack_tree_ror(t, node->parent);
 	}
-	redblack_tree_remove_repair_case3(root, node);
+	redblack_tree_remove_repair_case3(t, node);
 }
 
-static inline void redblack_tree_remove_repair_case1(redblack_tree_node **root,
+static inline void redblack_tree_remove_repair_case1(redblack_tree *t,
 						     redblack_tree_node *node)
 {
 	if (node->parent)
-		redblack_tree_remove_repair_case2(root, node);
+		redblack_tree_remove_repair_case2(t, node);
+	else
+		redblack_tree_stat(t, remove_cases[0]);
 }
 
-static void redblack_tree_remove_node(redblack_tree *t,
-				      void *item,
-				      redblack_tree_node *node,
-				      int *removed)
+// Unlink node, found by a search, known to be an extreme or a tombstone
+// of relaxed mode, and free it.
+void redblack_tree_remove_found(redblack_tree *t, redblack_tree_node *node)
 {
-	int64_t res;
 	redblack_tree_node *child;
+	int dead = redblack_tree_is_tombstone(node);
+	int left = 0;
+	int wavl;
 
-	while (node) {
-		res = t->compare_items(item, node->item);
-		if (res < 0)
-			node = node->left;
-		else if (res > 0)
-			node = node->right;
-		else // found item
-			break;
-	}
-
-	if (!node) // item not found
-		return;
+	if (t->hash_item && !dead)
+		redblack_tree_hash_remove(t, node);
+	if (t->filter && !dead)
+		redblack_tree_filter_remove(t, node->item);
+	// node may survive holding the successor's item
+	redblack_tree_cache_forget(t, node);
 
 	if (is_internal(node)) {
 		redblack_tree_node *succ = successor(node);
-		node->item = succ->item;
+		if (t->hash_item && !redblack_tree_is_tombstone(succ))
+			redblack_tree_hash_move(t, succ, node);
+		redblack_tree_set_item(t, node, succ->item);
 		node->context = succ->context;
+		// so may a tombstone, and its entry for redblack_tree_rebalance,
+		// and the CLOCK bit of the item
+		node->flags = (node->flags & ~(RBT_NODE_TOMBSTONE | RBT_NODE_RECENT)) |
+			      (succ->flags & (RBT_NODE_TOMBSTONE | RBT_NODE_RECENT));
+		if (succ->flags & RBT_NODE_PENDING)
+			redblack_tree_relaxed_move(t, succ, node);
+		// the hand stays with the item it was about to look at
+		if (t->clock && t->clock->hand == succ)
+			t->clock->hand = node;
 		node = succ;
 	}
 
+	redblack_tree_track_remove(t, node);
+
 	child = !node->left ? node->right : node->left;
+	wavl = t->balance == RBT_BALANCE_WAVL;
 
-	if (node->color == RBT_BLACK) {
+	if (!wavl && node->color == RBT_BLACK && t->relaxed &&
+	    color(child) == RBT_RED) {
+		// relaxed mode only unlinks nodes needing no repair right away
+		child->color = RBT_BLACK;
+	} else if (!wavl && node->color == RBT_BLACK) {
 		node->color = color(child);
-		redblack_tree_remove_repair_case1(&t->root, node);
+		redblack_tree_probe(remove_repair, t, node);
+		redblack_tree_remove_repair_case1(t, node);
+		redblack_tree_probe(remove_repair_done, t, node);
 	}
 
-	if (!node->parent)
+	if (!node->parent) {
+		// a red child would otherwise become a red root
 		t->root = child;
-	else {
-		if (node == node->parent->left)
+		if (child && !wavl)
+			child->color = RBT_BLACK;
+	} else {
+		left = node == node->parent->left;
+		if (left)
 			node->parent->left = child;
 		else
 			node->parent->right = child;
@@ -169,15 +196,121 @@ static void redblack_tree_remove_node(redblack_tree *t,
 	if (child)
 		child->parent = node->parent;
 
-	t->free_node(node);
-	*removed = 1;
+	// a weak AVL tree repairs from the parent, once node is gone
+	if (wavl) {
+		redblack_tree_probe(remove_repair, t, node->parent);
+		redblack_tree_wavl_remove_repair(t, node->parent, left);
+		redblack_tree_probe(remove_repair_done, t, node->parent);
+	}
+
+	redblack_tree_augment_path(t, node->parent);
+
+	redblack_tree_release_node(t, node);
+	if (dead)
+		--t->tombstones;
+	else
+		--t->count;
+}
+
+int redblack_tree_remove_item(redblack_tree *t, void *item)
+{
+	redblack_tree_node *node = t->root;
+	int64_t res;
+	uint64_t depth = 0;
+
+	if (t->tombstone_percent)
+		return redblack_tree_remove_lazy(t, item);
+
+	redblack_tree_stat(t, removes);
+
+	while (node) {
+		++depth;
+		redblack_tree_stat(t, compares);
+		res = t->compare_items(item, node->item);
+		if (res < 0)
+			node = node->left;
+		else if (res > 0)
+			node = node->right;
+		else // found item
+			break;
+	}
+
+	redblack_tree_stat_depth(t, depth);
+
+	// item not found, or already left for redblack_tree_rebalance
+	if (!node || redblack_tree_is_tombstone(node))
+		return 0;
+
+	if (!redblack_tree_arena_change(t))
+		return 0;
+
+	if (!t->relaxed || !redblack_tree_relaxed_remove(t, node))
+		redblack_tree_remove_found(t, node);
+	return 1;
 }
 
 int redblack_tree_remove(redblack_tree *t, void *item)
 {
-	int removed = 0;
+	uint64_t start = redblack_tree_latency_start(t);
+	int removed;
+
+	redblack_tree_probe(remove, t, item);
+
+	// the buffer may hold an insert the filter hasn't seen
+	if (t->buffer)
+		removed = redblack_tree_buffer_remove(t, item);
+	else if (!redblack_tree_may_contain(t, item))
+		removed = 0;
+	else if (t->btree_key)
+		removed = redblack_btree_remove(t, item);
+	else
+		removed = redblack_tree_remove_item(t, item);
 
-	redblack_tree_remove_node(t, item, t->root, &removed);
+	if (t->trace)
+		redblack_tree_trace_record_op(t, RBT_TRACE_REMOVE, item, removed);
 
+	redblack_tree_latency_record(t, RBT_TRACE_REMOVE, start);
+	redblack_tree_probe(remove_done, t, removed);
 	return removed;
 }
+
+static int redblack_tree_pop(redblack_tree *t, void **item, int max)
+{
+	uint64_t start = redblack_tree_latency_start(t);
+	redblack_tree_node *node = max ? redblack_tree_max_node(t) :
+					 redblack_tree_min_node(t);
+
+	if (!node || !redblack_tree_arena_change(t))
+		return 0;
+
+	redblack_tree_probe(remove, t, node->item);
+
+	*item = node->item;
+
+	if (t->btree_key)
+		redblack_btree_remove(t, node->item);
+	else if (t->tombstone_percent)
+		redblack_tree_remove_lazy_node(t, node);
+	else {
+		redblack_tree_stat(t, removes);
+		if (!t->relaxed || !redblack_tree_relaxed_remove(t, node))
+			redblack_tree_remove_found(t, node);
+	}
+
+	if (t->trace)
+		redblack_tree_trace_record_op(t, RBT_TRACE_REMOVE, *item, 1);
+
+	redblack_tree_latency_record(t, RBT_TRACE_REMOVE, start);
+	redblack_tree_probe(remove_done, t, 1);
+	return 1;
+}
+
+int redblack_tree_pop_min(redblack_tree *t, void **item)
+{
+	return redblack_tree_pop(t, item, 0);
+}
+
+int redblack_tree_pop_max(redblack_tree *t, void **item)
+{
+	return redblack_tree_pop(t, item, 1);
+}
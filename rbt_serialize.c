@@ -0,0 +1,483 @@
+/*
+** rbt_serialize.c : implementation of Red-Black Tree save and load
+** Copyright (C) 2018  Tim Whisonant
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#include "rbt.h"
+#include "rbt_util.h"
+
+/*
+** Stream layout (integers are little-endian):
+**
+**   'R' 'B' 'T' version flags count:u64 record[count]
+**
+** RBT_SAVE_IN_ORDER  record: item
+** RBT_SAVE_PRE_ORDER record: shape:u8 item
+**   shape bit 0: red, bit 1: has left child, bit 2: has right child
+**
+** A pre-order save of an RBT_BALANCE_WAVL tree sets RBT_SAVE_RANKS in
+** flags, and shape bit 0 is the parity of the rank instead: rank
+** differences being 1 or 2, the rank of a node is one or two above the
+** highest of its children, whichever has that parity.
+**
+** With RBT_SAVE_DELTA an item is the zigzag varint of its key minus
+** the key of the previous record, otherwise it is whatever save_item
+** wrote.
+*/
+#define RBT_SAVE_VERSION 1
+
+#define RBT_SAVE_RANKS  0x80
+
+#define RBT_SHAPE_RED   0x1
+#define RBT_SHAPE_LEFT  0x2
+#define RBT_SHAPE_RIGHT 0x4
+
+typedef struct _redblack_tree_serializer {
+	redblack_tree *t;
+	redblack_tree_stream *s;
+	const redblack_tree_codec *codec;
+	int flags;
+	int64_t last_key;
+	uint64_t loaded;
+	int failed;
+} redblack_tree_serializer;
+
+static int redblack_tree_write_varint(redblack_tree_stream *s, uint64_t v)
+{
+	uint8_t buf[10];
+	size_t len = 0;
+
+	do {
+		buf[len] = v & 0x7f;
+		v >>= 7;
+		if (v)
+			buf[len] |= 0x80;
+		++len;
+	} while (v);
+
+	return s->write(s->context, buf, len);
+}
+
+static int redblack_tree_read_varint(redblack_tree_stream *s, uint64_t *v)
+{
+	uint8_t b;
+	int shift;
+
+	*v = 0;
+
+	for (shift = 0 ; shift < 64 ; shift += 7) {
+		if (!s->read(s->context, &b, 1))
+			return 0;
+		*v |= (uint64_t) (b & 0x7f) << shift;
+		if (!(b & 0x80))
+			return 1;
+	}
+
+	return 0; // overlong
+}
+
+static int redblack_tree_save_item(redblack_tree_serializer *z, void *item)
+{
+	int64_t key;
+	uint64_t delta;
+
+	if (!(z->flags & RBT_SAVE_DELTA))
+		return z->codec->save_item(z->s, item);
+
+	key = z->codec->item_key(item);
+	delta = (uint64_t) key - (uint64_t) z->last_key;
+	z->last_key = key;
+
+	return redblack_tree_write_varint(z->s,
+			redblack_tree_zigzag((int64_t) delta));
+}
+
+static int redblack_tree_load_item(redblack_tree_serializer *z, void **item)
+{
+	uint64_t zigzag;
+
+	if (!(z->flags & RBT_SAVE_DELTA))
+		return z->codec->load_item(z->s, item);
+
+	if (!redblack_tree_read_varint(z->s, &zigzag))
+		return 0;
+
+	z->last_key = (int64_t) ((uint64_t) z->last_key +
+				 (uint64_t) redblack_tree_unzigzag(zigzag));
+	*item = z->codec->key_item(z->last_key);
+	return 1;
+}
+
+static int redblack_tree_save_node(redblack_tree_serializer *z,
+				   redblack_tree_node *node)
+{
+	uint8_t shape;
+
+	if (!node)
+		return 1;
+
+	if (z->flags & RBT_SAVE_PRE_ORDER) {
+		shape = 0;
+		if ((z->flags & RBT_SAVE_RANKS) ? (node->color & 1) :
+						   node->color == RBT_RED)
+			shape |= RBT_SHAPE_RED;
+		if (node->left)
+			shape |= RBT_SHAPE_LEFT;
+		if (node->right)
+			shape |= RBT_SHAPE_RIGHT;
+
+		return z->s->write(z->s->context, &shape, 1) &&
+		       redblack_tree_save_item(z, node->item) &&
+		       redblack_tree_save_node(z, node->left) &&
+		       redblack_tree_save_node(z, node->right);
+	}
+
+	return redblack_tree_save_node(z, node->left) &&
+	       redblack_tree_save_item(z, node->item) &&
+	       redblack_tree_save_node(z, node->right);
+}
+
+// B+-tree backend: items come from the in-order traversal
+static void redblack_tree_save_visitor(redblack_tree_node *node, void *context)
+{
+	redblack_tree_serializer *z = (redblack_tree_serializer *) context;
+
+	if (!z->failed && !redblack_tree_save_item(z, node->item))
+		z->failed = 1;
+}
+
+int redblack_tree_save(redblack_tree *t,
+		       redblack_tree_stream *s,
+		       const redblack_tree_codec *codec,
+		       int flags)
+{
+	redblack_tree_serializer z;
+	uint8_t header[13];
+	uint64_t count;
+	int i;
+
+	if ((flags & RBT_SAVE_DELTA) && !codec->item_key)
+		return 0;
+	if (!(flags & RBT_SAVE_DELTA) && !codec->save_item)
+		return 0;
+	if ((flags & RBT_SAVE_PRE_ORDER) && t->btree_key)
+		return 0;
+
+	// the saved shape must not include pending writes or tombstones
+	redblack_tree_compact(t);
+
+	if ((flags & RBT_SAVE_PRE_ORDER) && t->balance == RBT_BALANCE_WAVL)
+		flags |= RBT_SAVE_RANKS;
+
+	count = redblack_tree_num_items(t);
+
+	header[0] = 'R';
+	header[1] = 'B';
+	header[2] = 'T';
+	header[3] = RBT_SAVE_VERSION;
+	header[4] = (uint8_t) flags;
+	for (i = 0 ; i < 8 ; ++i)
+		header[5 + i] = (uint8_t) (count >> (8 * i));
+
+	if (!s->write(s->context, header, sizeof(header)))
+		return 0;
+
+	z.t = t;
+	z.s = s;
+	z.codec = codec;
+	z.flags = flags;
+	z.last_key = 0;
+	z.failed = 0;
+
+	if (t->btree_key) {
+		redblack_tree_in_order(t, redblack_tree_save_visitor, &z);
+		return !z.failed;
+	}
+
+	return redblack_tree_save_node(&z, t->root);
+}
+
+// undo a failed load: the items go back to the codec with the nodes
+static void redblack_tree_free_subtree(redblack_tree *t,
+				       const redblack_tree_codec *codec,
+				       redblack_tree_node *node)
+{
+	if (!node)
+		return;
+
+	redblack_tree_free_subtree(t, codec, node->left);
+	redblack_tree_free_subtree(t, codec, node->right);
+
+	// arena nodes hold copies, released as they were loaded
+	if (!t->arena)
+		redblack_tree_codec_release(codec, node->item);
+	redblack_tree_release_node(t, node);
+}
+
+// B+-tree backend: the leaves hand out their nodes in key order
+static void redblack_tree_release_visitor(redblack_tree_node *node, void *context)
+{
+	redblack_tree_codec_release((const redblack_tree_codec *) context,
+				    node->item);
+}
+
+static int redblack_tree_build_node(redblack_tree *t,
+				    uint64_t n,
+				    uint32_t depth,
+				    uint32_t red_depth,
+				    redblack_tree_node * (*next)(void *context),
+				    void *context,
+				    redblack_tree_node **root)
+{
+	redblack_tree_node *left = NULL;
+	redblack_tree_node *right = NULL;
+	redblack_tree_node *node;
+	uint64_t num_left;
+
+	*root = NULL;
+
+	if (!n)
+		return 1;
+
+	num_left = (n - 1) / 2;
+
+	if (!redblack_tree_build_node(t, num_left, depth + 1, red_depth,
+				      next, context, &left)) {
+		*root = left;
+		return 0;
+	}
+
+	node = next(context);
+	if (!node) {
+		*root = left;
+		return 0;
+	}
+
+	node->parent = NULL;
+	node->left = left;
+	if (left)
+		left->parent = node;
+
+	if (!redblack_tree_build_node(t, n - 1 - num_left, depth + 1, red_depth,
+				      next, context, &right)) {
+		node->right = right;
+		*root = node;
+		return 0;
+	}
+
+	node->right = right;
+	if (right)
+		right->parent = node;
+
+	// balanced by construction, so the height is a valid weak AVL rank
+	if (t->balance == RBT_BALANCE_WAVL)
+		node->color = 1 + redblack_tree_max(redblack_tree_rank(left),
+						    redblack_tree_rank(right));
+	else
+		node->color = (depth && depth == red_depth) ? RBT_RED : RBT_BLACK;
+	redblack_tree_augment_node(t, node);
+
+	*root = node;
+	return 1;
+}
+
+/*
+** Splitting each range in half leaves every NULL link at depth
+** floor(log2(n)) or below. Coloring only the nodes at that depth red
+** puts the same number of black nodes on every path.
+*/
+int redblack_tree_build_balanced(redblack_tree *t,
+				 uint64_t n,
+				 redblack_tree_node * (*next)(void *context),
+				 void *context,
+				 redblack_tree_node **root)
+{
+	uint32_t red_depth = 0;
+
+	while (n >> (red_depth + 1))
+		++red_depth;
+
+	return redblack_tree_build_node(t, n, 0, red_depth, next, context, root);
+}
+
+static redblack_tree_node * redblack_tree_load_next(void *context)
+{
+	redblack_tree_serializer *z = (redblack_tree_serializer *) context;
+	redblack_tree_node *node;
+	void *item;
+
+	if (!redblack_tree_load_item(z, &item))
+		return NULL;
+
+	node = redblack_tree_alloc_node(z->t, item);
+	// an arena node took a copy of item
+	if (!node || z->t->arena)
+		redblack_tree_codec_release(z->codec, item);
+	if (node) {
+		node->left = node->right = NULL;
+		++z->loaded;
+	}
+
+	return node;
+}
+
+static int redblack_tree_load_node(redblack_tree_serializer *z,
+				   redblack_tree_node **root)
+{
+	redblack_tree_node *node;
+	uint8_t shape;
+
+	*root = NULL;
+
+	if (!z->s->read(z->s->context, &shape, 1))
+		return 0;
+
+	node = redblack_tree_load_next(z);
+	if (!node)
+		return 0;
+
+	node->parent = NULL;
+
+	if ((shape & RBT_SHAPE_LEFT) &&
+	    !redblack_tree_load_node(z, &node->left)) {
+		redblack_tree_free_subtree(z->t, z->codec, node);
+		return 0;
+	}
+
+	if ((shape & RBT_SHAPE_RIGHT) &&
+	    !redblack_tree_load_node(z, &node->right)) {
+		redblack_tree_free_subtree(z->t, z->codec, node);
+		return 0;
+	}
+
+	if (node->left)
+		node->left->parent = node;
+	if (node->right)
+		node->right->parent = node;
+
+	if (z->flags & RBT_SAVE_RANKS) {
+		node->color = 1 + redblack_tree_max(redblack_tree_rank(node->left),
+						    redblack_tree_rank(node->right));
+		if ((node->color & 1) != !!(shape & RBT_SHAPE_RED))
+			++node->color;
+	} else
+		node->color = (shape & RBT_SHAPE_RED) ? RBT_RED : RBT_BLACK;
+
+	redblack_tree_augment_node(z->t, node);
+
+	*root = node;
+	return 1;
+}
+
+int redblack_tree_load(redblack_tree *t,
+		       redblack_tree_stream *s,
+		       const redblack_tree_codec *codec)
+{
+	redblack_tree_serializer z;
+	redblack_tree_node *root = NULL;
+	uint8_t header[13];
+	uint64_t count = 0;
+	int res;
+	int i;
+
+	// merge pending writes, an empty tree may still hold tombstones
+	redblack_tree_compact(t);
+
+	if (t->count)
+		return 0;
+
+	if (!s->read(s->context, header, sizeof(header)))
+		return 0;
+
+	if (header[0] != 'R' || header[1] != 'B' || header[2] != 'T' ||
+	    header[3] != RBT_SAVE_VERSION)
+		return 0;
+
+	for (i = 0 ; i < 8 ; ++i)
+		count |= (uint64_t) header[5 + i] << (8 * i);
+
+	z.t = t;
+	z.s = s;
+	z.codec = codec;
+	z.flags = header[4];
+	z.last_key = 0;
+	z.loaded = 0;
+
+	if ((z.flags & RBT_SAVE_DELTA) && !codec->key_item)
+		return 0;
+	if (!(z.flags & RBT_SAVE_DELTA) && !codec->load_item)
+		return 0;
+
+	if (t->btree_key) {
+		void *item;
+
+		if (z.flags & RBT_SAVE_PRE_ORDER)
+			return 0;
+
+		for ( ; z.loaded < count ; ++z.loaded) {
+			if (!redblack_tree_load_item(&z, &item))
+				break;
+			if (!redblack_btree_insert(t, item)) {
+				redblack_tree_codec_release(codec, item);
+				break;
+			}
+		}
+
+		if (z.loaded < count) {
+			// free what was loaded, keeping the configuration
+			redblack_tree_in_order(t, redblack_tree_release_visitor,
+					       (void *) codec);
+			redblack_btree_destroy(t);
+			t->count = 0;
+			redblack_tree_hash_rebuild(t);
+			redblack_tree_filter_rebuild(t);
+			return 0;
+		}
+
+		redblack_tree_hash_rebuild(t);
+		redblack_tree_filter_rebuild(t);
+		return 1;
+	}
+
+	// ranks only make sense to a weak AVL tree, and colors to the others
+	if ((z.flags & RBT_SAVE_PRE_ORDER) &&
+	    !(z.flags & RBT_SAVE_RANKS) != (t->balance != RBT_BALANCE_WAVL))
+		return 0;
+
+	if (z.flags & RBT_SAVE_PRE_ORDER)
+		res = !count || redblack_tree_load_node(&z, &root);
+	else
+		res = redblack_tree_build_balanced(t, count,
+						   redblack_tree_load_next, &z,
+						   &root);
+
+	// the shape bytes must agree with the count in the header
+	if (!res || z.loaded != count) {
+		redblack_tree_free_subtree(t, codec, root);
+		return 0;
+	}
+
+	t->root = root;
+	t->count = z.loaded;
+	redblack_tree_track_rebuild(t);
+	redblack_tree_hash_rebuild(t);
+	redblack_tree_filter_rebuild(t);
+
+	// a bounded tree keeps to its capacity, whatever the image holds
+	if (t->clock && t->count > t->clock->capacity)
+		redblack_tree_clock_evict(t);
+	return 1;
+}
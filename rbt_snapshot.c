@@ -0,0 +1,228 @@
+/*
+** rbt_snapshot.c : background snapshots of Red-Black Trees
+** Copyright (C) 2018  Tim Whisonant
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "rbt.h"
+#include "rbt_util.h"
+
+/*
+** The child shares every page of the tree with the parent until one of
+** them writes it, so the parent only pays for the fork (copying the page
+** tables) and then for one page copy per page its writers touch while
+** the child is saving. The library may run threads of its own, so the
+** child of a threaded parent may only make async-signal-safe calls: the
+** parent compacts the tree, allocates the buffer and creates the file,
+** leaving the child the walk over the tree and plain system calls.
+*/
+#define RBT_SNAPSHOT_BUFFER 65536
+
+typedef struct _redblack_tree_snapshot_file {
+	int fd;
+	int dir_fd; // directory of path, synced once the rename is made
+	size_t len;
+	uint8_t buf[RBT_SNAPSHOT_BUFFER];
+} redblack_tree_snapshot_file;
+
+static int redblack_tree_snapshot_put(int fd, const uint8_t *buf, size_t len)
+{
+	ssize_t res;
+
+	while (len) {
+		res = write(fd, buf, len);
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			return 0;
+		}
+		buf += res;
+		len -= res;
+	}
+
+	return 1;
+}
+
+static int redblack_tree_snapshot_flush(redblack_tree_snapshot_file *f)
+{
+	size_t len = f->len;
+
+	f->len = 0;
+	return redblack_tree_snapshot_put(f->fd, f->buf, len);
+}
+
+// stream handed to redblack_tree_save in the child
+static int redblack_tree_snapshot_write(void *context, const void *buf, size_t len)
+{
+	redblack_tree_snapshot_file *f = (redblack_tree_snapshot_file *) context;
+
+	if (f->len + len > sizeof(f->buf) && !redblack_tree_snapshot_flush(f))
+		return 0;
+
+	if (len > sizeof(f->buf))
+		return redblack_tree_snapshot_put(f->fd, (const uint8_t *) buf, len);
+
+	memcpy(f->buf + f->len, buf, len);
+	f->len += len;
+	return 1;
+}
+
+// open the directory holding path, using buf for its name
+static int redblack_tree_snapshot_open_dir(const char *path, char *buf)
+{
+	char *slash;
+
+	strcpy(buf, path);
+	slash = strrchr(buf, '/');
+	if (!slash)
+		strcpy(buf, ".");
+	else if (slash == buf)
+		buf[1] = 0;
+	else
+		*slash = 0;
+
+	return open(buf, O_RDONLY | O_DIRECTORY);
+}
+
+static void redblack_tree_snapshot_child(redblack_tree *t,
+					 const char *path,
+					 const char *tmp,
+					 redblack_tree_snapshot_file *f,
+					 const redblack_tree_codec *codec,
+					 int flags)
+{
+	redblack_tree_stream s;
+	int ok;
+
+	s.write = redblack_tree_snapshot_write;
+	s.read = NULL;
+	s.context = f;
+
+	ok = redblack_tree_save(t, &s, codec, flags) &&
+	     redblack_tree_snapshot_flush(f) &&
+	     !fsync(f->fd);
+	ok = !close(f->fd) && ok;
+	ok = ok && !rename(tmp, path);
+	if (!ok)
+		unlink(tmp);
+	// else a crash could still lose the rename
+	ok = ok && !fsync(f->dir_fd);
+
+	// _exit, not exit: the parent's stdio buffers and atexit handlers
+	// are not the child's to run
+	_exit(!ok);
+}
+
+int redblack_tree_snapshot_async(redblack_tree_snapshot *snap,
+				 redblack_tree *t,
+				 const char *path,
+				 const redblack_tree_codec *codec,
+				 int flags)
+{
+	static uint32_t serial;
+	redblack_tree_snapshot_file *f;
+	char *tmp;
+
+	snap->pid = 0;
+	snap->result = 0;
+
+	if (t->arena)
+		return 0;
+
+	// left to the child, redblack_tree_save could free tombstones
+	redblack_tree_compact(t);
+
+	f = (redblack_tree_snapshot_file *) malloc(sizeof(redblack_tree_snapshot_file));
+	// "<path>.<pid>.<serial>.tmp", unique among concurrent snapshots
+	tmp = (char *) malloc(strlen(path) + 2 * 11 + sizeof("...tmp"));
+	if (!f || !tmp)
+		goto out_free;
+
+	f->dir_fd = redblack_tree_snapshot_open_dir(path, tmp);
+	if (f->dir_fd < 0)
+		goto out_free;
+
+	sprintf(tmp, "%s.%ld.%u.tmp", path, (long) getpid(),
+		__atomic_fetch_add(&serial, 1, __ATOMIC_RELAXED));
+
+	f->len = 0;
+	f->fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (f->fd < 0) {
+		close(f->dir_fd);
+		goto out_free;
+	}
+
+	snap->pid = fork();
+	if (!snap->pid)
+		redblack_tree_snapshot_child(t, path, tmp, f, codec, flags);
+
+	close(f->fd);
+	close(f->dir_fd);
+
+	if (snap->pid < 0) {
+		snap->pid = 0;
+		unlink(tmp);
+		goto out_free;
+	}
+
+	free(f);
+	free(tmp);
+	return 1;
+
+out_free:
+	free(f);
+	free(tmp);
+	return 0;
+}
+
+// reap the child, without blocking unless block; 1 once it was reaped
+static int redblack_tree_snapshot_reap(redblack_tree_snapshot *snap, int block)
+{
+	pid_t res;
+	int status;
+
+	if (!snap->pid)
+		return 1;
+
+	do
+		res = waitpid(snap->pid, &status, block ? 0 : WNOHANG);
+	while (res < 0 && errno == EINTR);
+
+	if (!res)
+		return 0;
+
+	snap->result = res == snap->pid &&
+		       WIFEXITED(status) && !WEXITSTATUS(status);
+	snap->pid = 0;
+	return 1;
+}
+
+int redblack_tree_snapshot_done(redblack_tree_snapshot *snap)
+{
+	return redblack_tree_snapshot_reap(snap, 0);
+}
+
+int redblack_tree_snapshot_wait(redblack_tree_snapshot *snap)
+{
+	redblack_tree_snapshot_reap(snap, 1);
+	return snap->result;
+}
@@ -0,0 +1,179 @@
+/*
+** rbt_tombstone.c : lazy removal for Red-Black Trees
+** Copyright (C) 2018  Tim Whisonant
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#include "rbt.h"
+#include "rbt_util.h"
+
+/*
+** A tombstone keeps its place in the tree, so the tree stays a valid
+** red-black tree and nothing needs repair until compaction.
+*/
+int redblack_tree_remove_lazy(redblack_tree *t, void *item)
+{
+	redblack_tree_node *node = t->root;
+	int64_t res;
+	uint64_t depth = 0;
+
+	redblack_tree_stat(t, removes);
+
+	while (node) {
+		++depth;
+		redblack_tree_stat(t, compares);
+		res = t->compare_items(item, node->item);
+		if (res < 0)
+			node = node->left;
+		else if (res > 0)
+			node = node->right;
+		else // found item
+			break;
+	}
+
+	redblack_tree_stat_depth(t, depth);
+
+	if (!node || redblack_tree_is_tombstone(node) ||
+	    !redblack_tree_arena_change(t))
+		return 0;
+
+	redblack_tree_remove_lazy_node(t, node);
+	return 1;
+}
+
+void redblack_tree_bury(redblack_tree *t, redblack_tree_node *node)
+{
+	if (t->hash_item)
+		redblack_tree_hash_remove(t, node);
+	if (t->filter)
+		redblack_tree_filter_remove(t, node->item);
+
+	node->flags |= RBT_NODE_TOMBSTONE;
+	redblack_tree_augment_path(t, node);
+	--t->count;
+	++t->tombstones;
+}
+
+void redblack_tree_remove_lazy_node(redblack_tree *t, redblack_tree_node *node)
+{
+	redblack_tree_bury(t, node);
+
+	if (t->tombstones * 100 > (uint64_t) t->tombstone_percent * (t->count + t->tombstones))
+		redblack_tree_compact(t);
+}
+
+void redblack_tree_revive(redblack_tree *t, redblack_tree_node *node, void *item)
+{
+	redblack_tree_set_item(t, node, item);
+	node->flags &= ~RBT_NODE_TOMBSTONE;
+	if (node->flags & RBT_NODE_PENDING)
+		redblack_tree_relaxed_revive(t, node);
+	redblack_tree_augment_path(t, node);
+	--t->tombstones;
+
+	if (t->hash_item)
+		redblack_tree_hash_insert(t, node);
+	if (t->filter)
+		redblack_tree_filter_add(t, node->item);
+	if (t->clock)
+		node->flags |= RBT_NODE_RECENT;
+	++t->count;
+}
+
+typedef struct _redblack_tree_compactor {
+	redblack_tree_node *head;
+} redblack_tree_compactor;
+
+static redblack_tree_node * redblack_tree_compact_next(void *context)
+{
+	redblack_tree_compactor *c = (redblack_tree_compactor *) context;
+	redblack_tree_node *node = c->head;
+
+	c->head = node->right;
+	node->right = NULL;
+	return node;
+}
+
+/*
+** An in-order walk with an explicit stack reads the links of a node for
+** the last time when it is popped, so from then on its right link can
+** thread the list of live nodes, which is rebuilt as a balanced tree.
+** A red-black tree is at most 2 * log2(n + 1) deep.
+*/
+void redblack_tree_compact(redblack_tree *t)
+{
+	redblack_tree_node *stack[128];
+	redblack_tree_node *node;
+	redblack_tree_node *right;
+	redblack_tree_node **tail;
+	redblack_tree_compactor c;
+	int top = 0;
+
+	redblack_tree_flush(t);
+	// unlinks the tombstones of a relaxed tree one by one instead
+	redblack_tree_rebalance(t, 0);
+
+	// an arena file that can't be marked keeps its tombstones
+	if (!t->tombstones || !redblack_tree_arena_change(t))
+		return;
+
+	node = t->root;
+	c.head = NULL;
+	tail = &c.head;
+
+	for (;;) {
+		while (node) {
+			redblack_tree_assert(top < 128);
+			stack[top++] = node;
+			node = node->left;
+		}
+
+		if (!top)
+			break;
+
+		node = stack[--top];
+		right = node->right;
+
+		if (redblack_tree_is_tombstone(node)) {
+			redblack_tree_release_node(t, node);
+		} else {
+			*tail = node;
+			tail = &node->right;
+		}
+
+		node = right;
+	}
+	*tail = NULL;
+
+	t->tombstones = 0;
+	redblack_tree_build_balanced(t, t->count, redblack_tree_compact_next,
+				     &c, &t->root);
+	redblack_tree_track_rebuild(t);
+}
+
+int redblack_tree_set_lazy_remove(redblack_tree *t, uint32_t max_percent)
+{
+	if (t->btree_key || t->relaxed)
+		return 0;
+
+	if (max_percent > 100)
+		max_percent = 100;
+
+	if (!max_percent)
+		redblack_tree_compact(t);
+
+	t->tombstone_percent = max_percent;
+	return 1;
+}
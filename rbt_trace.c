@@ -0,0 +1,231 @@
+/*
+** rbt_trace.c : implementation of Red-Black Tree operation traces
+** Copyright (C) 2018  Tim Whisonant
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rbt.h"
+#include "rbt_util.h"
+
+/*
+** Trace file:
+**
+**   'R' 'B' 'T' 'R' version record...
+**
+** record: op:u8 delta_ns:varint key:varint
+**   op bits 0-6 are the redblack_tree_trace_op, bit 7 the result.
+**   delta_ns is the time since the previous record and key is zigzag
+**   encoded.
+*/
+#define RBT_TRACE_VERSION 1
+#define RBT_TRACE_RESULT 0x80
+
+// op, and two varints of at most 10 bytes
+#define RBT_TRACE_MAX_RECORD 21
+
+static int redblack_tree_trace_flush(redblack_tree_trace *trace)
+{
+	size_t done = 0;
+	ssize_t res;
+
+	while (done < trace->len) {
+		res = write(trace->fd, trace->buf + done, trace->len - done);
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			trace->error = 1;
+			break;
+		}
+		done += res;
+	}
+
+	trace->len = 0;
+	return !trace->error;
+}
+
+static void redblack_tree_trace_put_varint(redblack_tree_trace *trace,
+					   uint64_t v)
+{
+	do {
+		trace->buf[trace->len] = v & 0x7f;
+		v >>= 7;
+		if (v)
+			trace->buf[trace->len] |= 0x80;
+		++trace->len;
+	} while (v);
+}
+
+void redblack_tree_trace_record_op(redblack_tree *t,
+				   redblack_tree_trace_op op,
+				   void *item,
+				   int result)
+{
+	redblack_tree_trace *trace = t->trace;
+	uint64_t now = redblack_tree_now_ns();
+
+	if (trace->len + RBT_TRACE_MAX_RECORD > sizeof(trace->buf))
+		redblack_tree_trace_flush(trace);
+
+	trace->buf[trace->len++] = (uint8_t) op | (result ? RBT_TRACE_RESULT : 0);
+	redblack_tree_trace_put_varint(trace, now - trace->last_ns);
+	redblack_tree_trace_put_varint(trace,
+			redblack_tree_zigzag(trace->item_key(item)));
+
+	trace->last_ns = now;
+}
+
+int redblack_tree_trace_start(redblack_tree *t,
+			      redblack_tree_trace *trace,
+			      const char *path,
+			      int64_t (*item_key)(void *item))
+{
+	trace->error = 0;
+	trace->item_key = item_key;
+	trace->len = 0;
+	trace->pos = 0;
+
+	trace->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (trace->fd < 0)
+		return 0;
+
+	memcpy(trace->buf, "RBTR", 4);
+	trace->buf[4] = RBT_TRACE_VERSION;
+	trace->len = 5;
+
+	trace->start_ns = trace->last_ns = redblack_tree_now_ns();
+	t->trace = trace;
+	return 1;
+}
+
+int redblack_tree_trace_stop(redblack_tree *t)
+{
+	redblack_tree_trace *trace = t->trace;
+	int res;
+
+	if (!trace)
+		return 0;
+
+	t->trace = NULL;
+
+	res = redblack_tree_trace_flush(trace);
+	if (close(trace->fd))
+		res = 0;
+	trace->fd = -1;
+
+	return res;
+}
+
+// 0 at the end of the file
+static int redblack_tree_trace_get(redblack_tree_trace *trace, uint8_t *b)
+{
+	ssize_t res;
+
+	if (trace->pos == trace->len) {
+		do {
+			res = read(trace->fd, trace->buf, sizeof(trace->buf));
+		} while (res < 0 && errno == EINTR);
+
+		if (res <= 0) {
+			if (res < 0)
+				trace->error = 1;
+			return 0;
+		}
+
+		trace->len = res;
+		trace->pos = 0;
+	}
+
+	*b = trace->buf[trace->pos++];
+	return 1;
+}
+
+static int redblack_tree_trace_get_varint(redblack_tree_trace *trace,
+					  uint64_t *v)
+{
+	uint8_t b;
+	int shift;
+
+	*v = 0;
+
+	for (shift = 0 ; shift < 64 ; shift += 7) {
+		if (!redblack_tree_trace_get(trace, &b))
+			return 0;
+		*v |= (uint64_t) (b & 0x7f) << shift;
+		if (!(b & 0x80))
+			return 1;
+	}
+
+	return 0;
+}
+
+int redblack_tree_trace_open(redblack_tree_trace *trace, const char *path)
+{
+	uint8_t header[5];
+	int i;
+
+	trace->error = 0;
+	trace->item_key = NULL;
+	trace->start_ns = trace->last_ns = 0;
+	trace->len = trace->pos = 0;
+
+	trace->fd = open(path, O_RDONLY);
+	if (trace->fd < 0)
+		return 0;
+
+	for (i = 0 ; i < 5 ; ++i)
+		if (!redblack_tree_trace_get(trace, &header[i]))
+			break;
+
+	if (i < 5 || memcmp(header, "RBTR", 4) || header[4] != RBT_TRACE_VERSION) {
+		redblack_tree_trace_close(trace);
+		return 0;
+	}
+
+	return 1;
+}
+
+int redblack_tree_trace_next(redblack_tree_trace *trace,
+			     redblack_tree_trace_record *record)
+{
+	uint64_t delta;
+	uint64_t key;
+	uint8_t op;
+
+	if (!redblack_tree_trace_get(trace, &op) ||
+	    !redblack_tree_trace_get_varint(trace, &delta) ||
+	    !redblack_tree_trace_get_varint(trace, &key))
+		return 0;
+
+	trace->last_ns += delta;
+
+	record->op = op & ~RBT_TRACE_RESULT;
+	record->result = (op & RBT_TRACE_RESULT) ? 1 : 0;
+	record->key = redblack_tree_unzigzag(key);
+	record->time_ns = trace->last_ns;
+	return 1;
+}
+
+void redblack_tree_trace_close(redblack_tree_trace *trace)
+{
+	if (trace->fd >= 0)
+		close(trace->fd);
+	trace->fd = -1;
+}
@@ -19,6 +19,8 @@
 #ifndef __RBT_UTIL_H__
 #define __RBT_UTIL_H__
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 
 #if 1
 #define redblack_tree_assert(__expr)
@@ -33,6 +35,70 @@ do                                                                           \
 }while(0)
 #endif
 
+#ifdef RBT_STATS
+#define redblack_tree_stat(__t, __field) (++(__t)->stats.__field)
+#define redblack_tree_stat_depth(__t, __depth)                  \
+do                                                              \
+{                                                               \
+	(__t)->stats.descent_depth += (__depth);                \
+	if ((__depth) > (__t)->stats.max_depth)                 \
+		(__t)->stats.max_depth = (__depth);             \
+}while(0)
+#else
+#define redblack_tree_stat(__t, __field)
+#define redblack_tree_stat_depth(__t, __depth) ((void) (__depth))
+#endif // RBT_STATS
+
+/*
+** Static probes at the entry and exit of insert, remove, find, the
+** repairs and node allocation, compiled in with RBT_PROBES. Where
+** <sys/sdt.h> exists they are USDT probes of provider rbt, e.g.
+**     bpftrace -e 'usdt:./librbt.so:rbt:insert_repair { @[ustack] = count(); }'
+** otherwise each calls redblack_tree_probe_hook(), whose symbol uprobes
+** can attach to, with the probe name as first argument.
+*/
+#ifdef RBT_PROBES
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define redblack_tree_probe(__name, __t, __arg) \
+	STAP_PROBE2(rbt, __name, __t, __arg)
+#else
+void redblack_tree_probe_hook(const char *name, void *t, uint64_t arg);
+#define redblack_tree_probe(__name, __t, __arg) \
+	redblack_tree_probe_hook(#__name, (__t), (uint64_t) (__arg))
+#endif
+#else
+#define redblack_tree_probe(__name, __t, __arg) do { } while (0)
+#endif // RBT_PROBES
+
+static inline uint64_t redblack_tree_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// 0 unless t keeps latency histograms
+static inline uint64_t redblack_tree_latency_start(redblack_tree *t)
+{
+	return t->latency ? redblack_tree_now_ns() : 0;
+}
+
+static inline void redblack_tree_latency_record(redblack_tree *t,
+						redblack_tree_trace_op op,
+						uint64_t start)
+{
+	uint64_t ns;
+
+	if (!t->latency)
+		return;
+
+	ns = redblack_tree_now_ns() - start;
+	__atomic_fetch_add(&t->latency->counts[op - 1][ns ? 63 - __builtin_clzll(ns) : 0],
+			   1, __ATOMIC_RELAXED);
+}
+
 #define redblack_tree_max(__a, __b) \
 ({                                  \
 	typeof(__a) ___a = __a;     \
@@ -54,6 +120,14 @@ static inline redblack_tree_color color(redblack_tree_node *n)
 	return n->color;
 }
 
+// RBT_BALANCE_WAVL
+static inline int redblack_tree_rank(redblack_tree_node *n)
+{
+	if (!n)
+		return -1;
+	return n->color;
+}
+
 static inline redblack_tree_node * parent(redblack_tree_node *n)
 {
 	if (!n)
@@ -166,6 +240,234 @@ static inline redblack_tree_node * ror(redblack_tree_node **root,
 	return nnew;
 }
 
+// n was removed lazily and only keeps its place in the tree
+#define redblack_tree_is_tombstone(n) ((n)->flags & RBT_NODE_TOMBSTONE)
+
+// a tombstone contributes nothing to the aggregates
+static inline int64_t redblack_tree_node_value(redblack_tree *t,
+					       redblack_tree_node *n)
+{
+	if (redblack_tree_is_tombstone(n))
+		return t->aggregate.identity;
+	return t->aggregate.value(n->item);
+}
+
+/*
+** Recompute the aggregate of n from its item and its children.
+*/
+static inline void redblack_tree_augment_node(redblack_tree *t,
+					      redblack_tree_node *n)
+{
+	int64_t agg;
+
+	if (!t->aggregate.combine || !n)
+		return;
+
+	agg = redblack_tree_node_value(t, n);
+	if (n->left)
+		agg = t->aggregate.combine(n->left->aggregate, agg);
+	if (n->right)
+		agg = t->aggregate.combine(agg, n->right->aggregate);
+	n->aggregate = agg;
+}
+
+static inline void redblack_tree_augment_path(redblack_tree *t,
+					      redblack_tree_node *n)
+{
+	if (!t->aggregate.combine)
+		return;
+
+	while (n) {
+		redblack_tree_augment_node(t, n);
+		n = n->parent;
+	}
+}
+
+/*
+** Rotations used by the repair paths. The subtree keeps its
+** set of items, so only n and its replacement need new aggregates.
+*/
+static inline redblack_tree_node * redblack_tree_rol(redblack_tree *t,
+						     redblack_tree_node *n)
+{
+	redblack_tree_node *nnew = rol(&t->root, n);
+
+	redblack_tree_stat(t, rotations);
+
+	redblack_tree_augment_node(t, n);
+	redblack_tree_augment_node(t, nnew);
+	return nnew;
+}
+
+static inline redblack_tree_node * redblack_tree_ror(redblack_tree *t,
+						     redblack_tree_node *n)
+{
+	redblack_tree_node *nnew = ror(&t->root, n);
+
+	redblack_tree_stat(t, rotations);
+
+	redblack_tree_augment_node(t, n);
+	redblack_tree_augment_node(t, nnew);
+	return nnew;
+}
+
+/*
+** rbt_arena.c : node slots in a mapped file, used when t->arena is set.
+*/
+redblack_tree_node * redblack_tree_arena_alloc(redblack_tree *t, void *item);
+void redblack_tree_arena_free(redblack_tree *t, redblack_tree_node *node);
+int redblack_tree_arena_mark_dirty(redblack_tree_arena *a);
+
+// call before changing the nodes of t in place; 0 if the file couldn't
+// be marked, and the change must not be made
+static inline int redblack_tree_arena_change(redblack_tree *t)
+{
+	return !t->arena || t->arena->dirty ||
+	       redblack_tree_arena_mark_dirty(t->arena);
+}
+
+/*
+** rbt_relaxed.c : record the repairs deferred when t->relaxed is set.
+** redblack_tree_relaxed_remove turns node into a tombstone instead of
+** unlinking it if that would need a repair, and tells so. Listed nodes
+** carry RBT_NODE_PENDING; their entries follow the state of from to
+** another node, or are dropped if to is NULL.
+*/
+void redblack_tree_relaxed_red(redblack_tree *t, redblack_tree_node *node);
+int redblack_tree_relaxed_remove(redblack_tree *t, redblack_tree_node *node);
+void redblack_tree_relaxed_move(redblack_tree *t,
+				redblack_tree_node *from,
+				redblack_tree_node *to);
+// node is no tombstone anymore
+void redblack_tree_relaxed_revive(redblack_tree *t, redblack_tree_node *node);
+void redblack_tree_relaxed_clear(redblack_tree *t);
+
+/*
+** rbt_filter.c : t->filter counts the live items, tombstones excluded,
+** and must be told of every item entering or leaving that set, or be
+** rebuilt after the tree was replaced wholesale.
+*/
+void redblack_tree_filter_add(redblack_tree *t, void *item);
+void redblack_tree_filter_remove(redblack_tree *t, void *item);
+void redblack_tree_filter_rebuild(redblack_tree *t);
+int redblack_tree_filter_test(redblack_tree_filter *f, void *item);
+
+/*
+** rbt_clock.c : evict nodes until t is back within t->clock->capacity.
+** The hand moves on like t->leftmost when its node is unlinked, and
+** starts over when its node is freed without being unlinked.
+*/
+void redblack_tree_clock_evict(redblack_tree *t);
+
+// 0 if item is certainly not in the tree
+static inline int redblack_tree_may_contain(redblack_tree *t, void *item)
+{
+	return !t->filter || redblack_tree_filter_test(t->filter, item);
+}
+
+/*
+** rbt_layout.c : nodes copied by redblack_tree_relayout go back to their
+** slab instead of free_node; redblack_tree_layout_free tells so.
+*/
+int redblack_tree_layout_free(redblack_tree *t, redblack_tree_node *node);
+void redblack_tree_layout_destroy(redblack_tree *t);
+// frees every slab of l, and l, whatever nodes they still hold
+void redblack_tree_layout_release(redblack_tree_layout *l);
+
+// arena nodes own a copy of their item, other nodes point at it
+static inline void redblack_tree_set_item(redblack_tree *t,
+					  redblack_tree_node *node,
+					  void *item)
+{
+	if (t->arena)
+		memcpy(node->item, item, t->arena->item_size);
+	else
+		node->item = item;
+}
+
+static inline redblack_tree_node * redblack_tree_alloc_node(redblack_tree *t,
+							    void *item)
+{
+	redblack_tree_node *node;
+
+	redblack_tree_probe(alloc, t, item);
+	node = t->arena ? redblack_tree_arena_alloc(t, item) :
+			  t->allocate_node(item);
+	redblack_tree_probe(alloc_done, t, node);
+
+	if (node) {
+		redblack_tree_stat(t, allocations);
+		node->flags = 0;
+	}
+	return node;
+}
+
+// finalizer from splitmix64, so that weak item hashes still spread
+static inline uint64_t redblack_tree_hash_mix(uint64_t h)
+{
+	h ^= h >> 30;
+	h *= 0xbf58476d1ce4e5b9ull;
+	h ^= h >> 27;
+	h *= 0x94d049bb133111ebull;
+	h ^= h >> 31;
+	return h;
+}
+
+/*
+** The hot-key cache maps the hash of an item to the node last found
+** for it. A slot is only trusted after comparing the items, but it must
+** never point at a freed node.
+*/
+static inline redblack_tree_node ** redblack_tree_cache_slot(redblack_tree *t,
+							     void *item)
+{
+	return t->cache + (redblack_tree_hash_mix(t->cache_hash(item)) & t->cache_mask);
+}
+
+static inline void redblack_tree_cache_forget(redblack_tree *t,
+					      redblack_tree_node *node)
+{
+	redblack_tree_node **slot;
+
+	if (!t->cache)
+		return;
+
+	slot = redblack_tree_cache_slot(t, node->item);
+	if (*slot == node)
+		*slot = NULL;
+}
+
+static inline void redblack_tree_release_node(redblack_tree *t,
+					      redblack_tree_node *node)
+{
+	redblack_tree_stat(t, frees);
+	redblack_tree_cache_forget(t, node);
+	if (t->clock && node == t->clock->hand)
+		t->clock->hand = NULL;
+	if (node->flags & RBT_NODE_PENDING)
+		redblack_tree_relaxed_move(t, node, NULL);
+	if (t->layout && redblack_tree_layout_free(t, node))
+		return;
+	if (t->arena)
+		redblack_tree_arena_free(t, node);
+	else
+		t->free_node(node);
+}
+
+/*
+** zigzag maps small negative and positive values to small unsigned
+** values, so that they varint-encode in few bytes.
+*/
+static inline uint64_t redblack_tree_zigzag(int64_t v)
+{
+	return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
+
+static inline int64_t redblack_tree_unzigzag(uint64_t v)
+{
+	return (int64_t) ((v >> 1) ^ -(v & 1));
+}
+
 static inline int is_leaf(redblack_tree_node *n)
 {
 	redblack_tree_assert(n);
@@ -188,4 +490,180 @@ static inline redblack_tree_node * successor(redblack_tree_node *n)
 	return n;
 }
 
+// in-order neighbours, NULL past either end
+static inline redblack_tree_node * redblack_tree_next(redblack_tree_node *n)
+{
+	if (n->right)
+		return successor(n);
+	while (n->parent && n == n->parent->right)
+		n = n->parent;
+	return n->parent;
+}
+
+static inline redblack_tree_node * redblack_tree_prev(redblack_tree_node *n)
+{
+	if (n->left) {
+		n = n->left;
+		while (n->right)
+			n = n->right;
+		return n;
+	}
+	while (n->parent && n == n->parent->left)
+		n = n->parent;
+	return n->parent;
+}
+
+/*
+** t->leftmost and t->rightmost: a new node is the new minimum exactly
+** when it hangs left of the old one, and a node on its way out passes
+** the role to its in-order neighbour, whose identity rotations keep.
+*/
+static inline void redblack_tree_track_insert(redblack_tree *t,
+					      redblack_tree_node *n)
+{
+	if (!n->parent)
+		t->leftmost = t->rightmost = n;
+	else if (n == n->parent->left && n->parent == t->leftmost)
+		t->leftmost = n;
+	else if (n == n->parent->right && n->parent == t->rightmost)
+		t->rightmost = n;
+}
+
+// n has at most one child, a whole subtree in a relaxed tree; the
+// next node of a relayout pass moves on the same way
+static inline void redblack_tree_track_remove(redblack_tree *t,
+					      redblack_tree_node *n)
+{
+	if (t->layout && n == t->layout->next)
+		t->layout->next = redblack_tree_next(n);
+	if (t->clock && n == t->clock->hand)
+		t->clock->hand = redblack_tree_next(n);
+	if (n == t->leftmost)
+		t->leftmost = redblack_tree_next(n);
+	if (n == t->rightmost)
+		t->rightmost = redblack_tree_prev(n);
+}
+
+// after the tree was relinked wholesale
+static inline void redblack_tree_track_rebuild(redblack_tree *t)
+{
+	redblack_tree_node *n = t->root;
+
+	t->leftmost = t->rightmost = n;
+	if (!n)
+		return;
+	while (t->leftmost->left)
+		t->leftmost = t->leftmost->left;
+	while (t->rightmost->right)
+		t->rightmost = t->rightmost->right;
+}
+
+/*
+** rbt_serialize.c : link n nodes, supplied in order by next(), into a
+** balanced subtree at *root. 0 if next() failed, leaving the nodes
+** linked so far at *root for the caller to free.
+*/
+int redblack_tree_build_balanced(redblack_tree *t,
+				 uint64_t n,
+				 redblack_tree_node * (*next)(void *context),
+				 void *context,
+				 redblack_tree_node **root);
+
+// hand an item from codec->load_item that no node holds back to its owner
+static inline void redblack_tree_codec_release(const redblack_tree_codec *codec,
+					       void *item)
+{
+	if (codec->free_item)
+		codec->free_item(item);
+}
+
+/*
+** rbt_wavl.c : rebalance a weak AVL tree after x was linked in as a leaf
+** of rank 0, or after z lost the node on its left or right side.
+*/
+void redblack_tree_wavl_insert_repair(redblack_tree *t, redblack_tree_node *x);
+void redblack_tree_wavl_remove_repair(redblack_tree *t,
+				      redblack_tree_node *z,
+				      int left);
+
+/*
+** rbt_trace.c : append one record to t->trace.
+*/
+void redblack_tree_trace_record_op(redblack_tree *t,
+				   redblack_tree_trace_op op,
+				   void *item,
+				   int result);
+
+/*
+** rbt_hash.c : keep the hash index in step with the nodes. The caller
+** checks t->hash_item first.
+*/
+void redblack_tree_hash_insert(redblack_tree *t, redblack_tree_node *node);
+void redblack_tree_hash_remove(redblack_tree *t, redblack_tree_node *node);
+// the item of from now lives in to
+void redblack_tree_hash_move(redblack_tree *t,
+			     redblack_tree_node *from,
+			     redblack_tree_node *to);
+redblack_tree_node * redblack_tree_hash_find(redblack_tree *t, void *item);
+void redblack_tree_hash_rebuild(redblack_tree *t);
+// free the table but keep the index enabled, for an empty tree
+void redblack_tree_hash_clear(redblack_tree *t);
+
+/*
+** rbt_tombstone.c : lazy removal, used when t->tombstone_percent is set.
+** redblack_tree_bury only turns node into a tombstone.
+*/
+int redblack_tree_remove_lazy(redblack_tree *t, void *item);
+void redblack_tree_remove_lazy_node(redblack_tree *t, redblack_tree_node *node);
+void redblack_tree_bury(redblack_tree *t, redblack_tree_node *node);
+void redblack_tree_revive(redblack_tree *t, redblack_tree_node *node, void *item);
+
+/*
+** rbt_remove.c : unlink node, live or a tombstone, repair and free it.
+*/
+void redblack_tree_remove_found(redblack_tree *t, redblack_tree_node *node);
+
+/*
+** Red-black backend paths used to merge the write buffer.
+** redblack_tree_insert_hinted links node, whose item must be greater
+** than that of *finger, then points *finger at the node holding it.
+*/
+int redblack_tree_insert_hinted(redblack_tree *t,
+				redblack_tree_node *node,
+				redblack_tree_node **finger);
+int redblack_tree_remove_item(redblack_tree *t, void *item);
+
+/*
+** rbt_buffer.c : the write buffer, used when t->buffer is set.
+** redblack_tree_buffer_find returns 1 if the buffer decides the find.
+*/
+int redblack_tree_buffer_insert(redblack_tree *t, void *item);
+int redblack_tree_buffer_remove(redblack_tree *t, void *item);
+int redblack_tree_buffer_find(redblack_tree *t,
+			      void *item,
+			      redblack_tree_node **node);
+// free the pending writes and the buffer
+void redblack_tree_buffer_drop(redblack_tree *t);
+
+/*
+** rbt_btree.c : the B+-tree backend, used when t->btree_key is set.
+*/
+int redblack_btree_insert(redblack_tree *t, void *item);
+int redblack_btree_remove(redblack_tree *t, void *item);
+redblack_tree_node * redblack_btree_find(redblack_tree *t, void *item);
+redblack_tree_node * redblack_btree_extreme(redblack_tree *t, int max);
+void redblack_btree_destroy(redblack_tree *t);
+void redblack_btree_in_order(redblack_tree *t,
+			     void (*visitor)(redblack_tree_node *node, void *context, uint64_t level),
+			     void *context);
+uint64_t redblack_btree_height(redblack_tree *t);
+// the smallest item, and the one after leaf->items[*pos]; NULL past the end
+redblack_tree_node * redblack_btree_first(redblack_tree *t, void **leaf, uint32_t *pos);
+redblack_tree_node * redblack_btree_next(void **leaf, uint32_t *pos);
+// free the items of the detached B+-tree at *root, up to *budget of them
+// (less what was spent); *root is NULL once all of it is gone
+void redblack_btree_reclaim(void **root,
+			    void (*free_node)(redblack_tree_node * ),
+			    uint64_t *budget);
+
 #endif // __RBT_UTIL_H__
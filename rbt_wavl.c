@@ -0,0 +1,217 @@
+/*
+** rbt_wavl.c : weak AVL (rank-balanced) repair
+** Copyright (C) 2018  Tim Whisonant
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#include "rbt.h"
+#include "rbt_util.h"
+
+/*
+** Weak AVL trees (Haeupler, Sen and Tarjan, "Rank-Balanced Trees").
+** Every node keeps an integer rank in its color field, NULL has rank -1.
+** The rank difference of a child is the rank of its parent minus its
+** own, and must be 1 or 2; leaves have rank 0. Without removes the tree
+** is an AVL tree. Insert repairs with promotions and at most two
+** rotations; remove with demotions and at most two rotations, and both
+** take O(1) amortized rank changes.
+*/
+
+int redblack_tree_set_balance(redblack_tree *t, redblack_tree_balance balance)
+{
+	// merge pending writes, an empty tree may still hold tombstones
+	redblack_tree_compact(t);
+
+	if (t->count || t->btree_key || t->relaxed || t->arena)
+		return 0;
+
+	if (balance != RBT_BALANCE_REDBLACK && balance != RBT_BALANCE_WAVL)
+		return 0;
+
+	t->balance = balance;
+	return 1;
+}
+
+static inline void promote(redblack_tree_node *n)
+{
+	++n->color;
+}
+
+static inline void demote(redblack_tree_node *n)
+{
+	--n->color;
+}
+
+/*
+** x has just become a 0-child by being inserted as a leaf or promoted.
+**
+** Promote: the parent is 0,1 - raise its rank and continue above.
+**
+** Rotate: the parent z is 0,2. With y the inner child of x:
+**
+**        z              x                 z               y
+**       / \            / \               / \            /   \
+**      x   s   ==>    a   z             x   s   ==>    x     z
+**     / \                / \           / \            / \   / \
+**    a   y              y   s         a   y          a   b c   s
+**                                        / \
+**                                       b   c
+**
+** single rotation when y is missing or a 2-child, z is demoted; double
+** rotation otherwise, y is promoted, x and z are demoted.
+*/
+void redblack_tree_wavl_insert_repair(redblack_tree *t, redblack_tree_node *x)
+{
+	redblack_tree_node *z;
+	redblack_tree_node *s;
+	redblack_tree_node *y;
+	int left;
+
+	while ((z = x->parent) && z->color == x->color) {
+		left = x == z->left;
+		s = left ? z->right : z->left;
+
+		if (z->color - redblack_tree_rank(s) == 1) {
+			redblack_tree_stat(t, insert_cases[2]);
+			promote(z);
+			x = z;
+			continue;
+		}
+
+		y = left ? x->right : x->left;
+
+		if (x->color - redblack_tree_rank(y) == 2) {
+			redblack_tree_stat(t, insert_cases[3]);
+			if (left)
+				redblack_tree_ror(t, z);
+			else
+				redblack_tree_rol(t, z);
+			demote(z);
+		} else {
+			redblack_tree_stat(t, insert_cases[4]);
+			if (left) {
+				redblack_tree_rol(t, x);
+				redblack_tree_ror(t, z);
+			} else {
+				redblack_tree_ror(t, x);
+				redblack_tree_rol(t, z);
+			}
+			promote(y);
+			demote(x);
+			demote(z);
+		}
+		return;
+	}
+
+	redblack_tree_stat(t, insert_cases[z ? 1 : 0]);
+}
+
+/*
+** z has just lost a node on the left (left != 0) or right side, whose
+** place now holds x, possibly NULL.
+**
+** A leaf left with rank 1 is 2,2 and is demoted first. While x is then a
+** 3-child, with y its sibling:
+**
+** Demote: y is a 2-child - lower the rank of z, and continue above.
+**
+** Demote twice: y is a 1-child and 2,2 - lower the ranks of z and y.
+**
+** Rotate: otherwise, with v the inner and w the outer child of y (x on
+** the left):
+**
+**        z                 y                 z                 v
+**       / \               / \               / \              /   \
+**      x   y     ==>     z   w             x   y     ==>    z     y
+**         / \           / \                   / \          / \   / \
+**        v   w         x   v                 v   w        x   a b   w
+**                                           / \
+**                                          a   b
+**
+** single rotation when w is a 1-child: y is promoted and z demoted, twice
+** if it became a leaf; double rotation otherwise: v is promoted twice, y
+** demoted once and z twice.
+*/
+void redblack_tree_wavl_remove_repair(redblack_tree *t,
+				      redblack_tree_node *z,
+				      int left)
+{
+	redblack_tree_node *x;
+	redblack_tree_node *y;
+	redblack_tree_node *v;
+	redblack_tree_node *w;
+
+	if (!z) {
+		redblack_tree_stat(t, remove_cases[0]);
+		return;
+	}
+
+	if (!z->left && !z->right && z->color == 1) {
+		redblack_tree_stat(t, remove_cases[1]);
+		demote(z);
+		x = z;
+		z = x->parent;
+		left = z && x == z->left;
+	} else
+		x = left ? z->left : z->right;
+
+	while (z && z->color - redblack_tree_rank(x) == 3) {
+		y = left ? z->right : z->left;
+
+		if (z->color - y->color == 2) {
+			redblack_tree_stat(t, remove_cases[2]);
+			demote(z);
+		} else if (y->color - redblack_tree_rank(y->left) == 2 &&
+			   y->color - redblack_tree_rank(y->right) == 2) {
+			redblack_tree_stat(t, remove_cases[3]);
+			demote(z);
+			demote(y);
+		} else {
+			v = left ? y->left : y->right;
+			w = left ? y->right : y->left;
+
+			if (y->color - redblack_tree_rank(w) == 1) {
+				redblack_tree_stat(t, remove_cases[4]);
+				if (left)
+					redblack_tree_rol(t, z);
+				else
+					redblack_tree_ror(t, z);
+				promote(y);
+				demote(z);
+				if (!z->left && !z->right)
+					demote(z);
+			} else {
+				redblack_tree_stat(t, remove_cases[5]);
+				if (left) {
+					redblack_tree_ror(t, y);
+					redblack_tree_rol(t, z);
+				} else {
+					redblack_tree_rol(t, y);
+					redblack_tree_ror(t, z);
+				}
+				promote(v);
+				promote(v);
+				demote(y);
+				demote(z);
+				demote(z);
+			}
+			return;
+		}
+
+		x = z;
+		z = x->parent;
+		left = z && x == z->left;
+	}
+}
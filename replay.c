@@ -0,0 +1,593 @@
+/*
+** replay.c : replay an operation trace against a Red-Black Tree
+** Copyright (C) 2018  Tim Whisonant
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rbt.h"
+
+/*
+** Usage: replay [-r rounds] [-S] [-H] [-B | -W] [-T threads [-M]] trace
+**        replay -N items [-F finds] [-S] [-H] [-B | -W]
+**
+** Reads a trace recorded with redblack_tree_trace_start, then re-runs
+** its inserts, finds and removes against a fresh tree for each round.
+** Reports throughput, per-operation latency percentiles and how many
+** results differ from the recorded ones.
+**
+** With -N, builds a tree of that many items instead, keys spread over
+** the whole int64_t range, and reports the resident memory per item and
+** the latency of random finds at that size - e.g. -N 1000000000 for a
+** billion items, which takes some 64 GB with malloc'd nodes.
+**
+**   -r rounds  replay the trace this many times (default 1)
+**   -S         print the library operation counters (RBT_STATS builds)
+**   -H         also print the library's own latency histograms
+**   -B         use the B+-tree backend
+**   -W         rebalance as a weak AVL tree instead of a red-black tree
+**   -T threads deal the records round-robin to this many threads, which
+**              share the tree through the flat-combining front end;
+**              only throughput is reported
+**   -M         with -T, share the tree behind a plain mutex instead
+**   -N items   run the scale scenario with this many items
+**   -F finds   random finds timed by the scale scenario (default 1000000)
+*/
+
+redblack_tree_node * replay_allocate_node(void *item)
+{
+	redblack_tree_node *node = (redblack_tree_node *)
+				calloc(1, sizeof(redblack_tree_node));
+	if (node)
+		node->item = item;
+
+	return node;
+}
+
+void replay_free_node(redblack_tree_node *node)
+{
+	free(node);
+}
+
+redblack_queue_entry * replay_allocate_entry(redblack_tree_node *node)
+{
+	redblack_queue_entry *entry = (redblack_queue_entry *)
+				malloc(sizeof(redblack_queue_entry));
+	if (entry)
+		entry->node = node;
+
+	return entry;
+}
+
+void replay_free_entry(redblack_queue_entry *entry)
+{
+	free(entry);
+}
+
+int64_t replay_key(void *item)
+{
+	return (int64_t) item;
+}
+
+int64_t replay_compare(void *a, void *b)
+{
+	int64_t ia = (int64_t) a;
+	int64_t ib = (int64_t) b;
+	return (ia > ib) - (ia < ib);
+}
+
+typedef struct _replay_latencies {
+	const char *name;
+	uint64_t *ns;
+	size_t num;
+} replay_latencies;
+
+static uint64_t replay_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int replay_compare_ns(const void *a, const void *b)
+{
+	uint64_t ia = *(const uint64_t *) a;
+	uint64_t ib = *(const uint64_t *) b;
+	return (ia > ib) - (ia < ib);
+}
+
+static void replay_print_histogram(redblack_tree *t, int op, const char *name)
+{
+	uint64_t counts[RBT_LATENCY_BUCKETS];
+	int i;
+
+	if (!redblack_tree_get_latency(t, op, counts))
+		return;
+
+	printf("%s:", name);
+	for (i = 0 ; i < RBT_LATENCY_BUCKETS - 1 ; ++i)
+		if (counts[i])
+			printf(" <%lu ns %lu", 2ul << i, (unsigned long) counts[i]);
+	// 2 << 63 does not fit
+	if (counts[i])
+		printf(" >=%lu ns %lu", 1ul << i, (unsigned long) counts[i]);
+	printf("\n");
+}
+
+static void replay_print_histograms(redblack_tree *t)
+{
+	replay_print_histogram(t, RBT_TRACE_INSERT, "insert");
+	replay_print_histogram(t, RBT_TRACE_FIND, "find");
+	replay_print_histogram(t, RBT_TRACE_REMOVE, "remove");
+}
+
+static void replay_print_latencies(replay_latencies *l)
+{
+	if (!l->num)
+		return;
+
+	qsort(l->ns, l->num, sizeof(uint64_t), replay_compare_ns);
+
+	printf("%-8s %12zu ops  p50 %8lu ns  p99 %8lu ns  max %10lu ns\n",
+	       l->name, l->num,
+	       (unsigned long) l->ns[l->num / 2],
+	       (unsigned long) l->ns[l->num * 99 / 100],
+	       (unsigned long) l->ns[l->num - 1]);
+}
+
+// resident set size, 0 where /proc is not available
+static uint64_t replay_resident_bytes(void)
+{
+	unsigned long size;
+	unsigned long resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+
+	if (!f)
+		return 0;
+	if (fscanf(f, "%lu %lu", &size, &resident) != 2)
+		resident = 0;
+	fclose(f);
+	return (uint64_t) resident * (uint64_t) sysconf(_SC_PAGESIZE);
+}
+
+// distinct for every i < 2^64, spread over the whole int64_t range
+static int64_t replay_scale_key(uint64_t i)
+{
+	return (int64_t) (i * 0x9e3779b97f4a7c15ull);
+}
+
+static uint64_t replay_random(uint64_t *state)
+{
+	uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+	return z ^ (z >> 31);
+}
+
+static int replay_scale(uint64_t items, uint64_t finds, int btree, int wavl,
+			int print_stats, int histograms)
+{
+	redblack_tree t;
+	redblack_tree_report report;
+	redblack_tree_stats stats;
+	replay_latencies latency;
+	uint64_t resident;
+	uint64_t state = 1;
+	uint64_t misses = 0;
+	uint64_t start;
+	uint64_t ns;
+	uint64_t i;
+
+	redblack_tree_init(&t,
+			   replay_allocate_node,
+			   replay_free_node,
+			   replay_compare,
+			   replay_allocate_entry,
+			   replay_free_entry);
+
+	if (btree)
+		redblack_tree_set_backend(&t, RBT_BACKEND_BTREE, replay_key);
+	else if (wavl)
+		redblack_tree_set_balance(&t, RBT_BALANCE_WAVL);
+
+	latency.name = "find";
+	latency.num = 0;
+	latency.ns = (uint64_t *) malloc((finds + 1) * sizeof(uint64_t));
+	if (!latency.ns ||
+	    (histograms && !redblack_tree_set_latency_histograms(&t, 1))) {
+		fprintf(stderr, "replay: out of memory\n");
+		return 1;
+	}
+
+	resident = replay_resident_bytes();
+	start = replay_now();
+	for (i = 0 ; i < items ; ++i) {
+		if (!redblack_tree_insert(&t, (void *) replay_scale_key(i))) {
+			fprintf(stderr, "replay: insert %lu failed\n", (unsigned long) i);
+			return 1;
+		}
+	}
+	ns = replay_now() - start;
+	resident = replay_resident_bytes() - resident;
+
+	printf("%lu items inserted in %.3f s, %.0f inserts/s\n",
+	       (unsigned long) redblack_tree_num_items(&t), ns / 1e9,
+	       ns ? items / (ns / 1e9) : 0.0);
+
+	if (!btree) {
+		redblack_tree_analyze(&t, &report);
+		printf("height %lu, mean depth %.2f, %lu bytes per node, ~%lu allocated\n",
+		       (unsigned long) report.height, report.avg_depth,
+		       (unsigned long) report.node_bytes,
+		       (unsigned long) report.alloc_bytes);
+	} else
+		printf("height %lu\n", (unsigned long) redblack_tree_height(&t));
+	if (items)
+		printf("%.1f bytes resident per item\n", resident / (double) items);
+
+	if (print_stats)
+		redblack_tree_reset_stats(&t);
+
+	for (i = 0 ; i < finds && items ; ++i) {
+		void *item = (void *) replay_scale_key(replay_random(&state) % items);
+
+		start = replay_now();
+		if (!redblack_tree_find(&t, item))
+			++misses;
+		latency.ns[latency.num++] = replay_now() - start;
+	}
+	replay_print_latencies(&latency);
+	if (misses)
+		printf("%lu finds missed\n", (unsigned long) misses);
+
+	if (print_stats) {
+		if (redblack_tree_get_stats(&t, &stats))
+			printf("find compares %.2f, max depth %lu\n",
+			       stats.finds ? stats.compares / (double) stats.finds : 0.0,
+			       (unsigned long) stats.max_depth);
+		else
+			printf("operation counters not compiled in (RBT_STATS)\n");
+	}
+	if (histograms)
+		replay_print_histograms(&t);
+
+	redblack_tree_destroy(&t);
+	free(latency.ns);
+	return misses != 0;
+}
+
+typedef struct _replay_worker {
+	redblack_tree *t;
+	redblack_tree_fc *fc;   // NULL when sharing through lock
+	pthread_mutex_t *lock;
+	redblack_tree_trace_record *records;
+	size_t num_records;
+	int index;
+	int threads;
+} replay_worker;
+
+static void * replay_worker_run(void *context)
+{
+	replay_worker *w = (replay_worker *) context;
+	int slot = w->fc ? redblack_tree_fc_register(w->fc) : -1;
+	size_t i;
+
+	for (i = w->index ; i < w->num_records ; i += w->threads) {
+		void *item = (void *) w->records[i].key;
+
+		if (w->fc) {
+			switch (w->records[i].op) {
+			case RBT_TRACE_INSERT:
+				redblack_tree_fc_insert(w->fc, slot, item);
+				break;
+			case RBT_TRACE_FIND:
+				redblack_tree_fc_find(w->fc, slot, item);
+				break;
+			case RBT_TRACE_REMOVE:
+				redblack_tree_fc_remove(w->fc, slot, item);
+				break;
+			}
+			continue;
+		}
+
+		pthread_mutex_lock(w->lock);
+		switch (w->records[i].op) {
+		case RBT_TRACE_INSERT:
+			redblack_tree_insert(w->t, item);
+			break;
+		case RBT_TRACE_FIND:
+			redblack_tree_find(w->t, item);
+			break;
+		case RBT_TRACE_REMOVE:
+			redblack_tree_remove(w->t, item);
+			break;
+		}
+		pthread_mutex_unlock(w->lock);
+	}
+
+	return NULL;
+}
+
+// one round of the trace on threads threads, in ns of wall time
+static uint64_t replay_concurrent(redblack_tree *t,
+				  redblack_tree_trace_record *records,
+				  size_t num_records,
+				  int threads,
+				  int mutex,
+				  uint64_t *combines,
+				  uint64_t *combined)
+{
+	pthread_t *tids = (pthread_t *) malloc(threads * sizeof(pthread_t));
+	replay_worker *workers = (replay_worker *) malloc(threads * sizeof(replay_worker));
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	redblack_tree_fc fc;
+	uint64_t start;
+	uint64_t ns;
+	int i;
+
+	if (!tids || !workers || (!mutex && !redblack_tree_fc_init(&fc, t, threads))) {
+		fprintf(stderr, "replay: out of memory\n");
+		exit(1);
+	}
+
+	start = replay_now();
+	for (i = 0 ; i < threads ; ++i) {
+		workers[i].t = t;
+		workers[i].fc = mutex ? NULL : &fc;
+		workers[i].lock = &lock;
+		workers[i].records = records;
+		workers[i].num_records = num_records;
+		workers[i].index = i;
+		workers[i].threads = threads;
+		pthread_create(&tids[i], NULL, replay_worker_run, &workers[i]);
+	}
+	for (i = 0 ; i < threads ; ++i)
+		pthread_join(tids[i], NULL);
+	ns = replay_now() - start;
+
+	if (!mutex) {
+		*combines += fc.combines;
+		*combined += fc.combined;
+		redblack_tree_fc_destroy(&fc);
+	}
+
+	free(tids);
+	free(workers);
+	return ns;
+}
+
+int main(int argc, char *argv[])
+{
+	redblack_tree_trace trace;
+	redblack_tree_trace_record *records = NULL;
+	redblack_tree_trace_record record;
+	redblack_tree_stats stats;
+	replay_latencies latencies[4];
+	size_t num_records = 0;
+	size_t capacity = 0;
+	size_t mismatches = 0;
+	uint64_t elapsed = 0;
+	int print_stats = 0;
+	int histograms = 0;
+	uint64_t combines = 0;
+	uint64_t combined = 0;
+	int btree = 0;
+	int wavl = 0;
+	int threads = 0;
+	int mutex = 0;
+	uint64_t scale = 0;
+	uint64_t finds = 1000000;
+	int rounds = 1;
+	int round;
+	size_t i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "r:SHBWT:MN:F:")) != -1) {
+		switch (opt) {
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		case 'S':
+			print_stats = 1;
+			break;
+		case 'H':
+			histograms = 1;
+			break;
+		case 'B':
+			btree = 1;
+			break;
+		case 'W':
+			wavl = 1;
+			break;
+		case 'T':
+			threads = atoi(optarg);
+			break;
+		case 'M':
+			mutex = 1;
+			break;
+		case 'N':
+			scale = strtoull(optarg, NULL, 0);
+			break;
+		case 'F':
+			finds = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-r rounds] [-S] [-H] [-B | -W] [-T threads [-M]] trace\n"
+					"       %s -N items [-F finds] [-S] [-H] [-B | -W]\n", argv[0], argv[0]);
+			return 1;
+		}
+	}
+
+	if (scale)
+		return replay_scale(scale, finds, btree, wavl, print_stats, histograms);
+
+	if (optind >= argc || rounds < 1 || threads < 0) {
+		fprintf(stderr, "usage: %s [-r rounds] [-S] [-H] [-B | -W] [-T threads [-M]] trace\n"
+				"       %s -N items [-F finds] [-S] [-H] [-B | -W]\n", argv[0], argv[0]);
+		return 1;
+	}
+
+	if (!redblack_tree_trace_open(&trace, argv[optind])) {
+		fprintf(stderr, "%s: can't read trace %s\n", argv[0], argv[optind]);
+		return 1;
+	}
+
+	// load the whole trace first, so that file I/O is not measured
+	while (redblack_tree_trace_next(&trace, &record)) {
+		if (num_records == capacity) {
+			capacity = capacity ? 2 * capacity : 4096;
+			records = (redblack_tree_trace_record *)
+				realloc(records, capacity * sizeof(*records));
+			if (!records) {
+				fprintf(stderr, "%s: out of memory\n", argv[0]);
+				return 1;
+			}
+		}
+		records[num_records++] = record;
+	}
+	redblack_tree_trace_close(&trace);
+
+	memset(latencies, 0, sizeof(latencies));
+	latencies[RBT_TRACE_INSERT].name = "insert";
+	latencies[RBT_TRACE_FIND].name = "find";
+	latencies[RBT_TRACE_REMOVE].name = "remove";
+	if (num_records > (SIZE_MAX / sizeof(uint64_t) - 1) / rounds) {
+		fprintf(stderr, "%s: out of memory\n", argv[0]);
+		return 1;
+	}
+	for (i = RBT_TRACE_INSERT ; i <= RBT_TRACE_REMOVE ; ++i) {
+		latencies[i].ns = (uint64_t *)
+			malloc((num_records * rounds + 1) * sizeof(uint64_t));
+		if (!latencies[i].ns) {
+			fprintf(stderr, "%s: out of memory\n", argv[0]);
+			return 1;
+		}
+	}
+
+	for (round = 0 ; round < rounds ; ++round) {
+		redblack_tree t;
+
+		redblack_tree_init(&t,
+				   replay_allocate_node,
+				   replay_free_node,
+				   replay_compare,
+				   replay_allocate_entry,
+				   replay_free_entry);
+
+		if (btree)
+			redblack_tree_set_backend(&t, RBT_BACKEND_BTREE, replay_key);
+		else if (wavl)
+			redblack_tree_set_balance(&t, RBT_BALANCE_WAVL);
+
+		if (histograms && round == rounds - 1 &&
+		    !redblack_tree_set_latency_histograms(&t, 1)) {
+			fprintf(stderr, "%s: out of memory\n", argv[0]);
+			return 1;
+		}
+
+		if (threads) {
+			elapsed += replay_concurrent(&t, records, num_records, threads,
+						     mutex, &combines, &combined);
+			if (histograms && round == rounds - 1)
+				replay_print_histograms(&t);
+			redblack_tree_destroy(&t);
+			continue;
+		}
+
+		for (i = 0 ; i < num_records ; ++i) {
+			void *item = (void *) records[i].key;
+			uint64_t start;
+			uint64_t ns;
+			int result = 0;
+
+			start = replay_now();
+			switch (records[i].op) {
+			case RBT_TRACE_INSERT:
+				result = redblack_tree_insert(&t, item);
+				break;
+			case RBT_TRACE_FIND:
+				result = redblack_tree_find(&t, item) != NULL;
+				break;
+			case RBT_TRACE_REMOVE:
+				result = redblack_tree_remove(&t, item);
+				break;
+			default:
+				continue;
+			}
+			ns = replay_now() - start;
+
+			elapsed += ns;
+			latencies[records[i].op].ns[latencies[records[i].op].num++] = ns;
+			if (result != records[i].result)
+				++mismatches;
+		}
+
+		if (print_stats && round == rounds - 1) {
+			if (redblack_tree_get_stats(&t, &stats)) {
+				printf("compares %lu rotations %lu allocations %lu frees %lu max depth %lu\n",
+				       (unsigned long) stats.compares,
+				       (unsigned long) stats.rotations,
+				       (unsigned long) stats.allocations,
+				       (unsigned long) stats.frees,
+				       (unsigned long) stats.max_depth);
+				printf("mean depth %.2f\n",
+				       stats.inserts + stats.removes + stats.finds ?
+				       stats.descent_depth / (double) (stats.inserts +
+				       stats.removes + stats.finds) : 0.0);
+			} else
+				printf("operation counters not compiled in (RBT_STATS)\n");
+		}
+
+		if (histograms && round == rounds - 1)
+			replay_print_histograms(&t);
+
+		redblack_tree_destroy(&t);
+	}
+
+	if (threads) {
+		printf("%zu records, %d round(s), %d threads (%s), %.3f s, %.0f ops/s\n",
+		       num_records, rounds, threads,
+		       mutex ? "mutex" : "flat combining", elapsed / 1e9,
+		       elapsed ? (num_records * (double) rounds) / (elapsed / 1e9) : 0.0);
+		if (combines)
+			printf("%.2f requests per combining pass\n",
+			       combined / (double) combines);
+		for (i = RBT_TRACE_INSERT ; i <= RBT_TRACE_REMOVE ; ++i)
+			free(latencies[i].ns);
+		free(records);
+		return 0;
+	}
+
+	printf("%zu records, %d round(s), %.3f s, %.0f ops/s, %zu mismatched results\n",
+	       num_records, rounds, elapsed / 1e9,
+	       elapsed ? (num_records * (double) rounds) / (elapsed / 1e9) : 0.0,
+	       mismatches);
+
+	for (i = RBT_TRACE_INSERT ; i <= RBT_TRACE_REMOVE ; ++i) {
+		replay_print_latencies(&latencies[i]);
+		free(latencies[i].ns);
+	}
+
+	free(records);
+	return 0;
+}